@@ -0,0 +1,439 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet microbenchmarks
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * Microbenchmarks for the primitives on the message path: the send queue,
+ * the framing and parsing of protocol commands and the proxy's receive ring,
+ * and round trips through the client over loopback TCP, unix sockets and
+ * shared memory.
+ *
+ * Results can be written in a machine-readable form with the usual
+ * Google Benchmark options, e.g.
+ *
+ *    ./nsdnet_benchmark --benchmark_out=bench.json --benchmark_out_format=json
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "boost/locking_queue.hpp"
+#include "playernsd_client.h"
+#include "nsdnet_interface.h"
+#include "dev_nsdnet.h"
+
+extern "C" void nsdnet_putmsg(nsdnet_t *device, player_msghdr_t *header, uint8_t *data);
+
+/** Maximum number of producer threads to measure the send queue with. */
+#define BENCHMARK_MAX_PRODUCERS 8
+
+/**
+ * Push/pop through the send queue.
+ * Thread 0 is the consumer (the writer thread), the remaining threads are
+ * producers (the driver threads queueing messages).
+ */
+static void BM_LockingQueue(benchmark::State& state)
+{
+   static boost::locking_queue<std::string> *queue;
+   const int producers = state.threads() - 1;
+   if (state.thread_index() == 0)
+      queue = new boost::locking_queue<std::string>();
+   std::string msg = PlayerNSDClient::FrameBinary("node1", 64, std::string(64, 'x').data());
+
+   for (auto _ : state)
+   {
+      if (state.thread_index() == 0)
+      {
+         for (int i = 0; i < producers; i++)
+            benchmark::DoNotOptimize(queue->pop(true));
+      }
+      else
+         queue->push(msg);
+   }
+
+   if (state.thread_index() == 0)
+   {
+      state.SetItemsProcessed(state.iterations() * producers);
+      state.counters["producers"] = producers;
+      delete queue;
+   }
+}
+BENCHMARK(BM_LockingQueue)->DenseThreadRange(2, BENCHMARK_MAX_PRODUCERS + 1)->UseRealTime();
+
+/**
+ * Push/pop through the priority send queue, with the same thread layout
+ * as BM_LockingQueue.
+ */
+static void BM_SendQueue(benchmark::State& state)
+{
+   static PlayerNSDSendQueue *queue;
+   const int producers = state.threads() - 1;
+   if (state.thread_index() == 0)
+      queue = new PlayerNSDSendQueue();
+   std::string msg = PlayerNSDClient::FrameBinary("node1", 64, std::string(64, 'x').data());
+
+   for (auto _ : state)
+   {
+      if (state.thread_index() == 0)
+      {
+         std::string frame;
+         for (int i = 0; i < producers; i++)
+            queue->Pop(frame);
+         benchmark::DoNotOptimize(frame.data());
+      }
+      else
+         queue->Push(msg, PlayerNSDSendQueue::PriorityBulk);
+   }
+
+   if (state.thread_index() == 0)
+   {
+      state.SetItemsProcessed(state.iterations() * producers);
+      state.counters["producers"] = producers;
+      delete queue;
+   }
+}
+BENCHMARK(BM_SendQueue)->DenseThreadRange(2, BENCHMARK_MAX_PRODUCERS + 1)->UseRealTime();
+
+/**
+ * Building a msgbin frame of a given payload size.
+ */
+static void BM_FrameBinary(benchmark::State& state)
+{
+   std::string payload(state.range(0), 'x');
+   for (auto _ : state)
+      benchmark::DoNotOptimize(PlayerNSDClient::FrameBinary("node1", payload.size(), payload.data()));
+   state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(BM_FrameBinary)->RangeMultiplier(8)->Range(16, 1 << 20);
+
+/**
+ * Building a msgtext frame of a given payload size.
+ */
+static void BM_FrameText(benchmark::State& state)
+{
+   std::string payload(state.range(0), 'x');
+   for (auto _ : state)
+      benchmark::DoNotOptimize(PlayerNSDClient::FrameText("node1", payload));
+   state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(BM_FrameText)->RangeMultiplier(8)->Range(16, 1 << 20);
+
+/**
+ * Tokenising a command line as the reader does for every frame.
+ */
+static void BM_Tokenise(benchmark::State& state)
+{
+   std::string command("msgbin node12 4096");
+   for (auto _ : state)
+   {
+      std::vector<std::string> tokens;
+      PlayerNSDClient::Tokenise(command, tokens);
+      benchmark::DoNotOptimize(tokens.data());
+   }
+   state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Tokenise);
+
+/**
+ * Parsing a msgbin frame out of a stream buffer the way the reader does:
+ * getline for the header, tokenise, convert the length and read the payload.
+ */
+static void BM_ParseFrameBinary(benchmark::State& state)
+{
+   std::string payload(state.range(0), 'x');
+   std::string frame = PlayerNSDClient::FrameBinary("node1", payload.size(), payload.data());
+   std::vector<char> message(payload.size());
+   boost::asio::streambuf response;
+   for (auto _ : state)
+   {
+      std::ostream(&response).write(frame.data(), frame.size());
+      std::istream response_stream(&response);
+      std::string command;
+      std::getline(response_stream, command);
+      std::vector<std::string> tokens;
+      PlayerNSDClient::Tokenise(command, tokens);
+      std::size_t length = boost::lexical_cast<size_t>(tokens[2]);
+      response_stream.read(&message[0], length);
+      benchmark::DoNotOptimize(message.data());
+   }
+   state.SetBytesProcessed(state.iterations() * frame.size());
+}
+BENCHMARK(BM_ParseFrameBinary)->RangeMultiplier(8)->Range(16, 1 << 20);
+
+/**
+ * Inserting a received message into the proxy's ring (and taking it out
+ * again so the ring never overflows).
+ */
+static void BM_PutMsg(benchmark::State& state)
+{
+   nsdnet_t *device = (nsdnet_t *) calloc(1, sizeof(nsdnet_t));
+   // No event descriptor (nsdnet_create opens one), just the ring; 0 would
+   // be standard input.
+   device->event_fd = device->event_wfd = -1;
+   std::string payload(state.range(0), 'x');
+   player_msghdr_t header;
+   memset(&header, 0, sizeof(header));
+   header.type = PLAYER_MSGTYPE_DATA;
+   header.subtype = PLAYER_NSDNET_DATA_RECV;
+   header.size = sizeof(player_nsdnet_recv_data_t);
+   player_nsdnet_recv_data_t data;
+   memset(&data, 0, sizeof(data));
+   strcpy(data.clientid, "node1");
+   data.msg_count = payload.size();
+   data.msg = &payload[0];
+
+   for (auto _ : state)
+   {
+      nsdmsg_t *msg;
+      nsdnet_putmsg(device, &header, (uint8_t *) &data);
+      nsdnet_receive_message(device, &msg);
+      free(msg->msg);
+   }
+   state.SetBytesProcessed(state.iterations() * payload.size());
+   free(device);
+}
+BENCHMARK(BM_PutMsg)->RangeMultiplier(8)->Range(16, 1 << 20);
+
+/**
+ * A stand-in daemon for one client: greets and registers it, then sends
+ * every binary message straight back, switching to shared memory if asked.
+ */
+class EchoDaemon
+{
+   public:
+      /**
+       * Starts the daemon listening.
+       * \param path The unix socket path to listen on, empty for loopback TCP.
+       */
+      EchoDaemon(const std::string& path) : path(path)
+      {
+         if (path.empty())
+         {
+            tcpAcceptor.reset(new tcp::acceptor(ioService, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)));
+            host = "127.0.0.1";
+            port = boost::lexical_cast<std::string>(tcpAcceptor->local_endpoint().port());
+         }
+         else
+         {
+            unlink(path.c_str());
+            unixAcceptor.reset(new boost::asio::local::stream_protocol::acceptor(ioService,
+               boost::asio::local::stream_protocol::endpoint(path)));
+            host = PLAYERNSD_UNIX_PREFIX + path;
+         }
+         thread = boost::thread(&EchoDaemon::run, this);
+      }
+
+      std::string host, port;
+
+   private:
+      void run()
+      {
+         PlayerNSDStream socket(ioService);
+         if (tcpAcceptor)
+         {
+            tcp::socket accepted(ioService);
+            tcpAcceptor->accept(accepted);
+            accepted.set_option(tcp::no_delay(true));
+            socket.GetSocket().assign(boost::asio::generic::stream_protocol(AF_INET, IPPROTO_TCP),
+               accepted.release());
+         }
+         else
+         {
+            boost::asio::local::stream_protocol::socket accepted(ioService);
+            unixAcceptor->accept(accepted);
+            socket.GetSocket().assign(boost::asio::generic::stream_protocol(AF_UNIX, 0),
+               accepted.release());
+         }
+         serve(socket);
+      }
+
+      void serve(PlayerNSDStream& socket)
+      {
+         boost::system::error_code error;
+         boost::asio::streambuf buffer;
+         std::istream stream(&buffer);
+         std::string line;
+         boost::asio::write(socket, boost::asio::buffer(std::string("greetings daemon playernsd "
+            PLAYERNSD_PROTOCOL_VERSION " " PLAYERNSD_FEATURE_SHM "\n")));
+         boost::asio::read_until(socket, buffer, '\n', error);
+         std::getline(stream, line);
+         boost::asio::write(socket, boost::asio::buffer(std::string("registered\n")));
+         std::vector<char> payload;
+         while (!error)
+         {
+            boost::asio::read_until(socket, buffer, '\n', error);
+            if (error)
+               break;
+            std::getline(stream, line);
+            std::vector<std::string> tokens;
+            PlayerNSDClient::Tokenise(line, tokens);
+            if (tokens.size() == 3 && tokens[0] == "shmattach" && socket.AttachSharedMemory(tokens[1]))
+            {
+               boost::asio::write(socket, boost::asio::buffer(std::string("shmready\n")));
+               socket.UseSharedMemoryForWrites();
+               socket.UseSharedMemoryForReads();
+               continue;
+            }
+            if (tokens.size() != 3 || tokens[0] != "msgbin")
+               continue;
+            std::size_t length = boost::lexical_cast<std::size_t>(tokens[2]);
+            if (buffer.size() < length)
+               boost::asio::read(socket, buffer, boost::asio::transfer_at_least(length - buffer.size()), error);
+            payload.resize(length);
+            stream.read(&payload[0], length);
+            std::vector<boost::asio::const_buffer> frame;
+            std::string header = "msgbin daemon " + tokens[2] + "\n";
+            frame.push_back(boost::asio::buffer(header));
+            frame.push_back(boost::asio::buffer(payload));
+            boost::asio::write(socket, frame, error);
+         }
+      }
+
+      std::string path;
+      boost::asio::io_service ioService;
+      boost::scoped_ptr<tcp::acceptor> tcpAcceptor;
+      boost::scoped_ptr<boost::asio::local::stream_protocol::acceptor> unixAcceptor;
+      boost::thread thread;
+};
+
+/**
+ * A client handler that registers and signals each message received.
+ */
+class EchoHandler : public PlayerNSDClient::Handler
+{
+   public:
+      EchoHandler() : client(NULL), received(0) {}
+
+      /** Waits until the count of received messages reaches a value. */
+      void Wait(uint64_t count)
+      {
+         boost::unique_lock<boost::mutex> lock(mutex);
+         while (received < count)
+            cond.wait(lock);
+      }
+
+      virtual void ErrorRaised(PlayerNSDClient::ServerError err, const std::string& message) {}
+      virtual void Receive(const std::string& source, const std::string& data) {}
+      virtual void Receive(const std::string& source, int len, const char *data)
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         received++;
+         cond.notify_one();
+      }
+      virtual void ReceiveChunk(const std::string& source, uint32_t total, uint32_t offset,
+         int len, const char *data) {}
+      virtual void ReceiveTopic(const std::string& source, const std::string& topic,
+         int len, const char *data) {}
+      virtual void ClientListResponse(const std::vector<std::string>& clientList) {}
+      virtual void PropertyValue(const std::string& variable, const std::string& value) {}
+      virtual void PropertyChanged(const std::string& variable, const std::string& value) {}
+      virtual void TickReached(uint32_t tick) {}
+      virtual void StateChanged(PlayerNSDClient::ConnectionState state)
+      {
+         if (state == PlayerNSDClient::StateGreeting)
+            client->Register("bench");
+      }
+
+      PlayerNSDClient *client;
+
+   private:
+      boost::mutex mutex;
+      boost::condition_variable cond;
+      uint64_t received;
+};
+
+/**
+ * Returns the CPU time used by the whole process (all threads) in seconds.
+ */
+static double processCPUTime()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Round trip of a binary message through the client, its writer and reader
+ * threads and a daemon on the given transport.
+ * The connection is set up once and kept for the whole run (the client
+ * cannot be torn down cleanly while its threads are blocked).
+ */
+static void roundTrip(benchmark::State& state, const std::string& path, bool shm = false)
+{
+   static std::map<std::string, std::pair<EchoHandler *, PlayerNSDClient *> > connections;
+   std::pair<EchoHandler *, PlayerNSDClient *>& connection = connections[path];
+   static std::map<std::string, uint64_t> sent;
+   if (!connection.second)
+   {
+      EchoDaemon *daemon = new EchoDaemon(path);
+      connection.first = new EchoHandler();
+      connection.second = new PlayerNSDClient(*connection.first);
+      connection.first->client = connection.second;
+      if (shm)
+         connection.second->SetSharedMemory(1 << 20);
+      if (!connection.second->Connect(daemon->host, daemon->port))
+      {
+         state.SkipWithError("Unable to connect");
+         return;
+      }
+      while (connection.second->GetConnectionState() != PlayerNSDClient::StateRegistered)
+         boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+   }
+   std::string payload(state.range(0), 'x');
+   double start = processCPUTime();
+   for (auto _ : state)
+   {
+      connection.second->Send("daemon", payload.size(), payload.data());
+      connection.first->Wait(++sent[path]);
+   }
+   state.SetBytesProcessed(state.iterations() * payload.size() * 2);
+   state.counters["cpu_us_per_rtt"] = benchmark::Counter(
+      (processCPUTime() - start) * 1e6 / state.iterations());
+}
+
+static void BM_RoundTripTCP(benchmark::State& state)
+{
+   roundTrip(state, "");
+}
+BENCHMARK(BM_RoundTripTCP)->RangeMultiplier(16)->Range(16, 1 << 16)->UseRealTime();
+
+static void BM_RoundTripUnix(benchmark::State& state)
+{
+   roundTrip(state, "/tmp/nsdnet_benchmark.sock");
+}
+BENCHMARK(BM_RoundTripUnix)->RangeMultiplier(16)->Range(16, 1 << 16)->UseRealTime();
+
+static void BM_RoundTripShm(benchmark::State& state)
+{
+   roundTrip(state, "/tmp/nsdnet_benchmark_shm.sock", true);
+}
+BENCHMARK(BM_RoundTripShm)->RangeMultiplier(16)->Range(16, 1 << 16)->UseRealTime();
+
+BENCHMARK_MAIN();
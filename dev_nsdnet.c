@@ -25,6 +25,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#if !defined (WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined (__linux__)
+#include <sys/eventfd.h>
+#endif
 #include <libplayerc/playerc.h>
 #include <libplayercommon/playercommon.h>
 
@@ -33,6 +41,14 @@
 #include "dev_nsdnet.h"
 
 void nsdnet_putmsg(nsdnet_t *device, player_msghdr_t *header, uint8_t *data);
+static void nsdnet_enqueue(nsdnet_t *device, const char *clientid, const char *topic,
+	int msg_count, char *msg);
+static void nsdnet_putchunk(nsdnet_t *device, player_msghdr_t *header,
+	player_nsdnet_recv_chunk_data_t *chunk);
+static void nsdnet_putpropchange(nsdnet_t *device, player_nsdnet_propchanged_data_t *data);
+static char *nsdnet_pack(const char **strings, int count, uint32_t *size);
+static void nsdnet_event_open(nsdnet_t *device);
+static void nsdnet_event_update(nsdnet_t *device);
 
 /**
  * Create a device.
@@ -46,6 +62,7 @@ nsdnet_t *nsdnet_create(playerc_client_t *client, int index)
 	memset(device, 0, sizeof (nsdnet_t));
 	playerc_device_init(&device->info, client, PLAYER_NSDNET_CODE,
 		index, (playerc_putmsg_fn_t) nsdnet_putmsg);
+	nsdnet_event_open(device);
 
 	return device;
 }
@@ -55,9 +72,27 @@ nsdnet_t *nsdnet_create(playerc_client_t *client, int index)
  */
 void nsdnet_destroy (nsdnet_t *device)
 {
+	int i;
 	playerc_device_term (&device->info);
 	if (device->listclients)
 		free (device->listclients);
+	if (device->clientlist)
+		player_nsdnet_clientlist_req_t_free (device->clientlist);
+	if (device->props_reply)
+		player_nsdnet_propget_multi_req_t_free (device->props_reply);
+	if (device->props)
+		free (device->props);
+	for (i = 0; i < MAX_PROPCHANGES; i++)
+		if (device->propchanges[i].value)
+			free (device->propchanges[i].value);
+	if (device->partial.msg)
+		free (device->partial.msg);
+#if !defined (WIN32)
+	if (device->event_wfd >= 0 && device->event_wfd != device->event_fd)
+		close (device->event_wfd);
+	if (device->event_fd >= 0)
+		close (device->event_fd);
+#endif
 	free (device);
 }
 
@@ -89,18 +124,33 @@ void nsdnet_putmsg (nsdnet_t *device, player_msghdr_t *header, uint8_t *data)
 		if (header->subtype == PLAYER_NSDNET_DATA_RECV)
 		{
 			player_nsdnet_recv_data_t *recv_data = (player_nsdnet_recv_data_t *) data;
-			/* TODO: Detect overflow. */
-			nsdmsg_t *m = device->queue + (device->queue_head % MAX_MESSAGES);
-			if (device->queue_head - device->queue_tail >= MAX_MESSAGES) {
-				printf("message overflow!");
-				device->queue_tail++;
-			}
-			m->timestamp = time(NULL);
-			strncpy(m->clientid, recv_data->clientid, CLIENTID_LEN - 1);
-			m->msg_count = recv_data->msg_count;
-			m->msg = malloc(m->msg_count);
-			memcpy(m->msg, recv_data->msg, m->msg_count);
-			device->queue_head++;
+			char *msg = malloc(recv_data->msg_count);
+			memcpy(msg, recv_data->msg, recv_data->msg_count);
+			nsdnet_enqueue(device, recv_data->clientid, NULL, recv_data->msg_count, msg);
+		}
+		else if (header->subtype == PLAYER_NSDNET_DATA_RECV_TOPIC)
+		{
+			player_nsdnet_recv_topic_data_t *topic_data = (player_nsdnet_recv_topic_data_t *) data;
+			char *msg = malloc(topic_data->msg_count);
+			memcpy(msg, topic_data->msg, topic_data->msg_count);
+			nsdnet_enqueue(device, topic_data->clientid, topic_data->topic,
+				topic_data->msg_count, msg);
+		}
+		else if (header->subtype == PLAYER_NSDNET_DATA_RECV_BEGIN ||
+			header->subtype == PLAYER_NSDNET_DATA_RECV_CONTINUE ||
+			header->subtype == PLAYER_NSDNET_DATA_RECV_END)
+		{
+			nsdnet_putchunk(device, header, (player_nsdnet_recv_chunk_data_t *) data);
+		}
+		else if (header->subtype == PLAYER_NSDNET_DATA_PROPCHANGED)
+		{
+			nsdnet_putpropchange(device, (player_nsdnet_propchanged_data_t *) data);
+		}
+		else if (header->subtype == PLAYER_NSDNET_DATA_TICK)
+		{
+			/* Every message of the tick has been received before this. */
+			device->tick = ((player_nsdnet_tick_data_t *) data)->tick;
+			device->ticked = 1;
 		}
 		else if (header->subtype == PLAYER_NSDNET_DATA_ERROR)
 		{
@@ -117,6 +167,165 @@ void nsdnet_putmsg (nsdnet_t *device, player_msghdr_t *header, uint8_t *data)
 	}
 }
 
+/**
+ * Append a received message to the queue, taking ownership of msg, unless
+ * the callback takes it.
+ */
+static void nsdnet_enqueue(nsdnet_t *device, const char *clientid, const char *topic,
+	int msg_count, char *msg)
+{
+	nsdmsg_t *m;
+	if (device->received)
+	{
+		nsdmsg_t received;
+		received.timestamp = time(NULL);
+		strncpy(received.clientid, clientid, CLIENTID_LEN - 1);
+		received.clientid[CLIENTID_LEN - 1] = '\0';
+		received.msg_count = msg_count;
+		received.msg = msg;
+		received.topic[0] = '\0';
+		if (topic)
+			strncpy(received.topic, topic, TOPIC_LEN - 1);
+		received.topic[TOPIC_LEN - 1] = '\0';
+		if (device->received(device, &received))
+		{
+			free(msg);
+			return;
+		}
+	}
+	/* TODO: Detect overflow. */
+	m = device->queue + (device->queue_head % MAX_MESSAGES);
+	if (device->queue_head - device->queue_tail >= MAX_MESSAGES) {
+		printf("message overflow!");
+		device->queue_tail++;
+	}
+	m->timestamp = time(NULL);
+	strncpy(m->clientid, clientid, CLIENTID_LEN - 1);
+	m->msg_count = msg_count;
+	m->msg = msg;
+	m->topic[0] = '\0';
+	if (topic)
+		strncpy(m->topic, topic, TOPIC_LEN - 1);
+	device->queue_head++;
+	nsdnet_event_update(device);
+}
+
+/**
+ * Create the descriptor readable while messages are queued: an eventfd, or
+ * a pipe where there is none.
+ */
+static void nsdnet_event_open(nsdnet_t *device)
+{
+	device->event_fd = device->event_wfd = -1;
+#if defined (__linux__)
+	device->event_fd = device->event_wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif !defined (WIN32)
+	{
+		int fds[2];
+		if (pipe(fds) == 0)
+		{
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			fcntl(fds[1], F_SETFL, O_NONBLOCK);
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+			device->event_fd = fds[0];
+			device->event_wfd = fds[1];
+		}
+	}
+#endif
+}
+
+/**
+ * Make the descriptor readable if messages are queued, and clear it once
+ * they are all taken.  It only changes when the queue fills or empties.
+ */
+static void nsdnet_event_update(nsdnet_t *device)
+{
+#if !defined (WIN32)
+	int pending = device->queue_head != device->queue_tail;
+	if (device->event_fd < 0 || pending == device->event_pending)
+		return;
+	if (pending)
+	{
+		uint64_t one = 1;
+		/* A full pipe or counter is readable already. */
+		if (write(device->event_wfd, &one, device->event_wfd == device->event_fd ?
+			sizeof(one) : 1) < 0 && errno != EAGAIN)
+			return;
+	}
+	else
+	{
+		uint64_t count;
+		while (read(device->event_fd, &count, sizeof(count)) > 0 &&
+			device->event_wfd != device->event_fd)
+			;
+	}
+	device->event_pending = pending;
+#endif
+}
+
+/**
+ * Queue a change of a watched property, and pass it to the callback.
+ */
+static void nsdnet_putpropchange(nsdnet_t *device, player_nsdnet_propchanged_data_t *data)
+{
+	nsdpropchange_t *c = device->propchanges + (device->propchanges_head % MAX_PROPCHANGES);
+	if (device->propchanges_head - device->propchanges_tail >= MAX_PROPCHANGES)
+		device->propchanges_tail++;
+	if (c->value)
+		free(c->value);
+	c->timestamp = time(NULL);
+	strncpy(c->key, data->key, KEY_LEN - 1);
+	c->key[KEY_LEN - 1] = '\0';
+	c->value = malloc(data->value_count + 1);
+	memcpy(c->value, data->value, data->value_count);
+	c->value[data->value_count] = '\0';
+	device->propchanges_head++;
+	if (device->propchanged)
+		device->propchanged(device, c);
+}
+
+/**
+ * Reassemble a large message from its chunks, queueing it once complete.
+ * The driver sends the chunks of one message in order before the next.
+ */
+static void nsdnet_putchunk(nsdnet_t *device, player_msghdr_t *header,
+	player_nsdnet_recv_chunk_data_t *chunk)
+{
+	nsdmsg_t *p = &device->partial;
+	if (header->subtype == PLAYER_NSDNET_DATA_RECV_BEGIN)
+	{
+		if (p->msg)
+		{
+			printf("dropping incomplete message from %s\n", p->clientid);
+			free(p->msg);
+		}
+		strncpy(p->clientid, chunk->clientid, CLIENTID_LEN - 1);
+		p->msg_count = chunk->total;
+		p->msg = malloc(chunk->total);
+		device->partial_count = 0;
+	}
+	if (!p->msg || chunk->offset != device->partial_count ||
+		chunk->offset + chunk->msg_count > (uint32_t) p->msg_count)
+	{
+		printf("skipping out of sequence chunk from %s\n", chunk->clientid);
+		return;
+	}
+	memcpy(p->msg + chunk->offset, chunk->msg, chunk->msg_count);
+	device->partial_count += chunk->msg_count;
+	if (header->subtype == PLAYER_NSDNET_DATA_RECV_END)
+	{
+		if (device->partial_count == (uint32_t) p->msg_count)
+			nsdnet_enqueue(device, p->clientid, NULL, p->msg_count, p->msg);
+		else
+		{
+			printf("dropping incomplete message from %s\n", p->clientid);
+			free(p->msg);
+		}
+		p->msg = NULL;
+	}
+}
+
 /**
  * Request a list of clients connected.
  */
@@ -139,20 +348,171 @@ int nsdnet_get_listclients(nsdnet_t *device)
 	return 0;
 }
 
+/**
+ * Request a page of the compact list of clients.
+ */
+int nsdnet_get_clientlist(nsdnet_t *device, uint32_t first, uint32_t limit)
+{
+	int result = 0;
+	uint32_t i;
+	player_nsdnet_clientlist_req_t req, *resp;
+
+	memset(&req, 0, sizeof(req));
+	/* Only the page held can be reported unchanged. */
+	if (device->clientlist && device->clientlist_first == first &&
+		device->clientlist_limit == limit)
+		req.generation = device->clientlist->generation;
+	req.first = first;
+	req.limit = limit;
+	if ((result = playerc_client_request(device->info.client,
+		&device->info, PLAYER_NSDNET_REQ_CLIENTLIST, &req,
+		(void **)&resp)) < 0)
+		return result;
+
+	if (req.generation && resp->generation == req.generation)
+	{
+		device->clientlist->total = resp->total;
+		player_nsdnet_clientlist_req_t_free(resp);
+		return 0;
+	}
+	/* The ids are used where they are, so check they are terminated. */
+	if (resp->offsets_count && (!resp->names_count || resp->names[resp->names_count - 1]))
+	{
+		player_nsdnet_clientlist_req_t_free(resp);
+		return -1;
+	}
+	for (i = 0; i < resp->offsets_count; i++)
+		if (resp->offsets[i] >= resp->names_count)
+		{
+			player_nsdnet_clientlist_req_t_free(resp);
+			return -1;
+		}
+	if (device->clientlist)
+		player_nsdnet_clientlist_req_t_free(device->clientlist);
+	device->clientlist = resp;
+	device->clientlist_first = first;
+	device->clientlist_limit = limit;
+	return 1;
+}
+
+/**
+ * Get the number of clients in the page of the list held.
+ */
+int nsdnet_clientlist_count(nsdnet_t *device)
+{
+	return device->clientlist ? (int) device->clientlist->offsets_count : 0;
+}
+
+/**
+ * Get the number of clients in the whole list.
+ */
+int nsdnet_clientlist_total(nsdnet_t *device)
+{
+	return device->clientlist ? (int) device->clientlist->total : 0;
+}
+
+/**
+ * Get a client id in the page of the list held.
+ */
+const char *nsdnet_clientlist_id(nsdnet_t *device, int i)
+{
+	if (!device->clientlist || i < 0 || (uint32_t) i >= device->clientlist->offsets_count)
+		return NULL;
+	return device->clientlist->names + device->clientlist->offsets[i];
+}
+
 /**
  * Send a message to a target client id.
  */
 int nsdnet_send_message(nsdnet_t *device, const char *target, int len, char *message)
+{
+	return nsdnet_send_message_type(device, target, 0, len, message);
+}
+
+/**
+ * Send a message of a given type to a target client id.
+ */
+int nsdnet_send_message_type(nsdnet_t *device, const char *target, char type, int len, char *message)
 {
 	player_nsdnet_send_req_t req;
 	memset(&req, 0, sizeof(req));
 	if (target)
 		strncpy(req.clientid, target, sizeof(req.clientid) - 1);
+	req.type = type;
 	req.msg_count = len;
 	req.msg = message;
 	return playerc_client_request(device->info.client, &device->info, PLAYER_NSDNET_REQ_SEND, &req, NULL);
 }
 
+/**
+ * Send a message to a group of clients.
+ */
+int nsdnet_send_group(nsdnet_t *device, const char *group, const char **targets,
+	int count, char type, int len, char *message)
+{
+	int i, result;
+	player_nsdnet_send_group_req_t req;
+	memset(&req, 0, sizeof(req));
+	if (group)
+		strncpy(req.group, group, sizeof(req.group) - 1);
+	req.type = type;
+	req.targets_count = count * PLAYER_NSDNET_CLIENTID_LEN;
+	req.targets = calloc(count ? count : 1, PLAYER_NSDNET_CLIENTID_LEN);
+	for (i = 0; i < count; i++)
+		strncpy(req.targets + i * PLAYER_NSDNET_CLIENTID_LEN, targets[i], PLAYER_NSDNET_CLIENTID_LEN - 1);
+	req.msg_count = len;
+	req.msg = message;
+	result = playerc_client_request(device->info.client, &device->info,
+		PLAYER_NSDNET_REQ_SEND_GROUP, &req, NULL);
+	free(req.targets);
+	return result;
+}
+
+/**
+ * Publish a message on a topic.
+ */
+int nsdnet_publish(nsdnet_t *device, const char *topic, char type, int len, char *message)
+{
+	player_nsdnet_publish_req_t req;
+	memset(&req, 0, sizeof(req));
+	strncpy(req.topic, topic, sizeof(req.topic) - 1);
+	req.type = type;
+	req.msg_count = len;
+	req.msg = message;
+	return playerc_client_request(device->info.client, &device->info, PLAYER_NSDNET_REQ_PUBLISH, &req, NULL);
+}
+
+/**
+ * Broadcast a message to the clients within range.
+ */
+int nsdnet_send_range(nsdnet_t *device, double radius, char type, int len, char *message)
+{
+	player_nsdnet_send_range_req_t req;
+	memset(&req, 0, sizeof(req));
+	req.radius = radius;
+	req.type = type;
+	req.msg_count = len;
+	req.msg = message;
+	return playerc_client_request(device->info.client, &device->info, PLAYER_NSDNET_REQ_SEND_RANGE, &req, NULL);
+}
+
+/**
+ * Set the topics to receive messages on.
+ */
+int nsdnet_set_topics(nsdnet_t *device, const char **topics, int count)
+{
+	int i, result;
+	player_nsdnet_subscribe_req_t req;
+	req.topics_count = count * PLAYER_NSDNET_TOPIC_LEN;
+	req.topics = calloc(count ? count : 1, PLAYER_NSDNET_TOPIC_LEN);
+	for (i = 0; i < count; i++)
+		strncpy(req.topics + i * PLAYER_NSDNET_TOPIC_LEN, topics[i], PLAYER_NSDNET_TOPIC_LEN - 1);
+	result = playerc_client_request(device->info.client, &device->info,
+		PLAYER_NSDNET_REQ_SUBSCRIBE, &req, NULL);
+	free(req.topics);
+	return result;
+}
+
 /**
  * Receive a message from the queue (0 on success, otherwise no message to receive).
  */
@@ -164,9 +524,26 @@ int nsdnet_receive_message(nsdnet_t *device, nsdmsg_t **message)
 	if (message)
 		*message = m;
 	device->queue_tail++;
+	nsdnet_event_update(device);
 	return 1;
 }
 
+/**
+ * Get the descriptor readable while messages are queued.
+ */
+int nsdnet_get_fd(nsdnet_t *device)
+{
+	return device->event_fd;
+}
+
+/**
+ * Get the socket of the client.
+ */
+int nsdnet_get_client_fd(nsdnet_t *device)
+{
+	return device->info.client->sock;
+}
+
 /**
  * Get a property value from the device.
  */
@@ -206,3 +583,129 @@ int nsdnet_property_set(nsdnet_t *device, const char *variable, const char *valu
 		PLAYER_NSDNET_REQ_PROPSET, &req, NULL);
 }
 
+/**
+ * Pack NUL terminated strings back to back.
+ */
+static char *nsdnet_pack(const char **strings, int count, uint32_t *size)
+{
+	int i;
+	char *packed, *p;
+	*size = 0;
+	for (i = 0; i < count; i++)
+		*size += strlen(strings[i]) + 1;
+	p = packed = malloc(*size ? *size : 1);
+	for (i = 0; i < count; i++)
+	{
+		strcpy(p, strings[i]);
+		p += strlen(strings[i]) + 1;
+	}
+	return packed;
+}
+
+/**
+ * Get the values of several properties.
+ */
+int nsdnet_property_get_multi(nsdnet_t *device, const char **keys, int count)
+{
+	int result, i;
+	uint32_t k, v;
+	player_nsdnet_propget_multi_req_t req;
+	player_nsdnet_propget_multi_req_t *resp;
+	memset(&req, 0, sizeof(req));
+	req.keys = nsdnet_pack(keys, count, &req.keys_count);
+	result = playerc_client_request(device->info.client, &device->info,
+		PLAYER_NSDNET_REQ_PROPGET_MULTI, &req, (void **)&resp);
+	free(req.keys);
+	if (result < 0)
+		return result;
+
+	/* The values are used where they are, so check they are terminated. */
+	if (resp->found_count != (uint32_t) count ||
+		(resp->keys_count && resp->keys[resp->keys_count - 1]) ||
+		(resp->values_count && resp->values[resp->values_count - 1]))
+	{
+		player_nsdnet_propget_multi_req_t_free(resp);
+		return -1;
+	}
+	if (device->props_reply)
+		player_nsdnet_propget_multi_req_t_free(device->props_reply);
+	if (device->props)
+		free(device->props);
+	device->props = calloc(count ? count : 1, sizeof(nsdprop_t));
+	device->props_reply = resp;
+	device->props_count = 0;
+	for (i = 0, k = 0, v = 0; i < count && k < resp->keys_count && v < resp->values_count; i++)
+	{
+		device->props[i].key = resp->keys + k;
+		device->props[i].value = resp->values + v;
+		device->props[i].found = resp->found[i];
+		k += strlen(resp->keys + k) + 1;
+		v += strlen(resp->values + v) + 1;
+		device->props_count++;
+	}
+	return 0;
+}
+
+/**
+ * Find the value of a property got with nsdnet_property_get_multi.
+ */
+const char *nsdnet_property_value(nsdnet_t *device, const char *key)
+{
+	int i;
+	for (i = 0; i < device->props_count; i++)
+		if (!strcmp(device->props[i].key, key))
+			return device->props[i].found ? device->props[i].value : NULL;
+	return NULL;
+}
+
+/**
+ * Set several properties.
+ */
+int nsdnet_property_set_multi(nsdnet_t *device, const char **keys, const char **values, int count)
+{
+	int result, i;
+	const char **pairs;
+	player_nsdnet_propset_multi_req_t req;
+	memset(&req, 0, sizeof(req));
+	pairs = malloc((count ? count : 1) * 2 * sizeof(const char *));
+	for (i = 0; i < count; i++)
+	{
+		pairs[2 * i] = keys[i];
+		pairs[2 * i + 1] = values[i];
+	}
+	req.pairs = nsdnet_pack(pairs, 2 * count, &req.pairs_count);
+	free(pairs);
+	result = playerc_client_request(device->info.client, &device->info,
+		PLAYER_NSDNET_REQ_PROPSET_MULTI, &req, NULL);
+	free(req.pairs);
+	return result;
+}
+
+/**
+ * Watch properties for changes.
+ */
+int nsdnet_watch_properties(nsdnet_t *device, const char **keys, int count)
+{
+	int result;
+	player_nsdnet_propwatch_req_t req;
+	memset(&req, 0, sizeof(req));
+	req.keys = nsdnet_pack(keys, count, &req.keys_count);
+	result = playerc_client_request(device->info.client, &device->info,
+		PLAYER_NSDNET_REQ_PROPWATCH, &req, NULL);
+	free(req.keys);
+	return result;
+}
+
+/**
+ * Take a change of a watched property from the queue.
+ */
+int nsdnet_receive_propchange(nsdnet_t *device, nsdpropchange_t **change)
+{
+	nsdpropchange_t *c = device->propchanges + (device->propchanges_tail % MAX_PROPCHANGES);
+	if (device->propchanges_head == device->propchanges_tail)
+		return 0;
+	if (change)
+		*change = c;
+	device->propchanges_tail++;
+	return 1;
+}
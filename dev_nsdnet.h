@@ -51,18 +51,53 @@ extern "C" {
 #define CLIENTID_LEN 64
 typedef char clientid_string_t[CLIENTID_LEN];
 
+#define TOPIC_LEN 64
+
 #define MAX_MESSAGES 16384
 
+#define KEY_LEN 128
+
+#define MAX_PROPCHANGES 1024
+
 typedef struct nsdmsg_s
 {
    time_t timestamp;
    char clientid[CLIENTID_LEN];
    int msg_count;
    char *msg;
+   /** Topic the message was published on, empty if none */
+   char topic[TOPIC_LEN];
 } nsdmsg_t;
 
+/** A property key and value, pointing into the reply they came in */
+typedef struct nsdprop_s
+{
+   const char *key;
+   const char *value;
+   /** Whether the property exists */
+   int found;
+} nsdprop_t;
+
+/** A change of a watched property */
+typedef struct nsdpropchange_s
+{
+   time_t timestamp;
+   char key[KEY_LEN];
+   char *value;
+} nsdpropchange_t;
+
 struct nsdnet_s;
 
+/** Called on each change of a watched property */
+typedef void (*nsdnet_propchanged_fn_t)(struct nsdnet_s *device, const nsdpropchange_t *change);
+
+/**
+ * Called on each message as it is received, from within
+ * playerc_client_read, before it is queued.  Returns nonzero to take the
+ * message, which is then not queued; the message is valid during the call.
+ */
+typedef int (*nsdnet_received_fn_t)(struct nsdnet_s *device, const nsdmsg_t *message);
+
 typedef struct nsdnet_s
 {
 	/** Device info; must be at the start of all device structures. */
@@ -74,13 +109,47 @@ typedef struct nsdnet_s
    /** Count of the list of clients received on request */
    int listclients_count;
 
+   /** Compact list of clients received on request, as decoded */
+   struct player_nsdnet_clientlist_req *clientlist;
+   /** The page of the list held */
+   uint32_t clientlist_first;
+   uint32_t clientlist_limit;
+
    /** Property values requested */
    char *propval;
 
+   /** Property values requested together, pointing into the reply */
+   nsdprop_t *props;
+   int props_count;
+   struct player_nsdnet_propget_multi_req *props_reply;
+
    /** Queue of received messages */
    nsdmsg_t queue[MAX_MESSAGES];
    int queue_head;
    int queue_tail;
+   /** Called on each message as it is received, if set */
+   nsdnet_received_fn_t received;
+
+   /** Readable while messages are queued, see nsdnet_get_fd */
+   int event_fd;
+   /** The end of event_fd written to, event_fd itself unless a pipe */
+   int event_wfd;
+   int event_pending;
+
+   /** Large message being reassembled from its chunks */
+   nsdmsg_t partial;
+   uint32_t partial_count;
+
+   /** Queue of changes of watched properties */
+   nsdpropchange_t propchanges[MAX_PROPCHANGES];
+   int propchanges_head;
+   int propchanges_tail;
+   /** Called on each change as it is queued, if set */
+   nsdnet_propchanged_fn_t propchanged;
+
+   /** The last simulation tick ended, in tick mode, if ticked is set */
+   uint32_t tick;
+   int ticked;
 
    /** Last error message */
    int error_msg_count;
@@ -128,6 +197,39 @@ NSDNET_EXPORT int nsdnet_unsubscribe(nsdnet_t *device);
  */
 NSDNET_EXPORT int nsdnet_get_listclients(nsdnet_t *device);
 
+/**
+ * Requests a page of the list of clients in the compact format, keeping the
+ * reply as received.  The page held is only replaced if the list changed
+ * since it was received.
+ * \param device The nsdnet_t proxy object to request a list of clients from.
+ * \param first The index of the first client wanted.
+ * \param limit The most clients wanted, 0 for all of them.
+ * \return 1 if the list was received, 0 if unchanged, < 0 on error.
+ */
+NSDNET_EXPORT int nsdnet_get_clientlist(nsdnet_t *device, uint32_t first, uint32_t limit);
+
+/**
+ * Gets the number of clients in the page of the list held.
+ * \param device The nsdnet_t proxy object.
+ * \return The number of clients.
+ */
+NSDNET_EXPORT int nsdnet_clientlist_count(nsdnet_t *device);
+
+/**
+ * Gets the number of clients in the whole list.
+ * \param device The nsdnet_t proxy object.
+ * \return The number of clients.
+ */
+NSDNET_EXPORT int nsdnet_clientlist_total(nsdnet_t *device);
+
+/**
+ * Gets a client id in the page of the list held, pointing into the reply.
+ * \param device The nsdnet_t proxy object.
+ * \param i The index of the client in the page.
+ * \return The client id, NULL if out of range.
+ */
+NSDNET_EXPORT const char *nsdnet_clientlist_id(nsdnet_t *device, int i);
+
 /**
  * Sends a command (a message) to a particular client.
  * \param device The nsdnet_t proxy object to send messages.
@@ -138,6 +240,71 @@ NSDNET_EXPORT int nsdnet_get_listclients(nsdnet_t *device);
  */
 NSDNET_EXPORT int nsdnet_send_message(nsdnet_t *device, const char *target, int len, char *message);
 
+/**
+ * Sends a command (a message) of a given type to a particular client.
+ * \param device The nsdnet_t proxy object to send messages.
+ * \param target The target client id to send a message to, NULL to broadcast.
+ * \param type The type of the message, PLAYER_NSDNET_TYPE_CONTROL sends it
+ * ahead of bulk messages.
+ * \param len The length of the message.
+ * \param message The actual message.
+ * \return 0 if successful, anything else is an error.
+ */
+NSDNET_EXPORT int nsdnet_send_message_type(nsdnet_t *device, const char *target, char type,
+	int len, char *message);
+
+/**
+ * Sends a message to a group of clients in one operation.
+ * \param device The nsdnet_t proxy object to send messages.
+ * \param group The name of a group defined by the property
+ * "driver.group.<name>", NULL for none.
+ * \param targets Further target client ids.
+ * \param count The number of further target client ids.
+ * \param type The type of the message, PLAYER_NSDNET_TYPE_CONTROL sends it
+ * ahead of bulk messages.
+ * \param len The length of the message.
+ * \param message The actual message.
+ * \return 0 if successful, anything else is an error.
+ */
+NSDNET_EXPORT int nsdnet_send_group(nsdnet_t *device, const char *group, const char **targets,
+	int count, char type, int len, char *message);
+
+/**
+ * Publishes a message on a topic, to every client subscribed to it.
+ * \param device The nsdnet_t proxy object to send messages.
+ * \param topic The topic to publish on.
+ * \param type The type of the message, PLAYER_NSDNET_TYPE_CONTROL sends it
+ * ahead of bulk messages.
+ * \param len The length of the message.
+ * \param message The actual message.
+ * \return 0 if successful, anything else is an error.
+ */
+NSDNET_EXPORT int nsdnet_publish(nsdnet_t *device, const char *topic, char type,
+	int len, char *message);
+
+/**
+ * Broadcast a message to the clients within range of this one.
+ * \param device The nsdnet_t proxy object to send messages.
+ * \param radius The range in metres.
+ * \param type The type of the message, PLAYER_NSDNET_TYPE_CONTROL sends it
+ * ahead of bulk messages.
+ * \param len The length of the message.
+ * \param message The actual message.
+ * \return 0 if successful, anything else is an error.
+ */
+NSDNET_EXPORT int nsdnet_send_range(nsdnet_t *device, double radius, char type,
+	int len, char *message);
+
+/**
+ * Sets the topics to receive messages on, replacing any earlier ones.
+ * Until this is called messages on every topic are received.
+ * \param device The nsdnet_t proxy object to receive messages.
+ * \param topics The topics, "*" for every topic.
+ * \param count The number of topics.
+ * \return 0 if successful, anything else is an error.
+ */
+NSDNET_EXPORT int nsdnet_set_topics(nsdnet_t *device, const char **topics, int count);
+
 /**
  * Receives a command (a message) from a particular client.
  * \param device The nsdnet_t proxy object to receive messages from.
@@ -146,6 +313,24 @@ NSDNET_EXPORT int nsdnet_send_message(nsdnet_t *device, const char *target, int
  */
 NSDNET_EXPORT int nsdnet_receive_message(nsdnet_t *device, nsdmsg_t **message);
 
+/**
+ * Gets a descriptor that is readable while messages are queued, to wait on
+ * with select or poll alongside other descriptors.  Messages are queued as
+ * the client reads them: when the client is read by this thread, wait on
+ * nsdnet_get_client_fd as well, and read the client when it is readable.
+ * \param device The nsdnet_t proxy object.
+ * \return The descriptor, -1 if it could not be created.
+ */
+NSDNET_EXPORT int nsdnet_get_fd(nsdnet_t *device);
+
+/**
+ * Gets the socket of the client the proxy belongs to, readable when there
+ * is something to be read with playerc_client_read.
+ * \param device The nsdnet_t proxy object.
+ * \return The socket.
+ */
+NSDNET_EXPORT int nsdnet_get_client_fd(nsdnet_t *device);
+
 /**
  * Get a property value from the device.
  * \param device The nsdnet_t proxy object to get a property from.
@@ -162,6 +347,56 @@ NSDNET_EXPORT int nsdnet_property_get(nsdnet_t *device, const char *variable);
  * \return 0 if successful, anything else is an error.
  */
 NSDNET_EXPORT int nsdnet_property_set(nsdnet_t *device, const char *variable, const char *value);
+
+/**
+ * Watches properties for changes, replacing any earlier ones.  The current
+ * value of each and every change after are queued, to be taken with
+ * nsdnet_receive_propchange, and passed to device->propchanged if set.
+ * \param device The nsdnet_t proxy object to watch properties with.
+ * \param keys The names of the property variables, or prefixes ending in
+ * "*" if the daemon supports them.
+ * \param count The number of keys, 0 to stop watching.
+ * \return 0 if successful, anything else is an error.
+ */
+NSDNET_EXPORT int nsdnet_watch_properties(nsdnet_t *device, const char **keys, int count);
+
+/**
+ * Takes the oldest change of a watched property from the queue.
+ * \param device The nsdnet_t proxy object.
+ * \param change Set to the change, valid until the queue wraps around.
+ * \return 0 if no changes, anything else means there's a change.
+ */
+NSDNET_EXPORT int nsdnet_receive_propchange(nsdnet_t *device, nsdpropchange_t **change);
+
+/**
+ * Gets the values of several properties in one request, the lookups being
+ * made all at once.  The values are held in device->props, in the order of
+ * the keys, until the next call.
+ * \param device The nsdnet_t proxy object to get the properties from.
+ * \param keys The names of the property variables.
+ * \param count The number of keys.
+ * \return 0 if successful, anything else is an error.
+ */
+NSDNET_EXPORT int nsdnet_property_get_multi(nsdnet_t *device, const char **keys, int count);
+
+/**
+ * Finds the value of a property got with nsdnet_property_get_multi.
+ * \param device The nsdnet_t proxy object.
+ * \param key The name of the property variable.
+ * \return The value, NULL if it was not got or does not exist.
+ */
+NSDNET_EXPORT const char *nsdnet_property_value(nsdnet_t *device, const char *key);
+
+/**
+ * Sets several properties in one request.
+ * \param device The nsdnet_t proxy object to set the properties.
+ * \param keys The names of the property variables.
+ * \param values The values of the property variables.
+ * \param count The number of properties.
+ * \return 0 if successful, anything else is an error.
+ */
+NSDNET_EXPORT int nsdnet_property_set_multi(nsdnet_t *device, const char **keys,
+	const char **values, int count);
 #ifdef __cplusplus
 }
 #endif
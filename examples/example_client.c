@@ -18,11 +18,19 @@
 #include <libplayerc/playerc.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/select.h>
 
 #include "dev_nsdnet.h"
 
 playerxdr_function_t* player_plugininterf_gettable (void);
 
+// Prints each message as it is received, taking it rather than queueing it.
+static int print_message(nsdnet_t *device, const nsdmsg_t *msg)
+{
+	printf("%s: %.*s\n", msg->clientid, msg->msg_count, msg->msg);
+	return 1;
+}
+
 int main(int argc, const char **argv)
 {
 	int i;
@@ -73,7 +81,7 @@ int main(int argc, const char **argv)
 	printf("Client id: %s\n", device->propval);
 
 	// Get the list of clients
-	if (nsdnet_get_listclients(device))
+	if (nsdnet_get_clientlist(device, 0, 0) < 0)
 	{
 		printf("Failed to get list of clients...\n");
 		return -1;
@@ -81,30 +89,25 @@ int main(int argc, const char **argv)
 
 	// Print out what we get...
 	printf("Clients: ");
-	for (i = 0; i < device->listclients_count; i++)
+	for (i = 0; i < nsdnet_clientlist_count(device); i++)
 	{
-		printf("%s ", device->listclients[i]);
+		printf("%s ", nsdnet_clientlist_id(device, i));
 	}
 	printf("\n");
 
-	// Endless loop...
+	// Messages are passed to print_message as the client reads them.
+	device->received = print_message;
+
+	// Endless loop, waiting on the client's socket rather than sleeping...
 	for (i = 0; i < 1000; i++)
 	{
-		if (playerc_client_peek(client, 0) == 1)
+		fd_set fds;
+		struct timeval timeout = { 0, 100000 };
+		FD_ZERO(&fds);
+		FD_SET(nsdnet_get_client_fd(device), &fds);
+		if (select(nsdnet_get_client_fd(device) + 1, &fds, NULL, NULL, &timeout) > 0)
 		{
 			playerc_client_read(client);
-			while (device->queue_head != device->queue_tail)
-			{
-				nsdmsg_t *msg; int err;
-				if ((err = nsdnet_receive_message(device, &msg)))
-				{
-					if (err < 0)
-						printf("ERROR\n");
-					else
-						printf("%s: %s [%d]\n", msg->clientid, msg->msg, i);
-				}
-			}
-			usleep(0);
 		}
 		else
 		{
@@ -114,7 +117,6 @@ int main(int argc, const char **argv)
 				printf("Could not broadcast 'Hello World'\n");
 				return -1;
 			}
-			usleep(100000);
 		}
 	}
 
@@ -10,9 +10,11 @@ import sys
 import time
 import math
 import random
+import select
 import pickle
 from playercpp import *
 from nsdnet import *
+from nsdnet_codec import *
 
 # takes a parameter for the index
 if len(sys.argv) < 2:
@@ -46,6 +48,17 @@ for cid in proxy.GetClientList():
 # some random seed
 random.seed(time.time())
 
+# print each message as soon as the client reads it
+def handle_message(msg):
+  # Positions are read without parsing, anything else is pickled
+  position = PositionMessage.view(msg.message)
+  if position != None:
+    print "%s: position %f %f %f" % (msg.source, position.x, position.y, position.yaw)
+  else:
+    print "%s: %s" % (msg.source, pickle.loads(msg.message))
+
+watcher = MessageWatcher(client, proxy, handle_message)
+
 j = 0
 for i in range(0, 1000):
   # random bot movement every 10
@@ -55,34 +68,21 @@ for i in range(0, 1000):
     #print "Setting speed:", speed, "direction:", direction
     #posproxy.SetSpeed(speed, direction * math.pi / 180.0)
 
-  # Check for messages
-  if (client.Peek()):
-    # Read player client messages
-    client.Read()
-    # Get the current position
+  # Wait up to a tenth of a second for something from the client,
+  # rather than sleeping and checking
+  readable, _, _ = select.select(watcher.filenos(), [], [], 0.1)
+  if readable:
+    # Read player client messages, passing on those received
+    watcher.ready()
+    # Broadcast position, encoded to be read in place
     px = posproxy.GetXPos()
     py = posproxy.GetYPos()
     pyaw = posproxy.GetYaw()
-    # Create a picked tuple of the position
-    pp = pickle.dumps(("position", px, py, pyaw))
-    # Broadcast position
-    proxy.SendMessage(pp)
-    # Anything to receive?
-    while proxy.ReceiveMessageCount() > 0:
-      msg = proxy.ReceiveMessage()
-      if msg != None:
-        # Unpickle the message
-        msgpickle = pickle.loads(msg.message)
-        print "%s: %s [%d]" % (msg.source, msgpickle, i)
-  # Broadcast Hello World
-  time.sleep(0.1)
-  proxy.SendMessage(pickle.dumps(("string", "Hello World " + str(j))))
-  j += 1
-  time.sleep(0.1)
-  proxy.SendMessage(pickle.dumps(("string", "Hello World " + str(j))))
-  j += 1
-  time.sleep(0.1)
-
+    proxy.SendMessage(PositionMessage.encode(x=px, y=py, yaw=pyaw))
+  else:
+    # Broadcast Hello World when quiet
+    proxy.SendMessage(pickle.dumps(("string", "Hello World " + str(j))))
+    j += 1
 
 del proxy
 del posproxy
@@ -30,18 +30,28 @@
 #include <libplayerc++/playerc++.h>
 #include <libplayerinterface/player.h>
 #include "nsdnetproxy.h"
+#include "nsdnet_interface.h"
 
 struct Message
 {
         time_t timestamp;
         std::string source;
+        std::string topic;
         std::string message;
 };
 
+struct PropertyChange
+{
+        time_t timestamp;
+        std::string key;
+        std::string value;
+};
+
 %}
 
 %include "std_string.i"
 %include "std_vector.i"
+%include "std_map.i"
 
 %import "playercpp.i"
 
@@ -67,16 +77,33 @@ struct Message
 namespace std
 {
         %template(StringVector) vector<string>;
+        %template(StringMap) map<string, string>;
 }
 
 struct Message
 {
         time_t timestamp;
         std::string source;
+        std::string topic;
         std::string message;
 };
 
+struct PropertyChange
+{
+        time_t timestamp;
+        std::string key;
+        std::string value;
+};
+
+// Message type flags
+%constant int PLAYER_NSDNET_TYPE_CONTROL = PLAYER_NSDNET_TYPE_CONTROL;
+
 %ignore PlayerCc::NSDNetProxy::ReceiveMessage(time_t& timestamp, std::string& source, std::string& message);
+%ignore PlayerCc::NSDNetProxy::ReceiveMessage(time_t& timestamp, std::string& source, std::string& topic, std::string& message);
+%ignore PlayerCc::NSDNetProxy::ReceiveMessage(time_t& timestamp, std::string& source, std::string& topic, const char*& data, int& len);
+%ignore PlayerCc::NSDNetProxy::ReceivePropertyChange(time_t& timestamp, std::string& variable, std::string& value);
+%ignore PlayerCc::NSDNetProxy::SetMessageCallback;
+%ignore PlayerCc::NSDNetProxy::MessageCallback;
 %include "nsdnetproxy.h"
 
 // Attach a ReceiveMessage function to the Proxy class
@@ -85,9 +112,78 @@ struct Message
         Message *PlayerCc::NSDNetProxy::ReceiveMessage()
         {
                 Message *msg = new Message();
-                if (!self->ReceiveMessage(msg->timestamp, msg->source, msg->message))
+                if (!self->ReceiveMessage(msg->timestamp, msg->source, msg->topic, msg->message))
+                {
+                        delete msg;
                         return 0;
+                }
                 return msg;
         }
+
+        PropertyChange *PlayerCc::NSDNetProxy::ReceivePropertyChange()
+        {
+                PropertyChange *change = new PropertyChange();
+                if (!self->ReceivePropertyChange(change->timestamp, change->key, change->value))
+                {
+                        delete change;
+                        return 0;
+                }
+                return change;
+        }
 }
 %newobject PlayerCc::NSDNetProxy::ReceiveMessage;
+%newobject PlayerCc::NSDNetProxy::ReceivePropertyChange;
+
+%pythoncode %{
+class MessageWatcher(object):
+  """Passes each message a proxy receives to a callback, as soon as it
+  arrives, from select or an asyncio event loop rather than polling:
+
+    watcher = MessageWatcher(client, proxy, handle_message)
+    watcher.attach(asyncio.get_event_loop())
+
+  or, with select, wait for watcher.filenos() to be readable and then call
+  watcher.ready().  Unless threaded is set, because the client is read by
+  a thread of its own (client.StartThread()), the watcher reads the client
+  when its socket is readable.
+  """
+  def __init__(self, client, proxy, callback, threaded=False):
+    self.client = client
+    self.proxy = proxy
+    self.callback = callback
+    self.threaded = threaded
+    if threaded and proxy.GetEventFd() < 0:
+      raise RuntimeError('no descriptor to wait on for a threaded client')
+
+  def filenos(self):
+    """The descriptors to wait on."""
+    fds = []
+    if self.proxy.GetEventFd() >= 0:
+      fds.append(self.proxy.GetEventFd())
+    if not self.threaded:
+      fds.append(self.proxy.GetClientFd())
+    return fds
+
+  def ready(self):
+    """Reads what the client has waiting, then passes on each queued
+    message; returns the number of messages."""
+    if not self.threaded:
+      while self.client.Peek(0):
+        self.client.Read()
+    count = 0
+    while True:
+      msg = self.proxy.ReceiveMessage()
+      if msg is None:
+        return count
+      self.callback(msg)
+      count += 1
+
+  def attach(self, loop):
+    """Calls ready from an asyncio event loop whenever there is something."""
+    for fd in self.filenos():
+      loop.add_reader(fd, self.ready)
+
+  def detach(self, loop):
+    for fd in self.filenos():
+      loop.remove_reader(fd)
+%}
@@ -0,0 +1,287 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet message codec
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * A schema based encoding for the messages robots send each other, read in
+ * place rather than parsed.  A message type is a plain struct of
+ * NSDNetLE fields (little-endian numbers, naturally aligned) and
+ * NSDNetArray fields (variable length arrays and strings), with an enum
+ * CodecType giving its schema id:
+ *
+ * \code
+ * struct StateMessage
+ * {
+ *    enum { CodecType = 2 };
+ *    NSDNetLE<double> x, y, yaw;
+ *    NSDNetLE<uint32_t> battery;
+ *    NSDNetArray<char> task;
+ * };
+ * \endcode
+ *
+ * An encoded message is an NSDNetCodecHeader, the struct itself and then
+ * the elements of its arrays, each starting on an 8 byte boundary.  An
+ * array field holds the offset of its elements from the field and their
+ * count, so a received message is used through a pointer straight into
+ * the receive buffer.  Fields may be added at the end of a struct: the
+ * header records the size of the struct the message was encoded with, and
+ * a reader accepts messages at least as large as its own.
+ *
+ * The layout is that of a C struct on a little-endian host, which is what
+ * nsdnet_codec.py in Python reads through a memoryview.  On big-endian
+ * hosts the fields swap their bytes on access.
+ */
+
+#ifndef _NSDNET_CODEC_H_
+#define _NSDNET_CODEC_H_
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/predef/other/endian.h>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_pod.hpp>
+
+/** First two bytes of every encoded message ("NC"). */
+#define NSDNET_CODEC_MAGIC 0x434e
+/** Alignment of the struct and of each array in an encoded message. */
+#define NSDNET_CODEC_ALIGN 8
+
+/** A number stored little-endian, read and written as a native one. */
+template <typename T>
+struct NSDNetLE
+{
+   operator T() const { return swap(raw); }
+   NSDNetLE& operator=(T value) { raw = swap(value); return *this; }
+
+   static T swap(T value)
+   {
+#if BOOST_ENDIAN_BIG_BYTE
+      unsigned char bytes[sizeof(T)];
+      memcpy(bytes, &value, sizeof(T));
+      for (std::size_t i = 0; i < sizeof(T) / 2; i++)
+      {
+         unsigned char b = bytes[i];
+         bytes[i] = bytes[sizeof(T) - 1 - i];
+         bytes[sizeof(T) - 1 - i] = b;
+      }
+      memcpy(&value, bytes, sizeof(T));
+#endif
+      return value;
+   }
+
+   T raw;
+};
+
+/**
+ * A variable length field: the elements follow the struct, at an offset
+ * from the field itself.
+ */
+template <typename E>
+struct NSDNetArray
+{
+   const E *Data() const
+   {
+      return reinterpret_cast<const E *>(reinterpret_cast<const char *>(this) + offset);
+   }
+   std::size_t Size() const { return count; }
+   bool Empty() const { return count == 0; }
+   const E& operator[](std::size_t i) const { return Data()[i]; }
+   /** Copies out an array of characters. */
+   std::string String() const { return std::string((const char *) Data(), count * sizeof(E)); }
+
+   /**
+    * Checks that the elements lie within a received message, for messages
+    * from senders that are not trusted.
+    * \param data The message.
+    * \param len The length of the message.
+    */
+   bool Within(const char *data, std::size_t len) const
+   {
+      std::size_t start = reinterpret_cast<const char *>(this) - data + offset;
+      return !count || (offset && start <= len && (len - start) / sizeof(E) >= count);
+   }
+
+   NSDNetLE<uint32_t> offset;
+   NSDNetLE<uint32_t> count;
+};
+
+/** The header of an encoded message. */
+struct NSDNetCodecHeader
+{
+   NSDNetLE<uint16_t> magic;
+   /** The CodecType of the message. */
+   NSDNetLE<uint16_t> type;
+   /** The size of the struct the message was encoded with. */
+   NSDNetLE<uint32_t> size;
+};
+
+namespace NSDNetCodec
+{
+   /** Rounds a size up to the codec alignment. */
+   inline std::size_t Align(std::size_t size)
+   {
+      return (size + NSDNET_CODEC_ALIGN - 1) & ~(std::size_t)(NSDNET_CODEC_ALIGN - 1);
+   }
+
+   /**
+    * Gets the type of an encoded message.
+    * \param data The message.
+    * \param len The length of the message.
+    * \param type The CodecType of the message.
+    * \return false if it is not an encoded message.
+    */
+   inline bool TypeOf(const char *data, std::size_t len, uint16_t& type)
+   {
+      if (len < sizeof(NSDNetCodecHeader))
+         return false;
+      NSDNetCodecHeader header;
+      memcpy(&header, data, sizeof(header));
+      if (header.magic != NSDNET_CODEC_MAGIC)
+         return false;
+      type = header.type;
+      return true;
+   }
+
+   /**
+    * Reads a message in place.
+    * \param data The message, 8 byte aligned as malloc and new leave it.
+    * \param len The length of the message.
+    * \return The message, valid as long as data is, or NULL if it is not
+    * a T (or not aligned to be read in place).
+    */
+   template <typename T>
+   const T *View(const char *data, std::size_t len)
+   {
+      BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+      uint16_t type;
+      if (!TypeOf(data, len, type) || type != T::CodecType ||
+         ((std::size_t) data & (NSDNET_CODEC_ALIGN - 1)))
+         return NULL;
+      const NSDNetCodecHeader *header = reinterpret_cast<const NSDNetCodecHeader *>(data);
+      if (header->size < sizeof(T) || len - Align(sizeof(NSDNetCodecHeader)) < header->size)
+         return NULL;
+      return reinterpret_cast<const T *>(data + Align(sizeof(NSDNetCodecHeader)));
+   }
+}
+
+/**
+ * Encodes a message: fill in the fields of Message(), then the arrays with
+ * Set.  The buffer is 8 byte aligned, so it can also be read back in place.
+ */
+template <typename T>
+class NSDNetCodecBuilder
+{
+   public:
+      NSDNetCodecBuilder()
+      {
+         init();
+      }
+
+      /** \param message The fields to start with, of a message without arrays. */
+      NSDNetCodecBuilder(const T& message)
+      {
+         init();
+         memcpy(&Message(), &message, sizeof(T));
+      }
+
+      /** The fields, valid until the next Set. */
+      T& Message()
+      {
+         return *reinterpret_cast<T *>(reinterpret_cast<char *>(&buffer[0]) +
+            Align(sizeof(NSDNetCodecHeader)));
+      }
+
+      /**
+       * Appends the elements of an array field.
+       * \param field The field, e.g. &StateMessage::task.
+       * \param data The elements.
+       * \param count The number of elements.
+       */
+      template <typename E>
+      void Set(NSDNetArray<E> T::*field, const E *data, std::size_t count)
+      {
+         std::size_t start = NSDNetCodec::Align(used);
+         used = start + count * sizeof(E);
+         buffer.resize((NSDNetCodec::Align(used) + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+         char *base = reinterpret_cast<char *>(&buffer[0]);
+         if (count)
+            memcpy(base + start, data, count * sizeof(E));
+         NSDNetArray<E>& array = Message().*field;
+         array.offset = start - (reinterpret_cast<char *>(&array) - base);
+         array.count = count;
+      }
+
+      /** Appends the characters of a string field. */
+      void Set(NSDNetArray<char> T::*field, const std::string& value)
+      {
+         Set(field, value.data(), value.size());
+      }
+
+      const char *Data() const { return reinterpret_cast<const char *>(&buffer[0]); }
+      std::size_t Size() const { return used; }
+      std::string String() const { return std::string(Data(), used); }
+
+   private:
+      static std::size_t Align(std::size_t size) { return NSDNetCodec::Align(size); }
+
+      void init()
+      {
+         BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+         used = Align(sizeof(NSDNetCodecHeader)) + sizeof(T);
+         buffer.assign((Align(used) + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+         NSDNetCodecHeader *header = reinterpret_cast<NSDNetCodecHeader *>(&buffer[0]);
+         header->magic = NSDNET_CODEC_MAGIC;
+         header->type = T::CodecType;
+         header->size = sizeof(T);
+      }
+
+      /** Whole words, so that the buffer is aligned for any field. */
+      std::vector<uint64_t> buffer;
+      std::size_t used;
+};
+
+/** The pose of a robot, broadcast to its neighbours. */
+struct NSDNetPositionMessage
+{
+   enum { CodecType = 1 };
+   NSDNetLE<double> x;
+   NSDNetLE<double> y;
+   NSDNetLE<double> yaw;
+};
+
+/** The pose and velocity of a robot, with its state as free text. */
+struct NSDNetStateMessage
+{
+   enum { CodecType = 2 };
+   NSDNetLE<double> x;
+   NSDNetLE<double> y;
+   NSDNetLE<double> yaw;
+   NSDNetLE<double> vx;
+   NSDNetLE<double> vy;
+   NSDNetLE<double> vyaw;
+   NSDNetArray<char> state;
+};
+
+#endif
@@ -0,0 +1,187 @@
+#
+# \brief nsdnet message codec in python
+# \author Tai Chi Minh Ralph Eastwood
+# \author University of York
+#
+# Reads and writes the messages of nsdnet_codec.h.  A message type lists
+# its fields in the order of the C++ struct, with the struct format
+# character of each number, or Array/String for variable fields:
+#
+#   class StateMessage(Message):
+#     codec_type = 2
+#     fields = (('x', 'd'), ('y', 'd'), ('yaw', 'd'),
+#               ('battery', 'I'), ('task', String))
+#
+#   data = StateMessage.encode(x=1.0, y=2.0, yaw=0.0, battery=80, task=b'explore')
+#   msg = StateMessage.view(data)
+#   print msg.x, msg.task
+#
+# A view reads each field from the message when it is asked for, through a
+# memoryview, so nothing is parsed or copied up front; arrays come back as
+# memoryviews of the numbers where memoryview.cast exists.
+#
+
+import struct
+
+MAGIC = 0x434e
+ALIGN = 8
+HEADER = struct.Struct('<HHI')
+
+
+def _align(size, alignment=ALIGN):
+  return (size + alignment - 1) & ~(alignment - 1)
+
+
+class Array(object):
+  """A variable length field of numbers of one struct format character."""
+  def __init__(self, fmt):
+    self.fmt = fmt
+    self.size = struct.calcsize('<' + fmt)
+
+  def read(self, buf, start, count):
+    view = buf[start:start + count * self.size]
+    if hasattr(view, 'cast') and struct.pack('=H', 1) == struct.pack('<H', 1):
+      return view.cast(self.fmt)
+    return list(struct.unpack_from('<%d%s' % (count, self.fmt), buf, start))
+
+  def pack(self, value):
+    return struct.pack('<%d%s' % (len(value), self.fmt), *value)
+
+
+class _String(Array):
+  """A variable length field of characters, read as bytes."""
+  def __init__(self):
+    Array.__init__(self, 'c')
+
+  def read(self, buf, start, count):
+    return buf[start:start + count].tobytes()
+
+  def pack(self, value):
+    return bytes(value)
+
+String = _String()
+
+_ARRAY = struct.Struct('<II')
+
+
+class _Layout(object):
+  """The offsets of the fields of a message type, as a C compiler lays them out."""
+  def __init__(self, fields):
+    self.fields = {}
+    self.order = []
+    offset = 0
+    largest = 1
+    for name, kind in fields:
+      if isinstance(kind, Array):
+        size, alignment = _ARRAY.size, 4
+      else:
+        size = alignment = struct.calcsize('<' + kind)
+      offset = _align(offset, alignment)
+      self.fields[name] = (offset, kind)
+      self.order.append(name)
+      offset += size
+      largest = max(largest, alignment)
+    self.size = _align(offset, largest)
+
+
+class _View(object):
+  """A received message, read field by field in place."""
+  __slots__ = ('_buf', '_layout', '_base')
+
+  def __init__(self, buf, layout):
+    self._buf = buf
+    self._layout = layout
+    self._base = _align(HEADER.size)
+
+  def __getattr__(self, name):
+    try:
+      offset, kind = self._layout.fields[name]
+    except KeyError:
+      raise AttributeError(name)
+    at = self._base + offset
+    if isinstance(kind, Array):
+      rel, count = _ARRAY.unpack_from(self._buf, at)
+      start = at + rel
+      if count and (not rel or start + count * kind.size > len(self._buf)):
+        raise ValueError('array %s runs past the end of the message' % name)
+      return kind.read(self._buf, start, count)
+    return struct.unpack_from('<' + kind, self._buf, at)[0]
+
+  def __repr__(self):
+    return '(%s)' % ', '.join('%s=%r' % (n, getattr(self, n)) for n in self._layout.order)
+
+
+class _MessageType(type):
+  def __init__(cls, name, bases, namespace):
+    type.__init__(cls, name, bases, namespace)
+    cls._layout = _Layout(cls.fields)
+
+
+Message = _MessageType('Message', (object,), {
+  '__doc__': 'Base of the message types, see the top of this module.',
+  'codec_type': 0,
+  'fields': (),
+})
+
+
+def type_of(data):
+  """Returns the codec type of a message, or None if it was not encoded."""
+  if len(data) < HEADER.size:
+    return None
+  magic, codec_type, size = HEADER.unpack_from(data)
+  if magic != MAGIC:
+    return None
+  return codec_type
+
+
+def _view(cls, data):
+  """Returns the message read in place, or None if it is not of this type."""
+  buf = memoryview(data)
+  if type_of(buf) != cls.codec_type:
+    return None
+  magic, codec_type, size = HEADER.unpack_from(buf)
+  if size < cls._layout.size or len(buf) < _align(HEADER.size) + size:
+    return None
+  return _View(buf, cls._layout)
+
+
+def _encode(cls, **values):
+  """Encodes a message from its fields, by name; missing ones are 0 or empty."""
+  layout = cls._layout
+  base = _align(HEADER.size)
+  fixed = bytearray(base + layout.size)
+  HEADER.pack_into(fixed, 0, MAGIC, cls.codec_type, layout.size)
+  tail = bytearray()
+  for name in layout.order:
+    offset, kind = layout.fields[name]
+    value = values.get(name)
+    at = base + offset
+    if isinstance(kind, Array):
+      packed = kind.pack(value if value is not None else [])
+      start = _align(len(fixed) + len(tail))
+      tail += b'\0' * (start - len(fixed) - len(tail))
+      tail += packed
+      count = len(packed) // kind.size
+      _ARRAY.pack_into(fixed, at, start - at if count else 0, count)
+    else:
+      struct.pack_into('<' + kind, fixed, at, value if value is not None else 0)
+  return bytes(fixed + tail)
+
+
+Message.view = classmethod(_view)
+Message.encode = classmethod(_encode)
+
+
+class PositionMessage(Message):
+  """The pose of a robot, NSDNetPositionMessage in C++."""
+  codec_type = 1
+  fields = (('x', 'd'), ('y', 'd'), ('yaw', 'd'))
+
+
+class StateMessage(Message):
+  """The pose and velocity of a robot with its state, NSDNetStateMessage in C++."""
+  codec_type = 2
+  fields = (('x', 'd'), ('y', 'd'), ('yaw', 'd'),
+            ('vx', 'd'), ('vy', 'd'), ('vyaw', 'd'), ('state', String))
+
+# vim: ai:ts=2:sw=2:sts=2:
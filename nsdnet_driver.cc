@@ -39,9 +39,20 @@
 #include <boost/thread.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <deque>
+#include <map>
+#include <set>
+#include <sstream>
 
 #include "nsdnet_interface.h"
 #include "playernsd_client.h"
+#include "nsdnet_loopback.h"
+#include "nsdnet_shard.h"
+#include "nsdnet_tick.h"
+#include "nsdnet_world_cache.h"
 
 /** Number of threads per driver instance */
 #define NSDNET_THREAD_NUM 128
@@ -51,6 +62,20 @@
 #define MESSAGE_INFO						1
 #define MESSAGE_DEBUG					2
 
+/** Default number of received messages buffered for publishing */
+#define NSDNET_INBOUND_QUEUE_SIZE 1024
+/** Default number of received messages published per batch */
+#define NSDNET_PUBLISH_BATCH 64
+
+/** Seconds to wait for messages in tick mode before looking at the clock */
+#define NSDNET_TICK_WAIT 0.01
+
+/** Prefix of the properties answered from the driver's metrics */
+#define NSDNET_METRICS_KEY "driver.metrics"
+/** Prefix of the properties defining groups of clients, kept by the driver
+ * and never passed on to the daemon */
+#define NSDNET_GROUP_KEY "driver.group."
+
 /** typedef for fixed strings */
 typedef char clientIDString[PLAYER_NSDNET_CLIENTID_LEN];
 
@@ -69,7 +94,12 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
        */
       NSDNetDriver(ConfigFile* cf, int section) :
          ThreadedDriver(cf, section, true, PLAYER_MSGQUEUE_DEFAULT_MAXLEN, PLAYER_NSDNET_CODE),
-         dataReadyListClients(false), dataReadyPropertyValue(false)
+         dataReadyListClients(false), dataReadyPropertyValue(false),
+         waitingPropertyValue(false), multiAnswered(0),
+         respListClientsGeneration(0), clientListGeneration(0),
+         publishing(true), publisherWaiting(false), readerWaiting(false),
+         inboundQueued(0), inboundPublished(0), subscribedTopics(false), inboundFiltered(0),
+         ticking(false), currentTick(0), releasedTick(-1)
       {
          // Get address of the ground truth of the position 2d.
          if (cf->ReadDeviceAddr(&position2dAddr, section, "uses", PLAYER_POSITION2D_CODE, -1, NULL) == -1)
@@ -83,49 +113,19 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
          port = cf->ReadString(section, "port", "9999");
          verbose = cf->ReadBool(section, "verbose", false);
 
-         // Iterate sections to find stage
-         worldFile = "";
-         for (int i = 0; i < cf->GetSectionCount(); i++)
-         {
-            const char *value = cf->ReadString(i, "name", NULL);
-            if (value && !strcmp(value, "stage"))
-            {
-               if ((value = cf->ReadFilename(i, "worldfile", NULL)))
-               {
-                  worldFile = value;
-               }
-               if ((value = cf->ReadString(i, "model", NULL)))
-               {
-                  model = value;
-               }
-            }
-         }
-
-         // If there is a world file, go open and read it.
-         ConfigFile worldCf;
-         localizationX = localizationY = localizationZ = localizationA = 0.0;
-         poseX = poseY = poseZ = poseA = 0.0;
-         if (worldFile.length() && worldCf.Load(worldFile.c_str()))
-         {
-            for (int i = 0; i < worldCf.GetSectionCount(); i++)
-            {
-               const char *value = worldCf.ReadString(i, "name", NULL);
-               if (value && model == value)
-               {
-                  // Get pose origin
-                  poseX = worldCf.ReadTupleLength(i, "pose", 0, 0.0);
-                  poseY = worldCf.ReadTupleLength(i, "pose", 1, 0.0);
-                  poseZ = worldCf.ReadTupleLength(i, "pose", 2, 0.0);
-                  poseA = worldCf.ReadTupleAngle(i, "pose", 3, 0.0);
-                  // Get localization origin
-                  localizationX = worldCf.ReadTupleLength(i, "localization_origin", 0, 0.0);
-                  localizationY = worldCf.ReadTupleLength(i, "localization_origin", 1, 0.0);
-                  localizationZ = worldCf.ReadTupleLength(i, "localization_origin", 2, 0.0);
-                  localizationA = worldCf.ReadTupleAngle(i, "localization_origin", 3, 0.0);
-                  break;
-               }
-            }
-         }
+         // Get the origins of our model from the (cached) world file.
+         NSDNetWorldCache::ModelOrigin origin;
+         NSDNetWorldCache::GetStageConfig(cf, worldFile, model);
+         if (worldFile.length())
+            NSDNetWorldCache::GetModelOrigin(worldFile, model, origin);
+         poseX = origin.pose.x;
+         poseY = origin.pose.y;
+         poseZ = origin.pose.z;
+         poseA = origin.pose.a;
+         localizationX = origin.localization.x;
+         localizationY = origin.localization.y;
+         localizationZ = origin.localization.z;
+         localizationA = origin.localization.a;
 
          if (id)
          {
@@ -139,13 +139,68 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
 
          // Some initial zeroing
          respPropGet.value = 0;
+         respListClients.clients_count = 0;
          respListClients.clients = 0;
 
-         if (verbose)
-            std::cout << "Connecting to server " << host << " on port " << port << std::endl;
-         client.reset(new PlayerNSDClient(*this));
-         if (!client->Connect(host, port))
-            PLAYER_ERROR("Unable to connect to playernsd server!");
+         // In tick mode the traffic goes out and comes in a simulation tick
+         // at a time.
+         tickPeriod = cf->ReadFloat(section, "tick_period", 0.0);
+
+         // Received messages are handed over to a publisher thread so that
+         // the reader never waits on Player.
+         inbound.reset(new boost::lockfree::spsc_queue<InboundMessage *>(
+            std::max(1, cf->ReadInt(section, "inbound_queue_size", NSDNET_INBOUND_QUEUE_SIZE))));
+         publishBatch = std::max(1, cf->ReadInt(section, "publish_batch", NSDNET_PUBLISH_BATCH));
+         publisher = boost::thread(&NSDNetDriver::processPublisher, this);
+
+         // Client settings, applied when the client is started.
+         socketRcvbuf = cf->ReadInt(section, "socket_rcvbuf", 0);
+         compressThreshold = cf->ReadInt(section, "compress_threshold", 0);
+         chunkSize = cf->ReadInt(section, "chunk_size", PLAYERNSD_DEFAULT_CHUNK_SIZE);
+         maxMessageSize = cf->ReadInt(section, "max_message_size", 0);
+         flowQuantum = cf->ReadInt(section, "flow_quantum", 65536);
+         if (flowQuantum <= 0)
+         {
+            PLAYER_ERROR1("Invalid flow_quantum %d, must be positive", flowQuantum);
+            SetError(-1);
+         }
+         shmRingSize = cf->ReadInt(section, "shm_ring_size", 0);
+         recordDir = cf->ReadString(section, "record_dir", "");
+         watchInterval = cf->ReadFloat(section, "propwatch_interval", PLAYERNSD_WATCH_INTERVAL);
+         closeTimeout = cf->ReadFloat(section, "close_timeout", PLAYERNSD_CLOSE_TIMEOUT);
+
+         // In loopback mode the drivers of this process talk to each other
+         // directly, over links modelled here.
+         loopback = !strcmp(cf->ReadString(section, "mode", "playernsd"), "loopback");
+         loopbackThreads = std::max(1, cf->ReadInt(section, "loopback_threads", 1));
+         loopbackGridCell = cf->ReadFloat(section, "loopback_grid_cell", PLAYERNSD_GRID_CELL);
+         NSDNetLinkChain *chain = new NSDNetLinkChain();
+         linkModel.reset(chain);
+         double linkDelay = cf->ReadFloat(section, "link_delay", 0.0);
+         double linkRange = cf->ReadFloat(section, "link_range", 0.0);
+         double linkBandwidth = cf->ReadFloat(section, "link_bandwidth", 0.0);
+         if (linkDelay > 0.0)
+            chain->Add(new NSDNetFixedDelayLink(linkDelay));
+         if (linkRange > 0.0)
+            chain->Add(new NSDNetRangeLossLink(linkRange, cf->ReadFloat(section, "link_loss", 0.0),
+               cf->ReadInt(section, "link_seed", 0) + boost::hash<std::string>()(clientID)));
+         if (linkBandwidth > 0.0)
+            chain->Add(new NSDNetBandwidthLink(linkBandwidth));
+         if (chain->Empty())
+            linkModel.reset();
+
+         // With several daemons each robot is at home on one of them, by
+         // the map of ids to shard indices or else a hash of its id.
+         for (int i = 0; i < cf->GetTupleCount(section, "shards"); i++)
+            shards.push_back(cf->ReadTupleString(section, "shards", i, ""));
+         for (int i = 0; i + 1 < cf->GetTupleCount(section, "shard_map"); i += 2)
+            shardMap[cf->ReadTupleString(section, "shard_map", i, "")] =
+               cf->ReadTupleInt(section, "shard_map", i + 1, 0);
+
+         // Connect in the background so that the drivers connect in parallel,
+         // or not until the first subscription if lazy.
+         if (!cf->ReadBool(section, "lazy_connect", false))
+            startClient();
       }
 
       /**
@@ -154,8 +209,18 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
        */
       ~NSDNetDriver()
       {
-         if (receivedMsg.msg)
-            delete[] receivedMsg.msg;
+         // Nothing is received once the link has been closed.
+         if (client)
+            client->Close();
+         publishing = false;
+         {
+            boost::lock_guard<boost::mutex> lock(mutInbound);
+            condInbound.notify_all();
+         }
+         publisher.join();
+         InboundMessage *msg;
+         while (inbound->pop(msg))
+            delete msg;
          if (respListClients.clients)
             delete[] respListClients.clients;
          if (respPropGet.value)
@@ -169,6 +234,7 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
       virtual int MainSetup()
       {
          PLAYER_MSG0(MESSAGE_INFO, "NSDNetDriver initialising");
+         startClient();
          if (hasPosition2d)
          {
             position2dDevice = deviceTable->GetDevice(position2dAddr);
@@ -194,7 +260,11 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
          PLAYER_MSG0(MESSAGE_INFO, "NSDNetDriver shutting down.");
          if (hasPosition2d)
             position2dDevice->Unsubscribe(InQueue);
-         boost::this_thread::sleep(boost::posix_time::milliseconds(1000));
+         // Send what is still queued and let the next setup start afresh.
+         if (client)
+            client->Close();
+         client.reset();
+         ticking = false;
          PLAYER_MSG0(MESSAGE_INFO, "NSDNetDriver has been shutdown");
       }
 
@@ -207,8 +277,9 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
          for (;;)
          {
             pthread_testcancel();
-            this->Wait();
+            this->Wait(tickPeriod > 0.0 ? NSDNET_TICK_WAIT : 0.0);
             this->ProcessMessages();
+            advanceTick();
          }
       }
 
@@ -221,6 +292,7 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
       virtual int ProcessMessage(QueuePointer& resp_queue,
          player_msghdr *hdr, void *data)
       {
+         advanceTick();
          if (Message::MatchMessage (hdr, PLAYER_MSGTYPE_REQ,
             PLAYER_NSDNET_REQ_LISTCLIENTS, device_addr))
          {
@@ -233,10 +305,38 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
                condListClients.wait(lock);
             // TODO: Check if we got the right property we're waiting on
             dataReadyListClients = false;
+            // The fixed slots are only filled in again if the list changed.
+            if (respListClientsGeneration != clientListGeneration)
+            {
+               respListClients.clients_count = clientList.size() * PLAYER_NSDNET_CLIENTID_LEN;
+               if (respListClients.clients)
+                  delete[] respListClients.clients;
+               respListClients.clients = new char[respListClients.clients_count];
+               memset(respListClients.clients, 0, respListClients.clients_count);
+               for (unsigned int i = 0; i < clientList.size(); i++)
+                  strncpy(((clientIDString *)respListClients.clients)[i], clientList[i].c_str(),
+                     PLAYER_NSDNET_CLIENTID_LEN - 1);
+               respListClientsGeneration = clientListGeneration;
+            }
             Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_LISTCLIENTS,
                &respListClients, sizeof(respListClients), NULL);
             return 0;
          }
+         else if (Message::MatchMessage (hdr, PLAYER_MSGTYPE_REQ,
+            PLAYER_NSDNET_REQ_CLIENTLIST, device_addr))
+         {
+            player_nsdnet_clientlist_req_t *req = (player_nsdnet_clientlist_req_t *) data;
+            if (verbose)
+               std::cout << "NSDNetDriver: Got request for client list from generation "
+                  << req->generation << std::endl;
+            client->RequestClientList();
+            boost::unique_lock<boost::mutex> lock(mutListClients);
+            while(!dataReadyListClients)
+               condListClients.wait(lock);
+            dataReadyListClients = false;
+            publishClientList(req);
+            return 0;
+         }
          else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_CMD,
             PLAYER_NSDNET_CMD_SEND, device_addr))
          {
@@ -244,10 +344,11 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
             if (verbose)
                std::cout << "NSDNetDriver: Sending message to '" <<
                   (strlen(cmd->clientid)?"all":cmd->clientid) << "', " << cmd->msg << std::endl;
+            PlayerNSDClient::Priority priority = sendPriority(cmd->type);
             if (strlen(cmd->clientid))
-               client->Send(cmd->clientid, cmd->msg_count, cmd->msg);
+               client->Send(cmd->clientid, cmd->msg_count, cmd->msg, priority);
             else
-               client->Send(cmd->msg_count, cmd->msg);
+               client->Send(cmd->msg_count, cmd->msg, priority);
             return 0;
          }
          else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
@@ -257,14 +358,109 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
             if (verbose)
                std::cout << "NSDNetDriver: Sending message request to '" <<
                   (strlen(req->clientid)?"all":req->clientid) << "', " << req->msg << std::endl;
+            PlayerNSDClient::Priority priority = sendPriority(req->type);
             if (strlen(req->clientid))
-               client->Send(req->clientid, req->msg_count, req->msg);
+               client->Send(req->clientid, req->msg_count, req->msg, priority);
             else
-               client->Send(req->msg_count, req->msg);
+               client->Send(req->msg_count, req->msg, priority);
             Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_SEND,
                NULL, 0, NULL);
             return 0;
          }
+         else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
+            PLAYER_NSDNET_REQ_PUBLISH, device_addr))
+         {
+            player_nsdnet_publish_req *req = (player_nsdnet_publish_req *)data;
+            if (!validTopic(req->topic))
+            {
+               PLAYER_ERROR1("Invalid topic '%s'", req->topic);
+               return -1;
+            }
+            if (verbose)
+               std::cout << "NSDNetDriver: Publishing message on topic '" << req->topic << "'" << std::endl;
+            client->SendTopic(req->topic, req->msg_count, req->msg, sendPriority(req->type));
+            Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_PUBLISH,
+               NULL, 0, NULL);
+            return 0;
+         }
+         else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
+            PLAYER_NSDNET_REQ_SEND_GROUP, device_addr))
+         {
+            player_nsdnet_send_group_req *req = (player_nsdnet_send_group_req *)data;
+            // The listed targets and the group members, each once.
+            std::vector<std::string> targets;
+            std::set<std::string> seen;
+            for (uint32_t i = 0; i + PLAYER_NSDNET_CLIENTID_LEN <= req->targets_count; i += PLAYER_NSDNET_CLIENTID_LEN)
+            {
+               std::string target(req->targets + i, strnlen(req->targets + i, PLAYER_NSDNET_CLIENTID_LEN));
+               if (!target.empty() && seen.insert(target).second)
+                  targets.push_back(target);
+            }
+            if (strnlen(req->group, PLAYER_NSDNET_KEY_LEN))
+            {
+               std::string group(req->group, strnlen(req->group, PLAYER_NSDNET_KEY_LEN));
+               std::map<std::string, std::vector<std::string> >::const_iterator it =
+                  groups.find(NSDNET_GROUP_KEY + group);
+               if (it == groups.end())
+               {
+                  PLAYER_ERROR1("Unknown group '%s'", group.c_str());
+                  return -1;
+               }
+               for (std::size_t i = 0; i < it->second.size(); i++)
+                  if (seen.insert(it->second[i]).second)
+                     targets.push_back(it->second[i]);
+            }
+            if (verbose)
+               std::cout << "NSDNetDriver: Sending message to a group of " << targets.size() << std::endl;
+            client->SendGroup(targets, req->msg_count, req->msg, sendPriority(req->type));
+            Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_SEND_GROUP,
+               NULL, 0, NULL);
+            return 0;
+         }
+         else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
+            PLAYER_NSDNET_REQ_SEND_RANGE, device_addr))
+         {
+            player_nsdnet_send_range_req *req = (player_nsdnet_send_range_req *)data;
+            if (!(req->radius >= 0.0))
+            {
+               PLAYER_ERROR1("Invalid range %f", req->radius);
+               return -1;
+            }
+            if (verbose)
+               std::cout << "NSDNetDriver: Sending message within " << req->radius << "m" << std::endl;
+            client->SendRange(req->radius, req->msg_count, req->msg, sendPriority(req->type));
+            Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_SEND_RANGE,
+               NULL, 0, NULL);
+            return 0;
+         }
+         else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
+            PLAYER_NSDNET_REQ_SUBSCRIBE, device_addr))
+         {
+            player_nsdnet_subscribe_req *req = (player_nsdnet_subscribe_req *)data;
+            std::set<std::string> subscription;
+            for (uint32_t i = 0; i + PLAYER_NSDNET_TOPIC_LEN <= req->topics_count; i += PLAYER_NSDNET_TOPIC_LEN)
+            {
+               std::string topic(req->topics + i, strnlen(req->topics + i, PLAYER_NSDNET_TOPIC_LEN));
+               if (!validTopic(topic.c_str()))
+               {
+                  PLAYER_ERROR1("Invalid topic '%s'", topic.c_str());
+                  return -1;
+               }
+               subscription.insert(topic);
+            }
+            if (verbose)
+               std::cout << "NSDNetDriver: Subscribing to " << subscription.size() << " topics" << std::endl;
+            {
+               boost::lock_guard<boost::mutex> lock(mutTopics);
+               topics = subscription;
+               subscribedTopics = true;
+            }
+            // Let the daemon filter too, if it can.
+            client->Subscribe(subscription);
+            Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_SUBSCRIBE,
+               NULL, 0, NULL);
+            return 0;
+         }
          else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
             PLAYER_NSDNET_REQ_PROPGET, device_addr))
          {
@@ -279,29 +475,109 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
                respPropGet.value_count = 0;
                respPropGet.value = 0;
             }
-            // Short circuit if the client id is needed.
-            if (!strcmp(req->key, "self.id"))
+            std::string value;
+            if (localProperty(req->key, value))
             {
-               memcpy(&respPropGet, req, sizeof(respPropGet));
-               respPropGet.value_count = clientID.size() + 1;
-               respPropGet.value = new char[respPropGet.value_count];
-               strcpy(respPropGet.value, clientID.c_str());
-               Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_PROPGET,
-                  &respPropGet, sizeof(respPropGet), NULL);
+               publishLocalProperty(req, value);
                return 0;
             }
             if (verbose)
                std::cout << "NSDNetDriver: Unhandled key by driver, passing on to daemon " << req->key << std::endl;
+            {
+               boost::lock_guard<boost::mutex> lock(mutPropertyValue);
+               waitingPropertyValue = true;
+            }
             client->PropertyGet(req->key);
             // Block until we know the response.
             boost::unique_lock<boost::mutex> lock(mutPropertyValue);
             while(!dataReadyPropertyValue)
                condPropertyValue.wait(lock);
             dataReadyPropertyValue = false;
+            waitingPropertyValue = false;
             Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_PROPGET,
                &respPropGet, sizeof(respPropGet), NULL);
             return 0;
          }
+         else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
+            PLAYER_NSDNET_REQ_PROPGET_MULTI, device_addr))
+         {
+            player_nsdnet_propget_multi_req_t *req = (player_nsdnet_propget_multi_req_t *) data;
+            std::vector<std::string> keys;
+            splitPacked(req->keys, req->keys_count, keys);
+            if (verbose)
+               std::cout << "NSDNetDriver: Got request for " << keys.size() << " property values" << std::endl;
+            // Answer what the driver knows, and ask the daemon for the rest.
+            std::vector<std::string> values(keys.size());
+            std::vector<uint8_t> found(keys.size(), 0);
+            std::vector<std::size_t> asked;
+            for (std::size_t i = 0; i < keys.size(); i++)
+            {
+               if (localProperty(keys[i], values[i]))
+                  found[i] = 1;
+               else
+                  asked.push_back(i);
+            }
+            {
+               boost::lock_guard<boost::mutex> lock(mutPropertyValue);
+               multiValues.swap(values);
+               multiFound.swap(found);
+               multiAsked.swap(asked);
+               multiAnswered = 0;
+            }
+            // The lookups all go out at once, the daemon answers in order.
+            for (std::size_t i = 0; i < multiAsked.size(); i++)
+               client->PropertyGet(keys[multiAsked[i]]);
+            boost::unique_lock<boost::mutex> lock(mutPropertyValue);
+            while (multiAnswered < multiAsked.size())
+               condPropertyValue.wait(lock);
+            std::string packed;
+            for (std::size_t i = 0; i < multiValues.size(); i++)
+               packed.append(multiValues[i].c_str(), multiValues[i].size() + 1);
+            player_nsdnet_propget_multi_req_t resp;
+            memset(&resp, 0, sizeof(resp));
+            resp.keys_count = req->keys_count;
+            resp.keys = req->keys;
+            resp.values_count = packed.size();
+            resp.values = const_cast<char *>(packed.data());
+            resp.found_count = multiFound.size();
+            resp.found = multiFound.empty() ? NULL : &multiFound[0];
+            Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_PROPGET_MULTI,
+               &resp, sizeof(resp), NULL);
+            multiAsked.clear();
+            multiAnswered = 0;
+            return 0;
+         }
+         else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
+            PLAYER_NSDNET_REQ_PROPWATCH, device_addr))
+         {
+            player_nsdnet_propwatch_req_t *req = (player_nsdnet_propwatch_req_t *) data;
+            std::vector<std::string> keys;
+            splitPacked(req->keys, req->keys_count, keys);
+            std::set<std::string> watch(keys.begin(), keys.end());
+            watch.erase(std::string());
+            if (verbose)
+               std::cout << "NSDNetDriver: Watching " << watch.size() << " properties" << std::endl;
+            client->PropertyWatch(watch);
+            Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_PROPWATCH,
+               NULL, 0, NULL);
+            return 0;
+         }
+         else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
+            PLAYER_NSDNET_REQ_PROPSET_MULTI, device_addr))
+         {
+            player_nsdnet_propset_multi_req_t *req = (player_nsdnet_propset_multi_req_t *) data;
+            std::vector<std::string> pairs;
+            splitPacked(req->pairs, req->pairs_count, pairs);
+            if (verbose)
+               std::cout << "NSDNetDriver: Send property set request for " << pairs.size() / 2
+                  << " properties" << std::endl;
+            for (std::size_t i = 0; i + 1 < pairs.size(); i += 2)
+               if (!setGroup(pairs[i].c_str(), pairs[i + 1]))
+                  client->PropertySet(pairs[i], pairs[i + 1]);
+            Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_PROPSET_MULTI,
+               NULL, 0, NULL);
+            return 0;
+         }
          else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_CMD,
             PLAYER_NSDNET_CMD_PROPSET, device_addr))
          {
@@ -309,7 +585,8 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
             if (verbose)
                std::cout << "NSDNetDriver: Send property set for property " << cmd->key <<
                   " with value " << cmd->value << std::endl;
-            client->PropertySet(cmd->key, cmd->value);
+            if (!setGroup(cmd->key, std::string(cmd->value, cmd->value_count)))
+               client->PropertySet(cmd->key, cmd->value);
             return 0;
          }
          else if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ,
@@ -319,7 +596,8 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
             if (verbose)
                std::cout << "NSDNetDriver: Send property set request for property " << req->key <<
                   " with value " << req->value << std::endl;
-            client->PropertySet(req->key, req->value);
+            if (!setGroup(req->key, std::string(req->value, req->value_count)))
+               client->PropertySet(req->key, req->value);
             Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_PROPSET,
                NULL, 0, NULL);
             return 0;
@@ -371,6 +649,9 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
                   std::cout << "NSDNetDriver: Registering with playernsd server with id " << clientID << std::endl;
                client->Register(clientID);
                break;
+            case PlayerNSDClient::StateDisconnected:
+               PLAYER_ERROR("Unable to connect to playernsd server!");
+               break;
             case PlayerNSDClient::StateRegistered:
                if (verbose)
                   std::cout << "NSDNetDriver: Registered with playernsd server with id " << clientID << std::endl;
@@ -400,6 +681,29 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
                      << clientID << std::endl;
                client->Register(clientID);
                break;
+            case PlayerNSDClient::ServerErrorPropertyNotExist:
+               {
+                  // Answers the oldest property lookup, as a value would.
+                  boost::lock_guard<boost::mutex> lock(mutPropertyValue);
+                  if (multiAnswered < multiAsked.size())
+                  {
+                     multiValues[multiAsked[multiAnswered++]].clear();
+                     if (multiAnswered == multiAsked.size())
+                        condPropertyValue.notify_one();
+                  }
+                  else if (waitingPropertyValue)
+                  {
+                     if (respPropGet.value)
+                        delete[] respPropGet.value;
+                     respPropGet.value_count = 0;
+                     respPropGet.value = 0;
+                     dataReadyPropertyValue = true;
+                     condPropertyValue.notify_one();
+                  }
+               }
+               if (verbose)
+                  std::cout << "Playernsd error: " << message << std::endl;
+               break;
             default:
                if (verbose)
                   std::cout << "Playernsd error: " << message << std::endl;
@@ -414,16 +718,12 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
        */
       virtual void Receive(const std::string& source, const std::string& data)
       {
-         strncpy(receivedMsg.clientid, source.c_str(), PLAYER_NSDNET_KEY_LEN-1);
-         receivedMsg.msg_count = data.length() + 1;
-         if (receivedMsg.msg)
-            delete[] receivedMsg.msg;
-         receivedMsg.msg = new char[receivedMsg.msg_count];
-         strncpy(receivedMsg.msg, data.c_str(), receivedMsg.msg_count);
+         InboundMessage *msg = new InboundMessage(PLAYER_NSDNET_DATA_RECV, source);
+         // Text messages are published with their terminator.
+         msg->data.assign(data.c_str(), data.length() + 1);
          if (verbose)
             std::cout << "NSDNetDriver: Received text message from " << source << std::endl;
-         Publish(device_addr, PLAYER_MSGTYPE_DATA, PLAYER_NSDNET_DATA_RECV, &receivedMsg,
-            sizeof(receivedMsg), NULL);
+         enqueueInbound(msg);
       }
 
       /**
@@ -434,16 +734,96 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
        */
       virtual void Receive(const std::string& source, int len, const char *data)
       {
-         strncpy(receivedMsg.clientid, source.c_str(), PLAYER_NSDNET_KEY_LEN-1);
-         receivedMsg.msg_count = len;
-         if (receivedMsg.msg)
-            delete[] receivedMsg.msg;
-         receivedMsg.msg = new char[len];
-         memcpy(receivedMsg.msg, data, len);
+         InboundMessage *msg = new InboundMessage(PLAYER_NSDNET_DATA_RECV, source);
+         msg->data.assign(data, len);
          if (verbose)
             std::cout << "NSDNetDriver: Received binary message from " << source << std::endl;
-         Publish(device_addr, PLAYER_MSGTYPE_DATA, PLAYER_NSDNET_DATA_RECV, &receivedMsg,
-            sizeof(receivedMsg), NULL);
+         enqueueInbound(msg);
+      }
+
+      /**
+       * Handler is fired for each chunk of a large binary message.
+       * \param source The source of the message.
+       * \param total The length of the whole message.
+       * \param offset The offset of the chunk in the message.
+       * \param len The length of the chunk.
+       * \param data The chunk received.
+       */
+      virtual void ReceiveChunk(const std::string& source, uint32_t total, uint32_t offset,
+         int len, const char *data)
+      {
+         uint8_t subtype = PLAYER_NSDNET_DATA_RECV_CONTINUE;
+         if (offset == 0)
+            subtype = PLAYER_NSDNET_DATA_RECV_BEGIN;
+         else if (offset + len >= total)
+            subtype = PLAYER_NSDNET_DATA_RECV_END;
+         InboundMessage *msg = new InboundMessage(subtype, source);
+         msg->total = total;
+         msg->offset = offset;
+         msg->data.assign(data, len);
+         if (verbose && offset == 0)
+            std::cout << "NSDNetDriver: Receiving " << total << " byte message from " << source << std::endl;
+         enqueueInbound(msg);
+      }
+
+      /**
+       * Handler is fired when a message published on a topic is received.
+       * Messages on topics nobody subscribed to are dropped here, before
+       * they cost a Publish.
+       * \param source The source of the message.
+       * \param topic The topic of the message.
+       * \param len The length of the message received.
+       * \param data The message received.
+       */
+      virtual void ReceiveTopic(const std::string& source, const std::string& topic,
+         int len, const char *data)
+      {
+         {
+            boost::lock_guard<boost::mutex> lock(mutTopics);
+            if (subscribedTopics && !topics.count(topic) && !topics.count(PLAYERNSD_ALL_TOPICS))
+            {
+               inboundFiltered++;
+               return;
+            }
+         }
+         InboundMessage *msg = new InboundMessage(PLAYER_NSDNET_DATA_RECV_TOPIC, source);
+         msg->topic = topic;
+         msg->data.assign(data, len);
+         if (verbose)
+            std::cout << "NSDNetDriver: Received message on topic " << topic << " from " << source << std::endl;
+         enqueueInbound(msg);
+      }
+
+      /**
+       * Handler is fired when a watched property changes.
+       * \param variable The property variable name.
+       * \param value The property value.
+       */
+      virtual void PropertyChanged(const std::string& variable, const std::string& value)
+      {
+         InboundMessage *msg = new InboundMessage(PLAYER_NSDNET_DATA_PROPCHANGED, std::string());
+         msg->topic = variable;
+         msg->data = value;
+         if (verbose)
+            std::cout << "NSDNetDriver: Property " << variable << " changed to " << value << std::endl;
+         enqueueInbound(msg);
+      }
+
+      /**
+       * Handler is fired when every robot has finished a simulation tick,
+       * after all the messages of the tick.
+       * \param tick The tick.
+       */
+      virtual void TickReached(uint32_t tick)
+      {
+         if (tick > releasedTick)
+            releasedTick = tick;
+         boost::atomic_thread_fence(boost::memory_order_seq_cst);
+         if (publisherWaiting)
+         {
+            boost::lock_guard<boost::mutex> lock(mutInbound);
+            condInbound.notify_all();
+         }
       }
 
       /**
@@ -453,12 +833,22 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
       virtual void ClientListResponse(const std::vector<std::string>& clientList)
       {
          boost::lock_guard<boost::mutex> lock(mutListClients);
-         respListClients.clients_count = clientList.size() * PLAYER_NSDNET_CLIENTID_LEN;
-         if (respListClients.clients)
-            delete[] respListClients.clients;
-         respListClients.clients = new char[respListClients.clients_count];
-         for (unsigned int i = 0; i < clientList.size(); i++)
-            strcpy(((clientIDString *)respListClients.clients)[i], clientList[i].c_str());
+         // The string table is only rebuilt when the membership changes.
+         if (clientList != this->clientList)
+         {
+            this->clientList = clientList;
+            clientListNames.clear();
+            clientListOffsets.resize(clientList.size());
+            for (unsigned int i = 0; i < clientList.size(); i++)
+            {
+               clientListOffsets[i] = clientListNames.size();
+               clientListNames.append(clientList[i].c_str(), clientList[i].size() + 1);
+            }
+            // Generation 0 is never used, it is what a requester holding no
+            // list asks with.
+            if (!++clientListGeneration)
+               clientListGeneration++;
+         }
          dataReadyListClients = true;
          if (verbose)
             std::cout << "NSDNetDriver: Received client list response." << std::endl;
@@ -473,6 +863,15 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
       virtual void PropertyValue(const std::string& variable, const std::string& value)
       {
          boost::lock_guard<boost::mutex> lock(mutPropertyValue);
+         if (multiAnswered < multiAsked.size())
+         {
+            std::size_t i = multiAsked[multiAnswered++];
+            multiValues[i] = value;
+            multiFound[i] = 1;
+            if (multiAnswered == multiAsked.size())
+               condPropertyValue.notify_one();
+            return;
+         }
          //player_nsdnet_propget_req_t resp;
          // TODO: Make safe.
          if (verbose)
@@ -491,22 +890,567 @@ class NSDNetDriver : public ThreadedDriver, PlayerNSDClient::Handler
       }
 
    private:
+      /** A received message waiting to be published. */
+      struct InboundMessage
+      {
+         InboundMessage(uint8_t subtype, const std::string& source) :
+            subtype(subtype), source(source), total(0), offset(0), tick(0) {}
+         uint8_t subtype;
+         std::string source;
+         uint32_t total;
+         uint32_t offset;
+         std::string topic;
+         std::string data;
+         /** The tick the message came in, in tick mode. */
+         int64_t tick;
+      };
+
+      /** Orders received messages by their source. */
+      struct InboundBySource
+      {
+         bool operator()(const InboundMessage *a, const InboundMessage *b) const
+         {
+            return a->source < b->source;
+         }
+      };
+
+      /**
+       * Hands a received message over to the publisher thread.
+       * Called on the reader thread; only waits if the inbound queue is full.
+       * \param msg The message, owned by the queue from now on.
+       */
+      void enqueueInbound(InboundMessage *msg)
+      {
+         // Whatever comes after the end of a tick belongs to the next.
+         msg->tick = releasedTick + 1;
+         while (!inbound->push(msg))
+         {
+            if (!publishing)
+            {
+               delete msg;
+               return;
+            }
+            // The publisher is behind, wait for it to make room.
+            boost::unique_lock<boost::mutex> lock(mutInbound);
+            readerWaiting = true;
+            if (!inbound->write_available() && publishing)
+               condInbound.timed_wait(lock, boost::posix_time::milliseconds(10));
+            readerWaiting = false;
+         }
+         inboundQueued++;
+         boost::atomic_thread_fence(boost::memory_order_seq_cst);
+         if (publisherWaiting)
+         {
+            boost::lock_guard<boost::mutex> lock(mutInbound);
+            condInbound.notify_all();
+         }
+      }
+
+      /**
+       * Publisher thread: drains the inbound queue in batches.
+       */
+      void processPublisher()
+      {
+         if (tickPeriod > 0.0)
+         {
+            processTickPublisher();
+            return;
+         }
+         std::vector<InboundMessage *> batch(publishBatch);
+         while (publishing)
+         {
+            std::size_t count = inbound->pop(&batch[0], batch.size());
+            if (!count)
+            {
+               boost::unique_lock<boost::mutex> lock(mutInbound);
+               publisherWaiting = true;
+               if (!inbound->read_available() && publishing)
+                  condInbound.timed_wait(lock, boost::posix_time::milliseconds(10));
+               publisherWaiting = false;
+               continue;
+            }
+            for (std::size_t i = 0; i < count; i++)
+            {
+               publishInbound(*batch[i]);
+               delete batch[i];
+            }
+            inboundPublished += count;
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+            if (readerWaiting)
+            {
+               boost::lock_guard<boost::mutex> lock(mutInbound);
+               condInbound.notify_all();
+            }
+         }
+      }
+
+      /**
+       * Publisher thread in tick mode: holds the received messages until
+       * their tick has ended, then publishes them ordered by source (the
+       * order between sources is up to the threads that delivered them),
+       * followed by the end of the tick.
+       */
+      void processTickPublisher()
+      {
+         std::vector<InboundMessage *> batch(publishBatch);
+         // Taken off the queue so the reader is never held up by a tick.
+         std::deque<InboundMessage *> waiting;
+         std::vector<InboundMessage *> due;
+         int64_t publishedTick = -1;
+         while (publishing)
+         {
+            std::size_t count = inbound->pop(&batch[0], batch.size());
+            waiting.insert(waiting.end(), batch.begin(), batch.begin() + count);
+            if (count)
+            {
+               boost::atomic_thread_fence(boost::memory_order_seq_cst);
+               if (readerWaiting)
+               {
+                  boost::lock_guard<boost::mutex> lock(mutInbound);
+                  condInbound.notify_all();
+               }
+            }
+            int64_t released = releasedTick;
+            while (!waiting.empty() && waiting.front()->tick <= released)
+            {
+               due.push_back(waiting.front());
+               waiting.pop_front();
+            }
+            if (due.empty() && released == publishedTick)
+            {
+               if (count)
+                  continue;
+               boost::unique_lock<boost::mutex> lock(mutInbound);
+               publisherWaiting = true;
+               if (!inbound->read_available() && releasedTick == released && publishing)
+                  condInbound.timed_wait(lock, boost::posix_time::milliseconds(10));
+               publisherWaiting = false;
+               continue;
+            }
+            std::stable_sort(due.begin(), due.end(), InboundBySource());
+            for (std::size_t i = 0; i < due.size(); i++)
+            {
+               publishInbound(*due[i]);
+               delete due[i];
+            }
+            inboundPublished += due.size();
+            due.clear();
+            if (released != publishedTick)
+            {
+               player_nsdnet_tick_data tickData;
+               tickData.tick = released;
+               Publish(device_addr, PLAYER_MSGTYPE_DATA, PLAYER_NSDNET_DATA_TICK, &tickData,
+                  sizeof(tickData), NULL);
+               publishedTick = released;
+            }
+         }
+         for (std::size_t i = 0; i < waiting.size(); i++)
+            delete waiting[i];
+      }
+
+      /**
+       * Ends the tick once the simulation time has passed it, sending what
+       * was held for it.  Ticks without traffic end with the last of them.
+       */
+      void advanceTick()
+      {
+         if (tickPeriod <= 0.0 || !client)
+            return;
+         double now;
+         GlobalTime->GetTimeDouble(&now);
+         uint32_t tick = (uint32_t) (now / tickPeriod);
+         if (!ticking)
+         {
+            ticking = true;
+            currentTick = tick;
+         }
+         else if (tick > currentTick)
+         {
+            if (verbose)
+               std::cout << "NSDNetDriver: Ending tick " << tick - 1 << std::endl;
+            client->Tick(tick - 1);
+            currentTick = tick;
+         }
+      }
+
+      /**
+       * Wraps a link so that it sends a tick at a time, in tick mode.
+       * \param link The link.
+       * \return The link to use.
+       */
+      PlayerNSDLink *tickLink(PlayerNSDLink *link)
+      {
+         if (tickPeriod > 0.0)
+            return new NSDNetTickLink(link);
+         return link;
+      }
+
+      /**
+       * Publishes a received message to the clients.
+       * \param msg The message.
+       */
+      void publishInbound(InboundMessage& msg)
+      {
+         // Publish copies the message, so it can point straight at the data.
+         if (msg.subtype == PLAYER_NSDNET_DATA_RECV)
+         {
+            player_nsdnet_recv_data receivedMsg;
+            memset(&receivedMsg, 0, sizeof(receivedMsg));
+            strncpy(receivedMsg.clientid, msg.source.c_str(), PLAYER_NSDNET_CLIENTID_LEN-1);
+            receivedMsg.msg_count = msg.data.size();
+            receivedMsg.msg = &msg.data[0];
+            Publish(device_addr, PLAYER_MSGTYPE_DATA, PLAYER_NSDNET_DATA_RECV, &receivedMsg,
+               sizeof(receivedMsg), NULL);
+         }
+         else if (msg.subtype == PLAYER_NSDNET_DATA_RECV_TOPIC)
+         {
+            player_nsdnet_recv_topic_data topicMsg;
+            memset(&topicMsg, 0, sizeof(topicMsg));
+            strncpy(topicMsg.clientid, msg.source.c_str(), PLAYER_NSDNET_CLIENTID_LEN-1);
+            strncpy(topicMsg.topic, msg.topic.c_str(), PLAYER_NSDNET_TOPIC_LEN-1);
+            topicMsg.msg_count = msg.data.size();
+            topicMsg.msg = &msg.data[0];
+            Publish(device_addr, PLAYER_MSGTYPE_DATA, PLAYER_NSDNET_DATA_RECV_TOPIC, &topicMsg,
+               sizeof(topicMsg), NULL);
+         }
+         else if (msg.subtype == PLAYER_NSDNET_DATA_PROPCHANGED)
+         {
+            player_nsdnet_propchanged_data change;
+            memset(&change, 0, sizeof(change));
+            strncpy(change.key, msg.topic.c_str(), PLAYER_NSDNET_KEY_LEN-1);
+            change.value_count = msg.data.size();
+            change.value = const_cast<char *>(msg.data.c_str());
+            Publish(device_addr, PLAYER_MSGTYPE_DATA, PLAYER_NSDNET_DATA_PROPCHANGED, &change,
+               sizeof(change), NULL);
+         }
+         else
+         {
+            player_nsdnet_recv_chunk_data chunk;
+            memset(&chunk, 0, sizeof(chunk));
+            strncpy(chunk.clientid, msg.source.c_str(), PLAYER_NSDNET_CLIENTID_LEN-1);
+            chunk.total = msg.total;
+            chunk.offset = msg.offset;
+            chunk.msg_count = msg.data.size();
+            chunk.msg = &msg.data[0];
+            Publish(device_addr, PLAYER_MSGTYPE_DATA, msg.subtype, &chunk, sizeof(chunk), NULL);
+         }
+      }
+
+      /**
+       * Creates the client and starts connecting to the daemon in the
+       * background, unless that has been done already.
+       */
+      void startClient()
+      {
+         if (client)
+            return;
+         if (loopback)
+         {
+            if (verbose)
+               std::cout << "Joining the loopback bus" << std::endl;
+            NSDNetLoopback *link = new NSDNetLoopback(*this, linkModel, loopbackThreads,
+               loopbackGridCell);
+            link->SetPosition(poseX, poseY);
+            client.reset(tickLink(link));
+            link->Connect();
+            return;
+         }
+         if (!shards.empty())
+         {
+            NSDNetShardedLink *link = new NSDNetShardedLink(*this, shardMap);
+            for (std::size_t i = 0; i < shards.size(); i++)
+            {
+               std::string shardHost, shardPort;
+               NSDNetShardedLink::ParseEndpoint(shards[i], port, shardHost, shardPort);
+               if (verbose)
+                  std::cout << "Connecting to shard " << i << " on " << shardHost << " port "
+                     << shardPort << std::endl;
+               std::stringstream recording;
+               recording << clientID << "." << i;
+               configureClient(link->AddShard(shardHost, shardPort), recording.str());
+            }
+            client.reset(tickLink(link));
+            link->Connect();
+            return;
+         }
+         if (verbose)
+            std::cout << "Connecting to server " << host << " on port " << port << std::endl;
+         PlayerNSDClient *nsdClient = new PlayerNSDClient(*this);
+         configureClient(*nsdClient, clientID);
+         client.reset(tickLink(nsdClient));
+         nsdClient->ConnectAsync(host, port);
+      }
+
+      /**
+       * Applies the client settings of the driver to a client.
+       * \param nsdClient The client, not yet connected.
+       * \param recording The name of its recording, if recording.
+       */
+      void configureClient(PlayerNSDClient& nsdClient, const std::string& recording)
+      {
+         nsdClient.SetReceiveBufferSize(socketRcvbuf);
+         nsdClient.SetCompressionThreshold(compressThreshold);
+         nsdClient.SetChunkSize(chunkSize);
+         nsdClient.SetMaxMessageSize(maxMessageSize);
+         nsdClient.SetFlowQuantum(flowQuantum);
+         nsdClient.SetSharedMemory(shmRingSize);
+         nsdClient.SetWatchInterval(watchInterval);
+         nsdClient.SetCloseTimeout(closeTimeout);
+         if (!recordDir.empty())
+            nsdClient.Record(recordDir + "/" + recording + ".nsdrec");
+      }
+
+      /**
+       * Gets the send priority requested by a message's type.
+       * \param type The type of the message.
+       * \return The priority class to send the message in.
+       */
+      static PlayerNSDClient::Priority sendPriority(char type)
+      {
+         if (type & PLAYER_NSDNET_TYPE_CONTROL)
+            return PlayerNSDSendQueue::PriorityControl;
+         return PlayerNSDSendQueue::PriorityBulk;
+      }
+
+      /**
+       * Checks that a topic can be sent in a protocol command.
+       * \param topic The topic.
+       * \return true if the topic is valid.
+       */
+      static bool validTopic(const char *topic)
+      {
+         std::size_t len = strnlen(topic, PLAYER_NSDNET_TOPIC_LEN);
+         return len && len < PLAYER_NSDNET_TOPIC_LEN && !strpbrk(topic, " \n");
+      }
+
+      /**
+       * Defines a group of clients if the property is a group property.
+       * \param key The property key, "driver.group.<name>".
+       * \param value The space separated client ids of the members.
+       * \return true if the property was a group property.
+       */
+      bool setGroup(const char *key, const std::string& value)
+      {
+         if (strncmp(key, NSDNET_GROUP_KEY, strlen(NSDNET_GROUP_KEY)))
+            return false;
+         std::vector<std::string>& members = groups[key];
+         members.clear();
+         std::istringstream ss(value.c_str());
+         std::string member;
+         while (ss >> member)
+            members.push_back(member);
+         return true;
+      }
+
+      /**
+       * Gets the value of a property kept by the driver rather than the
+       * daemon: the client id, groups and metrics.
+       * \param key The property key.
+       * \param value Set to the value of the property.
+       * \return true if the property is kept by the driver.
+       */
+      bool localProperty(const std::string& key, std::string& value)
+      {
+         // Short circuit if the client id is needed.
+         if (key == "self.id")
+         {
+            value = clientID;
+            return true;
+         }
+         if (!key.compare(0, strlen(NSDNET_GROUP_KEY), NSDNET_GROUP_KEY))
+         {
+            value.clear();
+            std::map<std::string, std::vector<std::string> >::const_iterator it = groups.find(key);
+            if (it != groups.end())
+               for (std::size_t i = 0; i < it->second.size(); i++)
+                  value += (i ? " " : "") + it->second[i];
+            return true;
+         }
+         if (!key.compare(0, strlen(NSDNET_METRICS_KEY), NSDNET_METRICS_KEY))
+         {
+            value = metricsValue(key);
+            return true;
+         }
+         return false;
+      }
+
+      /**
+       * Splits a list of NUL terminated strings packed back to back.
+       * \param data The list.
+       * \param count The number of bytes in the list.
+       * \param strings The strings, appended to.
+       */
+      static void splitPacked(const char *data, uint32_t count, std::vector<std::string>& strings)
+      {
+         const char *end = data + count;
+         while (data < end)
+         {
+            const char *nul = (const char *) memchr(data, '\0', end - data);
+            if (!nul)
+               nul = end;
+            strings.push_back(std::string(data, nul));
+            data = nul + 1;
+         }
+      }
+
+      /**
+       * Replies to a property request with a value known to the driver.
+       * \param req The property request.
+       * \param value The value of the property.
+       */
+      void publishLocalProperty(player_nsdnet_propget_req *req, const std::string& value)
+      {
+         memcpy(&respPropGet, req, sizeof(respPropGet));
+         respPropGet.value_count = value.size() + 1;
+         respPropGet.value = new char[respPropGet.value_count];
+         strcpy(respPropGet.value, value.c_str());
+         Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_PROPGET,
+            &respPropGet, sizeof(respPropGet), NULL);
+      }
+
+      /**
+       * Replies to a compact client list request from the cached list,
+       * without the client ids if the requester's generation is current.
+       * Must be called with mutListClients held.
+       * \param req The client list request.
+       */
+      void publishClientList(player_nsdnet_clientlist_req_t *req)
+      {
+         player_nsdnet_clientlist_req_t resp;
+         memset(&resp, 0, sizeof(resp));
+         resp.generation = clientListGeneration;
+         resp.total = clientList.size();
+         resp.first = std::min<uint32_t>(req->first, resp.total);
+         uint32_t count = resp.total - resp.first;
+         if (req->limit)
+            count = std::min(count, req->limit);
+         std::vector<uint32_t> offsets;
+         bool includeIds = req->generation != clientListGeneration && count;
+         if (includeIds && count == resp.total)
+         {
+            // The whole list goes out straight from the cache.
+            resp.offsets_count = count;
+            resp.offsets = &clientListOffsets[0];
+            resp.names_count = clientListNames.size();
+            resp.names = const_cast<char *>(clientListNames.data());
+         }
+         else if (includeIds)
+         {
+            uint32_t start = clientListOffsets[resp.first];
+            uint32_t end = resp.first + count < resp.total ?
+               clientListOffsets[resp.first + count] : clientListNames.size();
+            offsets.resize(count);
+            for (uint32_t i = 0; i < count; i++)
+               offsets[i] = clientListOffsets[resp.first + i] - start;
+            resp.offsets_count = count;
+            resp.offsets = &offsets[0];
+            resp.names_count = end - start;
+            resp.names = const_cast<char *>(clientListNames.data()) + start;
+         }
+         Publish(device_addr, PLAYER_MSGTYPE_RESP_ACK, PLAYER_NSDNET_REQ_CLIENTLIST,
+            &resp, sizeof(resp), NULL);
+      }
+
+      /**
+       * Formats the metrics for a property request.
+       * "driver.metrics" gives every metric as space separated name=value
+       * pairs, "driver.metrics.<name>" gives the value of a single metric.
+       * \param key The requested property key.
+       * \return The value of the property.
+       */
+      std::string metricsValue(const std::string& key)
+      {
+         PlayerNSDClient::Metrics metrics;
+         client->GetMetrics(metrics);
+         metrics["inbound.published"] = inboundPublished;
+         metrics["inbound.depth"] = inboundQueued - inboundPublished;
+         metrics["inbound.filtered"] = inboundFiltered;
+         if (tickPeriod > 0.0)
+            metrics["inbound.tick"] = releasedTick;
+         std::stringstream ss;
+         if (key.size() > strlen(NSDNET_METRICS_KEY) + 1)
+         {
+            PlayerNSDClient::Metrics::const_iterator it =
+               metrics.find(key.substr(strlen(NSDNET_METRICS_KEY) + 1));
+            if (it != metrics.end())
+               ss << it->second;
+            return ss.str();
+         }
+         for (PlayerNSDClient::Metrics::const_iterator it = metrics.begin(); it != metrics.end(); ++it)
+            ss << (it == metrics.begin() ? "" : " ") << it->first << "=" << it->second;
+         return ss.str();
+      }
+
       std::string worldFile;
       std::string model;
       std::string clientID;
       std::string host;
       std::string port;
       bool verbose;
-      boost::scoped_ptr<PlayerNSDClient> client;
+      int socketRcvbuf;
+      int compressThreshold;
+      int chunkSize;
+      int maxMessageSize;
+      int flowQuantum;
+      int shmRingSize;
+      std::string recordDir;
+      double watchInterval;
+      double closeTimeout;
+      bool loopback;
+      int loopbackThreads;
+      double loopbackGridCell;
+      boost::shared_ptr<NSDNetLinkModel> linkModel;
+      /** The endpoints of the daemons to shard over, if more than host. */
+      std::vector<std::string> shards;
+      std::map<std::string, std::size_t> shardMap;
+      boost::scoped_ptr<PlayerNSDLink> client;
       boost::condition_variable condListClients;
       boost::condition_variable condPropertyValue;
       boost::mutex mutListClients;
       boost::mutex mutPropertyValue;
       bool dataReadyListClients;
       bool dataReadyPropertyValue;
-      player_nsdnet_recv_data receivedMsg;
+      /** Whether a single property lookup is waiting on the daemon. */
+      bool waitingPropertyValue;
+      /** Values of a multiple property lookup, and the indices of the keys
+          asked of the daemon in the order asked. */
+      std::vector<std::string> multiValues;
+      std::vector<uint8_t> multiFound;
+      std::vector<std::size_t> multiAsked;
+      std::size_t multiAnswered;
       player_nsdnet_listclients_req_t respListClients;
+      /** The generation of the list in respListClients. */
+      uint32_t respListClientsGeneration;
+      /** The last client list received, with its string table. */
+      std::vector<std::string> clientList;
+      std::string clientListNames;
+      std::vector<uint32_t> clientListOffsets;
+      uint32_t clientListGeneration;
       player_nsdnet_propget_req_t respPropGet;
+      boost::scoped_ptr<boost::lockfree::spsc_queue<InboundMessage *> > inbound;
+      int publishBatch;
+      boost::thread publisher;
+      boost::mutex mutInbound;
+      boost::condition_variable condInbound;
+      boost::atomic<bool> publishing;
+      boost::atomic<bool> publisherWaiting;
+      boost::atomic<bool> readerWaiting;
+      boost::atomic<uint64_t> inboundQueued;
+      boost::atomic<uint64_t> inboundPublished;
+      /** Topics subscribed to, all topics until the first subscription. */
+      std::set<std::string> topics;
+      bool subscribedTopics;
+      boost::mutex mutTopics;
+      boost::atomic<uint64_t> inboundFiltered;
+      /** Simulation seconds per tick, 0 if not in tick mode. */
+      double tickPeriod;
+      /** Whether the first tick has started, and the tick in progress. */
+      bool ticking;
+      uint32_t currentTick;
+      /** The last tick every robot has finished, -1 before the first. */
+      boost::atomic<int64_t> releasedTick;
+      /** Members of the groups of clients, by property key. */
+      std::map<std::string, std::vector<std::string> > groups;
 
       bool hasPosition2d;
       Device *position2dDevice;
@@ -0,0 +1,806 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet in-process loopback
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <boost/atomic.hpp>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread.hpp>
+#include "nsdnet_loopback.h"
+
+/** Prefix of the properties kept for each robot rather than shared. */
+#define NSDNET_LOOPBACK_SELF_KEY "self."
+
+/**
+ * Returns the monotonic clock in seconds.
+ */
+static double monotonicTime()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool NSDNetFixedDelayLink::Transmit(const Link& link, std::size_t bytes, double& delay)
+{
+   delay += this->delay;
+   return true;
+}
+
+NSDNetRangeLossLink::NSDNetRangeLossLink(double range, double loss, uint32_t seed) :
+   range(range), loss(loss), random(seed)
+{
+}
+
+bool NSDNetRangeLossLink::Transmit(const Link& link, std::size_t bytes, double& delay)
+{
+   if (!link.positioned || range <= 0.0)
+      return true;
+   double distance = hypot(link.toX - link.fromX, link.toY - link.fromY);
+   if (distance > range)
+      return false;
+   double p = loss * (distance / range) * (distance / range);
+   boost::lock_guard<boost::mutex> lock(mutex);
+   return random() / 4294967296.0 >= p;
+}
+
+bool NSDNetBandwidthLink::Transmit(const Link& link, std::size_t bytes, double& delay)
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   busyUntil = std::max(busyUntil, link.now) + bytes / rate;
+   delay += busyUntil - link.now;
+   return true;
+}
+
+bool NSDNetLinkChain::Transmit(const Link& link, std::size_t bytes, double& delay)
+{
+   for (std::size_t i = 0; i < models.size(); i++)
+      if (!models[i]->Transmit(link, bytes, delay))
+         return false;
+   return true;
+}
+
+/** A robot on the bus. */
+struct NSDNetLoopback::Node
+{
+   Node(PlayerNSDClient::Handler *handler) :
+      handler(handler), worker(0), subscribed(false), positioned(false), x(0.0), y(0.0),
+      ticking(false), tick(0), sent(0), dropped(0), delivered(0) {}
+
+   /** Guards the handler, which is cleared when the endpoint goes away. */
+   boost::mutex mutex;
+   PlayerNSDClient::Handler *handler;
+   /** Set once registered. */
+   std::string id;
+   std::size_t worker;
+
+   /** Guards the subscription, position and properties. */
+   boost::mutex stateMutex;
+   std::set<std::string> topics;
+   bool subscribed;
+   bool positioned;
+   double x, y;
+   std::map<std::string, std::string> properties;
+   /** Watched properties, keys or prefixes. */
+   std::set<std::string> watched;
+
+   /** Whether the robot marks ticks, and the last tick it finished. */
+   boost::atomic<bool> ticking;
+   boost::atomic<uint32_t> tick;
+
+   boost::atomic<uint64_t> sent;
+   boost::atomic<uint64_t> dropped;
+   boost::atomic<uint64_t> delivered;
+};
+
+/** A message on its way to a robot. */
+struct Delivery
+{
+   enum Kind
+   {
+      /** A message. */
+      KindMessage,
+      /** The new value of a watched property. */
+      KindProperty,
+      /** The end of a tick. */
+      KindTick,
+   };
+
+   double due;
+   uint64_t seq;
+   boost::shared_ptr<NSDNetLoopback::Node> to;
+   std::string source;
+   /** The topic, empty if not published on one, or the property key. */
+   std::string topic;
+   PlayerNSDSendQueue::Payload payload;
+   Kind kind;
+   /** Whether the sender marks ticks, and the last tick it had finished,
+       or the tick ended. */
+   bool ticked;
+   uint32_t tick;
+};
+
+/** Orders deliveries by when they are due, then as sent. */
+struct DeliveryLater
+{
+   bool operator()(const Delivery& a, const Delivery& b) const
+   {
+      return a.due > b.due || (a.due == b.due && a.seq > b.seq);
+   }
+};
+
+/** A delivery thread and the messages waiting for it. */
+struct DeliveryWorker
+{
+   DeliveryWorker() : latest(0.0), barrier(0.0) {}
+   boost::mutex mutex;
+   boost::condition_variable cond;
+   std::priority_queue<Delivery, std::vector<Delivery>, DeliveryLater> queue;
+   /** When the latest message queued is due, and the latest end of a tick. */
+   double latest;
+   double barrier;
+   /** Messages sent for ticks not yet finished by everyone. */
+   std::vector<Delivery> held;
+   boost::thread thread;
+};
+
+/**
+ * The robots of the process and the threads delivering to them.
+ */
+class NSDNetLoopback::Bus
+{
+   public:
+      /**
+       * Gets the process's bus, starting it on first use.
+       * \param threads The number of delivery threads to start it with.
+       */
+      static Bus& Get(std::size_t threads, double cellSize)
+      {
+         // Never destroyed, the delivery threads run until the process exits.
+         static Bus *bus = new Bus(std::max<std::size_t>(threads, 1), cellSize);
+         return *bus;
+      }
+
+      bool Add(const boost::shared_ptr<Node>& node)
+      {
+         bool positioned;
+         double x, y;
+         {
+            boost::lock_guard<boost::mutex> lock(node->stateMutex);
+            positioned = node->positioned;
+            x = node->x;
+            y = node->y;
+         }
+         boost::lock_guard<boost::mutex> lock(mutex);
+         if (!nodes.insert(std::make_pair(node->id, node)).second)
+            return false;
+         node->worker = boost::hash<std::string>()(node->id) % workers.size();
+         if (positioned)
+            grid.Update(node->id, x, y);
+         return true;
+      }
+
+      /** Takes a robot off the bus, unless its id has been taken since. */
+      void Remove(const boost::shared_ptr<Node>& node)
+      {
+         {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            std::map<std::string, boost::shared_ptr<Node> >::iterator it = nodes.find(node->id);
+            if (it == nodes.end() || it->second != node)
+               return;
+            nodes.erase(it);
+            grid.Remove(node->id);
+         }
+         // Nobody waits for a robot that has gone.
+         boost::lock_guard<boost::mutex> lock(tickMutex);
+         if (ticking.erase(node->id))
+            release();
+      }
+
+      /**
+       * Records that a robot has finished a tick, releasing the tick once
+       * every robot marking ticks has.
+       */
+      void Tick(const boost::shared_ptr<Node>& node, uint32_t tick)
+      {
+         boost::lock_guard<boost::mutex> lock(tickMutex);
+         node->tick = tick;
+         node->ticking = true;
+         bool joined = ticking.insert(std::make_pair(node->id, node)).second;
+         if (!release() && joined && releasedAny && tick <= released)
+            // Joining behind the others, its tick is already over.
+            postTick(node, released);
+      }
+
+      /** Moves a robot in the index of positions, if it is on the bus. */
+      void Move(const std::string& id, double x, double y)
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         if (nodes.count(id))
+            grid.Update(id, x, y);
+      }
+
+      /**
+       * Gets the other robots within a range of one, or every other robot
+       * if its position is not known.
+       */
+      void GetInRange(const boost::shared_ptr<Node>& self, double radius,
+         std::vector<boost::shared_ptr<Node> >& others)
+      {
+         std::vector<std::string> ids;
+         {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            double x, y;
+            if (grid.Find(self->id, x, y))
+            {
+               grid.Query(x, y, radius, ids);
+               others.reserve(ids.size());
+               for (std::size_t i = 0; i < ids.size(); i++)
+                  if (ids[i] != self->id)
+                     others.push_back(nodes[ids[i]]);
+               return;
+            }
+         }
+         GetOthers(self, others);
+      }
+
+      /** Finds a robot, returning an empty pointer if there is none. */
+      boost::shared_ptr<Node> Find(const std::string& id)
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         std::map<std::string, boost::shared_ptr<Node> >::iterator it = nodes.find(id);
+         return it == nodes.end() ? boost::shared_ptr<Node>() : it->second;
+      }
+
+      /** Gets every robot but one (or every robot). */
+      void GetOthers(const boost::shared_ptr<Node>& self, std::vector<boost::shared_ptr<Node> >& others)
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         others.reserve(nodes.size());
+         for (std::map<std::string, boost::shared_ptr<Node> >::iterator it = nodes.begin(); it != nodes.end(); ++it)
+            if (it->second != self)
+               others.push_back(it->second);
+      }
+
+      void GetIDs(std::vector<std::string>& ids)
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         for (std::map<std::string, boost::shared_ptr<Node> >::iterator it = nodes.begin(); it != nodes.end(); ++it)
+            ids.push_back(it->first);
+      }
+
+      /** Sets a shared property, returning false if it was unchanged. */
+      bool SetProperty(const std::string& key, const std::string& value)
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         std::map<std::string, std::string>::iterator it = properties.find(key);
+         if (it != properties.end() && it->second == value)
+            return false;
+         properties[key] = value;
+         return true;
+      }
+
+      /** Gets a shared property, returning false if there is none. */
+      bool GetProperty(const std::string& key, std::string& value)
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         std::map<std::string, std::string>::iterator it = properties.find(key);
+         if (it == properties.end())
+            return false;
+         value = it->second;
+         return true;
+      }
+
+      /** Queues a message with the thread of its receiver. */
+      void Post(Delivery& delivery)
+      {
+         DeliveryWorker& worker = *workers[delivery.to->worker];
+         bool first;
+         {
+            boost::lock_guard<boost::mutex> lock(worker.mutex);
+            delivery.seq = seq++;
+            if (delivery.kind == Delivery::KindTick)
+            {
+               // After everything already on its way.
+               delivery.due = std::max(delivery.due, worker.latest);
+               worker.barrier = delivery.due;
+            }
+            else if (delivery.ticked)
+            {
+               if (!releasedAny || delivery.tick > released)
+               {
+                  // Sent ahead of the others, it waits for them.
+                  worker.held.push_back(delivery);
+                  return;
+               }
+               // Not before the end of the tick it was sent after.
+               delivery.due = std::max(delivery.due, worker.barrier);
+            }
+            worker.latest = std::max(worker.latest, delivery.due);
+            worker.queue.push(delivery);
+            first = worker.queue.top().seq == delivery.seq;
+         }
+         // Only a new earliest message changes how long the thread waits.
+         if (first)
+            worker.cond.notify_one();
+      }
+
+   private:
+      Bus(std::size_t threads, double cellSize) : grid(cellSize), seq(0),
+         releasedAny(false), released(0)
+      {
+         for (std::size_t i = 0; i < threads; i++)
+         {
+            workers.push_back(new DeliveryWorker());
+            workers.back()->thread = boost::thread(&Bus::process, this, workers.back());
+         }
+      }
+
+      void process(DeliveryWorker *worker)
+      {
+         std::vector<Delivery> due;
+         for (;;)
+         {
+            {
+               boost::unique_lock<boost::mutex> lock(worker->mutex);
+               while (worker->queue.empty())
+                  worker->cond.wait(lock);
+               double now = monotonicTime();
+               double wait = worker->queue.top().due - now;
+               if (wait > 0.0)
+               {
+                  worker->cond.timed_wait(lock, boost::posix_time::microseconds((int64_t)(wait * 1e6) + 1));
+                  continue;
+               }
+               while (!worker->queue.empty() && worker->queue.top().due <= now)
+               {
+                  due.push_back(worker->queue.top());
+                  worker->queue.pop();
+               }
+            }
+            for (std::size_t i = 0; i < due.size(); i++)
+               deliver(due[i]);
+            due.clear();
+         }
+      }
+
+      /**
+       * Releases the ticks every robot marking ticks has finished: the end
+       * of the tick is queued for each of those robots, and then the
+       * messages held back for the next tick.  Must be called with
+       * tickMutex held.
+       * \return false if there was no tick to release.
+       */
+      bool release()
+      {
+         if (ticking.empty())
+            return false;
+         uint32_t low = ticking.begin()->second->tick;
+         for (std::map<std::string, boost::shared_ptr<Node> >::iterator it = ticking.begin(); it != ticking.end(); ++it)
+            low = std::min<uint32_t>(low, it->second->tick);
+         if (releasedAny && low <= released)
+            return false;
+         for (std::map<std::string, boost::shared_ptr<Node> >::iterator it = ticking.begin(); it != ticking.end(); ++it)
+            postTick(it->second, low);
+         // Only then is anything for the next tick let through.
+         released = low;
+         releasedAny = true;
+         BOOST_FOREACH(DeliveryWorker *worker, workers)
+         {
+            {
+               boost::lock_guard<boost::mutex> lock(worker->mutex);
+               std::vector<Delivery> later;
+               BOOST_FOREACH(Delivery delivery, worker->held)
+               {
+                  if (delivery.tick > low)
+                  {
+                     later.push_back(delivery);
+                     continue;
+                  }
+                  delivery.due = std::max(delivery.due, worker->barrier);
+                  delivery.seq = seq++;
+                  worker->latest = std::max(worker->latest, delivery.due);
+                  worker->queue.push(delivery);
+               }
+               worker->held.swap(later);
+            }
+            worker->cond.notify_one();
+         }
+         return true;
+      }
+
+      /** Queues the end of a tick for a robot, after its messages. */
+      void postTick(const boost::shared_ptr<Node>& to, uint32_t tick)
+      {
+         Delivery delivery;
+         delivery.due = monotonicTime();
+         delivery.to = to;
+         delivery.kind = Delivery::KindTick;
+         delivery.ticked = true;
+         delivery.tick = tick;
+         Post(delivery);
+      }
+
+      static void deliver(const Delivery& delivery)
+      {
+         Node& to = *delivery.to;
+         boost::lock_guard<boost::mutex> lock(to.mutex);
+         if (!to.handler)
+            return;
+         if (delivery.kind == Delivery::KindTick)
+         {
+            to.handler->TickReached(delivery.tick);
+            return;
+         }
+         const std::string& payload = *delivery.payload;
+         if (delivery.kind == Delivery::KindProperty)
+         {
+            to.handler->PropertyChanged(delivery.topic, payload);
+            return;
+         }
+         if (delivery.topic.empty())
+            to.handler->Receive(delivery.source, payload.size(), payload.data());
+         else
+            to.handler->ReceiveTopic(delivery.source, delivery.topic, payload.size(), payload.data());
+         to.delivered++;
+      }
+
+      boost::mutex mutex;
+      std::map<std::string, boost::shared_ptr<Node> > nodes;
+      /** Properties shared by all the robots. */
+      std::map<std::string, std::string> properties;
+      /** The positions of the robots that have one. */
+      PlayerNSDGrid grid;
+      std::vector<DeliveryWorker *> workers;
+      boost::atomic<uint64_t> seq;
+      /** Guards the robots marking ticks and releasing ticks. */
+      boost::mutex tickMutex;
+      std::map<std::string, boost::shared_ptr<Node> > ticking;
+      /** The last tick finished by every robot marking ticks, if any. */
+      boost::atomic<bool> releasedAny;
+      boost::atomic<uint32_t> released;
+};
+
+NSDNetLoopback::NSDNetLoopback(PlayerNSDClient::Handler& handler,
+   const boost::shared_ptr<NSDNetLinkModel>& model, std::size_t threads, double cellSize) :
+   handler(handler), model(model), node(new Node(&handler)), bus(Bus::Get(threads, cellSize))
+{
+}
+
+NSDNetLoopback::~NSDNetLoopback()
+{
+   Close();
+}
+
+void NSDNetLoopback::Close()
+{
+   // What has been sent is already on the bus, so there is nothing to drain.
+   if (!node->id.empty())
+      bus.Remove(node);
+   // Wait for a delivery in progress, and stop any further ones.
+   boost::lock_guard<boost::mutex> lock(node->mutex);
+   node->handler = NULL;
+}
+
+void NSDNetLoopback::Connect()
+{
+   handler.StateChanged(PlayerNSDClient::StateConnected);
+   handler.StateChanged(PlayerNSDClient::StateGreeting);
+}
+
+void NSDNetLoopback::SetPosition(double x, double y)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(node->stateMutex);
+      node->x = x;
+      node->y = y;
+      node->positioned = true;
+   }
+   if (!node->id.empty())
+      bus.Move(node->id, x, y);
+}
+
+void NSDNetLoopback::Register(const std::string &clientID)
+{
+   if (!node->id.empty())
+   {
+      handler.ErrorRaised(PlayerNSDClient::ServerErrorAlreadyRegistered, "error alreadyregistered");
+      return;
+   }
+   node->id = clientID;
+   if (!bus.Add(node))
+   {
+      node->id.clear();
+      handler.ErrorRaised(PlayerNSDClient::ServerErrorClientIDInUse, "error clientidinuse");
+      return;
+   }
+   handler.StateChanged(PlayerNSDClient::StateRegistered);
+}
+
+void NSDNetLoopback::RequestClientList()
+{
+   std::vector<std::string> ids;
+   bus.GetIDs(ids);
+   handler.ClientListResponse(ids);
+}
+
+void NSDNetLoopback::Send(const std::string& target, uint32_t len, const char *data,
+   Priority priority)
+{
+   std::vector<boost::shared_ptr<Node> > targets;
+   boost::shared_ptr<Node> to = bus.Find(target);
+   if (!to)
+   {
+      handler.ErrorRaised(PlayerNSDClient::ServerErrorUnknownClient, "error unknownclient " + target);
+      return;
+   }
+   targets.push_back(to);
+   send(targets, std::string(), len, data);
+}
+
+void NSDNetLoopback::Send(uint32_t len, const char *data, Priority priority)
+{
+   std::vector<boost::shared_ptr<Node> > targets;
+   bus.GetOthers(node, targets);
+   send(targets, std::string(), len, data);
+}
+
+void NSDNetLoopback::SendTopic(const std::string& topic, uint32_t len, const char *data,
+   Priority priority)
+{
+   std::vector<boost::shared_ptr<Node> > others, targets;
+   bus.GetOthers(node, others);
+   // Only robots that want the topic (or have not said) get it.
+   for (std::size_t i = 0; i < others.size(); i++)
+   {
+      boost::lock_guard<boost::mutex> lock(others[i]->stateMutex);
+      if (!others[i]->subscribed || others[i]->topics.count(topic) ||
+         others[i]->topics.count(PLAYERNSD_ALL_TOPICS))
+         targets.push_back(others[i]);
+   }
+   send(targets, topic, len, data);
+}
+
+void NSDNetLoopback::SendGroup(const std::vector<std::string>& targets, uint32_t len,
+   const char *data, Priority priority)
+{
+   std::vector<boost::shared_ptr<Node> > nodes;
+   for (std::size_t i = 0; i < targets.size(); i++)
+   {
+      boost::shared_ptr<Node> to = bus.Find(targets[i]);
+      if (to)
+         nodes.push_back(to);
+   }
+   send(nodes, std::string(), len, data);
+}
+
+void NSDNetLoopback::SendRange(double radius, uint32_t len, const char *data,
+   Priority priority)
+{
+   // Only the robots nearby are looked at, however many there are.
+   std::vector<boost::shared_ptr<Node> > targets;
+   bus.GetInRange(node, radius, targets);
+   send(targets, std::string(), len, data);
+}
+
+void NSDNetLoopback::send(const std::vector<boost::shared_ptr<Node> >& targets,
+   const std::string& topic, uint32_t len, const char *data)
+{
+   if (node->id.empty() || targets.empty())
+      return;
+   // One copy of the message, shared by every delivery.
+   PlayerNSDSendQueue::Payload payload(new std::string(data, len));
+   NSDNetLinkModel::Link link;
+   link.now = monotonicTime();
+   {
+      boost::lock_guard<boost::mutex> lock(node->stateMutex);
+      link.positioned = node->positioned;
+      link.fromX = node->x;
+      link.fromY = node->y;
+   }
+   bool positioned = link.positioned;
+   // Messages sent after finishing a tick belong to the next.
+   bool ticked = node->ticking;
+   uint32_t tick = node->tick;
+   for (std::size_t i = 0; i < targets.size(); i++)
+   {
+      double delay = 0.0;
+      node->sent++;
+      if (model)
+      {
+         {
+            boost::lock_guard<boost::mutex> lock(targets[i]->stateMutex);
+            link.positioned = positioned && targets[i]->positioned;
+            link.toX = targets[i]->x;
+            link.toY = targets[i]->y;
+         }
+         if (!model->Transmit(link, len, delay))
+         {
+            node->dropped++;
+            continue;
+         }
+      }
+      Delivery delivery;
+      delivery.due = link.now + delay;
+      delivery.to = targets[i];
+      delivery.source = node->id;
+      delivery.topic = topic;
+      delivery.payload = payload;
+      delivery.kind = Delivery::KindMessage;
+      delivery.ticked = ticked;
+      delivery.tick = tick;
+      bus.Post(delivery);
+   }
+}
+
+void NSDNetLoopback::Subscribe(const std::set<std::string>& topics)
+{
+   boost::lock_guard<boost::mutex> lock(node->stateMutex);
+   node->topics = topics;
+   node->subscribed = true;
+}
+
+void NSDNetLoopback::PropertyGet(const std::string& variable)
+{
+   std::string value;
+   bool found;
+   if (!variable.compare(0, strlen(NSDNET_LOOPBACK_SELF_KEY), NSDNET_LOOPBACK_SELF_KEY))
+   {
+      boost::lock_guard<boost::mutex> lock(node->stateMutex);
+      std::map<std::string, std::string>::iterator it = node->properties.find(variable);
+      found = it != node->properties.end();
+      if (found)
+         value = it->second;
+   }
+   else
+      found = bus.GetProperty(variable, value);
+   // As the daemon answers a property that was never set.
+   if (found)
+      handler.PropertyValue(variable, value);
+   else
+      handler.ErrorRaised(PlayerNSDClient::ServerErrorPropertyNotExist, "error propertynotexist");
+}
+
+void NSDNetLoopback::PropertySet(const std::string& variable, const std::string& value)
+{
+   std::vector<boost::shared_ptr<Node> > nodes;
+   bool moved = false;
+   double x = 0.0, y = 0.0;
+   if (variable.compare(0, strlen(NSDNET_LOOPBACK_SELF_KEY), NSDNET_LOOPBACK_SELF_KEY))
+   {
+      if (!bus.SetProperty(variable, value))
+         return;
+      // Everyone, including this robot, may be watching a shared property.
+      bus.GetOthers(boost::shared_ptr<Node>(), nodes);
+   }
+   else
+   {
+      boost::lock_guard<boost::mutex> lock(node->stateMutex);
+      std::string& current = node->properties[variable];
+      if (current == value)
+         return;
+      current = value;
+      if (variable == "self.position")
+      {
+         // "x y a", as set by the driver from its position2d device.
+         std::istringstream ss(value);
+         if (ss >> x >> y)
+         {
+            node->x = x;
+            node->y = y;
+            node->positioned = moved = true;
+         }
+      }
+      nodes.push_back(node);
+   }
+   if (moved && !node->id.empty())
+      bus.Move(node->id, x, y);
+   PlayerNSDSendQueue::Payload payload;
+   for (std::size_t i = 0; i < nodes.size(); i++)
+   {
+      {
+         boost::lock_guard<boost::mutex> lock(nodes[i]->stateMutex);
+         if (!watches(nodes[i]->watched, variable))
+            continue;
+      }
+      if (!payload)
+         payload.reset(new std::string(value));
+      changed(nodes[i], variable, payload);
+   }
+}
+
+void NSDNetLoopback::PropertyWatch(const std::set<std::string>& keys)
+{
+   std::vector<std::pair<std::string, std::string> > current;
+   {
+      boost::lock_guard<boost::mutex> lock(node->stateMutex);
+      node->watched = keys;
+      BOOST_FOREACH(const std::string& key, keys)
+      {
+         std::map<std::string, std::string>::iterator it = node->properties.find(key);
+         if (it != node->properties.end())
+            current.push_back(*it);
+      }
+   }
+   // Report the current values of the keys watched, as a poll would.
+   BOOST_FOREACH(const std::string& key, keys)
+   {
+      if (!key.compare(0, strlen(NSDNET_LOOPBACK_SELF_KEY), NSDNET_LOOPBACK_SELF_KEY))
+         continue;
+      std::string value;
+      if (bus.GetProperty(key, value))
+         current.push_back(std::make_pair(key, value));
+   }
+   for (std::size_t i = 0; i < current.size(); i++)
+      changed(node, current[i].first,
+         PlayerNSDSendQueue::Payload(new std::string(current[i].second)));
+}
+
+bool NSDNetLoopback::watches(const std::set<std::string>& watched, const std::string& variable)
+{
+   if (watched.count(variable))
+      return true;
+   BOOST_FOREACH(const std::string& key, watched)
+      if (boost::algorithm::ends_with(key, PLAYERNSD_WATCH_PREFIX) &&
+         !variable.compare(0, key.size() - 1, key, 0, key.size() - 1))
+         return true;
+   return false;
+}
+
+void NSDNetLoopback::changed(const boost::shared_ptr<Node>& to, const std::string& variable,
+   const PlayerNSDSendQueue::Payload& value)
+{
+   // Through the receiver's delivery thread, like its messages.
+   Delivery delivery;
+   delivery.due = monotonicTime();
+   delivery.to = to;
+   delivery.topic = variable;
+   delivery.payload = value;
+   delivery.kind = Delivery::KindProperty;
+   delivery.ticked = node->ticking;
+   delivery.tick = node->tick;
+   bus.Post(delivery);
+}
+
+void NSDNetLoopback::Tick(uint32_t tick)
+{
+   // Nothing is sent or received before registering.
+   if (!node->id.empty())
+      bus.Tick(node, tick);
+}
+
+void NSDNetLoopback::GetMetrics(Metrics& metrics)
+{
+   metrics["loopback.sent"] = node->sent;
+   metrics["loopback.dropped"] = node->dropped;
+   metrics["loopback.delivered"] = node->delivered;
+}
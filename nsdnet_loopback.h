@@ -0,0 +1,211 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet in-process loopback
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * A link that passes messages between the driver instances of one Player
+ * process through an in-memory bus instead of playernsd, for runs that need
+ * many robots more than they need a network simulator.
+ *
+ * What happens to a message on its way is decided by the sender's link
+ * model, a chain of simple models: a fixed delay, loss with the distance
+ * between the robots (from their "self.position" properties) and a cap on
+ * the bandwidth each robot sends with.
+ *
+ * Range broadcasts only look at the robots near the sender, found in a
+ * uniform grid of the robots' latest positions.
+ *
+ * Messages are handed to the receivers' handlers by the bus's delivery
+ * threads, each receiver always by the same thread, so a handler sees its
+ * messages from one thread in the order they became due, as it would from
+ * the client's reader thread.
+ *
+ * Once a robot marks the end of a simulation tick, the messages it sends
+ * for later ticks are held back until every robot marking ticks has
+ * finished the tick, and then every such robot is told, after the last of
+ * the tick's messages due for it.
+ */
+
+#ifndef _NSDNET_LOOPBACK_H_
+#define _NSDNET_LOOPBACK_H_
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include "playernsd_client.h"
+#include "playernsd_grid.h"
+
+/**
+ * Decides what happens to a message sent over a loopback link.
+ */
+class NSDNetLinkModel
+{
+   public:
+      /** A message's trip from one robot to another. */
+      struct Link
+      {
+         /** When the message is sent, in seconds on the monotonic clock. */
+         double now;
+         /** Whether both robots' positions are known. */
+         bool positioned;
+         double fromX, fromY, toX, toY;
+      };
+
+      virtual ~NSDNetLinkModel() {}
+
+      /**
+       * Passes a message over the link.
+       * \param link The link.
+       * \param bytes The size of the message.
+       * \param delay The delay of the message in seconds, added to.
+       * \return false if the message is lost.
+       */
+      virtual bool Transmit(const Link& link, std::size_t bytes, double& delay) = 0;
+};
+
+/** Delays every message by the same time. */
+class NSDNetFixedDelayLink : public NSDNetLinkModel
+{
+   public:
+      NSDNetFixedDelayLink(double delay) : delay(delay) {}
+      virtual bool Transmit(const Link& link, std::size_t bytes, double& delay);
+
+   private:
+      double delay;
+};
+
+/**
+ * Loses messages with the distance between the robots: never beyond the
+ * range, otherwise with a probability growing with the square of the
+ * distance up to a given loss at the edge of the range.
+ */
+class NSDNetRangeLossLink : public NSDNetLinkModel
+{
+   public:
+      NSDNetRangeLossLink(double range, double loss, uint32_t seed);
+      virtual bool Transmit(const Link& link, std::size_t bytes, double& delay);
+
+   private:
+      double range;
+      double loss;
+      boost::mutex mutex;
+      boost::mt19937 random;
+};
+
+/** Queues each robot's messages behind each other at a given rate. */
+class NSDNetBandwidthLink : public NSDNetLinkModel
+{
+   public:
+      /** \param rate The rate in bytes per second. */
+      NSDNetBandwidthLink(double rate) : rate(rate), busyUntil(0.0) {}
+      virtual bool Transmit(const Link& link, std::size_t bytes, double& delay);
+
+   private:
+      double rate;
+      /** When the messages sent so far are all on their way. */
+      double busyUntil;
+      boost::mutex mutex;
+};
+
+/** Passes messages through several models in turn. */
+class NSDNetLinkChain : public NSDNetLinkModel
+{
+   public:
+      /** Adds a model to the end of the chain, which owns it. */
+      void Add(NSDNetLinkModel *model) { models.push_back(boost::shared_ptr<NSDNetLinkModel>(model)); }
+      bool Empty() const { return models.empty(); }
+      virtual bool Transmit(const Link& link, std::size_t bytes, double& delay);
+
+   private:
+      std::vector<boost::shared_ptr<NSDNetLinkModel> > models;
+};
+
+class NSDNetLoopback : public PlayerNSDLink
+{
+   public:
+      /**
+       * Creates an endpoint on the process's bus.
+       * \param handler The handler of the driver.
+       * \param model The link model of the messages sent, none for a
+       * perfect link.
+       * \param threads The number of delivery threads, if this is the first
+       * endpoint of the process.
+       * \param cellSize The cell size of the bus's index of positions, if
+       * this is the first endpoint of the process.
+       */
+      NSDNetLoopback(PlayerNSDClient::Handler& handler,
+         const boost::shared_ptr<NSDNetLinkModel>& model, std::size_t threads = 1,
+         double cellSize = PLAYERNSD_GRID_CELL);
+      ~NSDNetLoopback();
+
+      /**
+       * Goes through the states of a connection, registering through the
+       * handler.
+       */
+      void Connect();
+
+      /**
+       * Sets the position used by the link model until the robot sets its
+       * "self.position".
+       */
+      void SetPosition(double x, double y);
+
+      virtual void Register(const std::string &clientID);
+      virtual void RequestClientList();
+      virtual void Send(const std::string& target, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void Send(uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendTopic(const std::string& topic, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendGroup(const std::vector<std::string>& targets, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendRange(double radius, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void Subscribe(const std::set<std::string>& topics);
+      virtual void PropertyGet(const std::string& variable);
+      virtual void PropertySet(const std::string& variable, const std::string& value);
+      virtual void PropertyWatch(const std::set<std::string>& keys);
+      virtual void Tick(uint32_t tick);
+      virtual void GetMetrics(Metrics& metrics);
+      virtual void Close();
+
+      struct Node;
+      class Bus;
+
+   private:
+      void send(const std::vector<boost::shared_ptr<Node> >& targets, const std::string& topic,
+         uint32_t len, const char *data);
+      void changed(const boost::shared_ptr<Node>& to, const std::string& variable,
+         const PlayerNSDSendQueue::Payload& value);
+      static bool watches(const std::set<std::string>& watched, const std::string& variable);
+
+      PlayerNSDClient::Handler& handler;
+      boost::shared_ptr<NSDNetLinkModel> model;
+      boost::shared_ptr<Node> node;
+      Bus& bus;
+};
+
+#endif
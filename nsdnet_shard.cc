@@ -0,0 +1,523 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet link over several playernsd daemons
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
+#include "nsdnet_shard.h"
+
+/** Prefix of the properties of the robot itself, kept by its home shard. */
+#define NSDNET_SHARD_SELF_KEY "self."
+
+/** One daemon, with the handler its client reports to. */
+struct NSDNetShardedLink::Shard
+{
+   /** Passes what a shard's client reports on to the link. */
+   class Handler : public PlayerNSDClient::Handler
+   {
+      public:
+         Handler(NSDNetShardedLink& link, std::size_t index) : link(link), index(index) {}
+
+         virtual void ErrorRaised(PlayerNSDClient::ServerError err, const std::string& message)
+         {
+            link.errorRaised(index, err, message);
+         }
+         // Each message is sent on one shard only, so any shard may deliver.
+         virtual void Receive(const std::string& source, const std::string& data)
+         {
+            link.handler.Receive(source, data);
+         }
+         virtual void Receive(const std::string& source, int len, const char *data)
+         {
+            link.handler.Receive(source, len, data);
+         }
+         virtual void ReceiveChunk(const std::string& source, uint32_t total, uint32_t offset,
+            int len, const char *data)
+         {
+            link.handler.ReceiveChunk(source, total, offset, len, data);
+         }
+         virtual void ReceiveTopic(const std::string& source, const std::string& topic,
+            int len, const char *data)
+         {
+            link.handler.ReceiveTopic(source, topic, len, data);
+         }
+         virtual void ClientListResponse(const std::vector<std::string>& clientList)
+         {
+            link.clientListResponse(index, clientList);
+         }
+         virtual void PropertyValue(const std::string& variable, const std::string& value)
+         {
+            link.propertyResult(index, true, value);
+         }
+         virtual void PropertyChanged(const std::string& variable, const std::string& value)
+         {
+            if (link.isHome(index))
+               link.handler.PropertyChanged(variable, value);
+         }
+         virtual void TickReached(uint32_t tick)
+         {
+            link.tickReached(index, tick);
+         }
+         virtual void StateChanged(PlayerNSDClient::ConnectionState state)
+         {
+            link.stateChanged(index, state);
+         }
+
+      private:
+         NSDNetShardedLink& link;
+         std::size_t index;
+   };
+
+   Shard(NSDNetShardedLink& link, std::size_t index, const std::string& host,
+      const std::string& port) :
+      host(host), port(port), registering(false), reached(0), handler(link, index),
+      client(handler) {}
+
+   std::string host, port;
+   /** Whether the robot's id has been sent to the shard to register. */
+   bool registering;
+   /** The last tick the shard has reached. */
+   uint32_t reached;
+   /** The lookups asked of this shard, which it answers in order. */
+   std::deque<boost::shared_ptr<Lookup> > asked;
+   Handler handler;
+   PlayerNSDClient client;
+};
+
+NSDNetShardedLink::NSDNetShardedLink(PlayerNSDClient::Handler& handler,
+   const std::map<std::string, std::size_t>& homes) :
+   handler(handler), homes(homes), home(0), homed(false), accepted(false), greeted(false),
+   watching(false), listPending(0), reached(0)
+{
+}
+
+NSDNetShardedLink::~NSDNetShardedLink()
+{
+   // Stop the clients before anything they call back into goes away.
+   shards.clear();
+}
+
+PlayerNSDClient& NSDNetShardedLink::AddShard(const std::string& host, const std::string& port)
+{
+   shards.push_back(boost::shared_ptr<Shard>(new Shard(*this, shards.size(), host, port)));
+   listAsked.push_back(false);
+   return shards.back()->client;
+}
+
+void NSDNetShardedLink::Connect()
+{
+   BOOST_FOREACH(const boost::shared_ptr<Shard>& shard, shards)
+      shard->client.ConnectAsync(shard->host, shard->port);
+}
+
+std::size_t NSDNetShardedLink::ShardOf(const std::string& clientID) const
+{
+   std::map<std::string, std::size_t>::const_iterator it = homes.find(clientID);
+   if (it != homes.end() && it->second < shards.size())
+      return it->second;
+   // A robot whose id clashed is registered again with "_" appended, and
+   // keeps the home of its first id.
+   std::string base = clientID.substr(0, clientID.find_last_not_of('_') + 1);
+   if (base.size() < clientID.size() && !base.empty())
+      return ShardOf(base);
+   // FNV-1a, so that every driver on every host agrees.
+   uint32_t hash = 2166136261u;
+   for (std::size_t i = 0; i < clientID.size(); i++)
+   {
+      hash ^= (unsigned char)clientID[i];
+      hash *= 16777619u;
+   }
+   return shards.empty() ? 0 : hash % shards.size();
+}
+
+void NSDNetShardedLink::ParseEndpoint(const std::string& endpoint, const std::string& defaultPort,
+   std::string& host, std::string& port)
+{
+   std::size_t colon = endpoint.rfind(':');
+   host = endpoint;
+   port = defaultPort;
+   if (boost::starts_with(endpoint, PLAYERNSD_UNIX_PREFIX) || colon == std::string::npos)
+      return;
+   if (endpoint[0] == '[')
+   {
+      // An IPv6 address, "[::1]:9999" or "[::1]".
+      std::size_t close = endpoint.find(']');
+      if (close == std::string::npos)
+         return;
+      host = endpoint.substr(1, close - 1);
+      if (colon == close + 1)
+         port = endpoint.substr(colon + 1);
+   }
+   else if (endpoint.find(':') == colon)
+   {
+      host = endpoint.substr(0, colon);
+      port = endpoint.substr(colon + 1);
+   }
+   // Otherwise a bare IPv6 address, without a port.
+}
+
+void NSDNetShardedLink::Register(const std::string &clientID)
+{
+   bool registerHome;
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      id = clientID;
+      // A renamed robot keeps its home, which every driver agrees on.
+      if (!homed)
+      {
+         home = ShardOf(clientID);
+         homed = true;
+      }
+      // The other shards are registered once the home has taken the id.
+      registerHome = !shards.empty() && startRegistering(home);
+      if (watching)
+         shards[home]->client.PropertyWatch(watched);
+   }
+   if (registerHome)
+      shards[home]->client.Register(clientID);
+}
+
+bool NSDNetShardedLink::startRegistering(std::size_t shard)
+{
+   if (shards[shard]->registering ||
+      shards[shard]->client.GetConnectionState() != PlayerNSDClient::StateGreeting)
+      return false;
+   shards[shard]->registering = true;
+   return true;
+}
+
+void NSDNetShardedLink::stateChanged(std::size_t shard, PlayerNSDClient::ConnectionState state)
+{
+   if (state == PlayerNSDClient::StateGreeting)
+   {
+      std::string registerAs;
+      bool first = false;
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         if (id.empty() && !greeted)
+            first = greeted = true;
+         if (!id.empty() && (isHome(shard) || accepted) && startRegistering(shard))
+            registerAs = id;
+      }
+      // The driver registers on the first greeting, which registers the
+      // home shard if it is waiting.
+      if (!registerAs.empty())
+         shards[shard]->client.Register(registerAs);
+      else if (first)
+         handler.StateChanged(state);
+      return;
+   }
+   if (state == PlayerNSDClient::StateRegistered && isHome(shard))
+   {
+      // Every robot takes its id on its home shard first, so an id the home
+      // has accepted is free on every other shard.
+      std::vector<std::size_t> greeting;
+      std::string registerAs;
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         accepted = true;
+         registerAs = id;
+         for (std::size_t i = 0; i < shards.size(); i++)
+            if (startRegistering(i))
+               greeting.push_back(i);
+      }
+      BOOST_FOREACH(std::size_t i, greeting)
+         shards[i]->client.Register(registerAs);
+   }
+   // A shard that cannot be reached is reported, whichever it is.
+   if (isHome(shard) || state == PlayerNSDClient::StateDisconnected)
+      handler.StateChanged(state);
+}
+
+void NSDNetShardedLink::errorRaised(std::size_t shard, PlayerNSDClient::ServerError err,
+   const std::string& message)
+{
+   switch (err)
+   {
+      case PlayerNSDClient::ServerErrorPropertyNotExist:
+         propertyResult(shard, false, std::string());
+         break;
+      case PlayerNSDClient::ServerErrorClientIDInUse:
+         {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            shards[shard]->registering = false;
+         }
+         // The driver retries under another id, on the home shard first.
+         if (isHome(shard))
+            handler.ErrorRaised(err, message);
+         else
+            // Only when the drivers disagree on the shards, as the home
+            // shard took the id first; the robot stays off this shard.
+            handler.ErrorRaised(PlayerNSDClient::ServerErrorUnknown,
+               "shard " + boost::lexical_cast<std::string>(shard) + ": " + message);
+         break;
+      case PlayerNSDClient::ServerErrorAlreadyRegistered:
+         if (isHome(shard))
+            handler.ErrorRaised(err, message);
+         break;
+      default:
+         handler.ErrorRaised(err, message);
+         break;
+   }
+}
+
+void NSDNetShardedLink::RequestClientList()
+{
+   std::vector<std::size_t> ask;
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      listMerged.clear();
+      listSeen.clear();
+      listPending = 0;
+      for (std::size_t i = 0; i < shards.size(); i++)
+      {
+         listAsked[i] = shards[i]->client.GetConnectionState() == PlayerNSDClient::StateRegistered;
+         if (listAsked[i])
+         {
+            listPending++;
+            ask.push_back(i);
+         }
+      }
+   }
+   if (ask.empty())
+   {
+      handler.ClientListResponse(std::vector<std::string>());
+      return;
+   }
+   BOOST_FOREACH(std::size_t i, ask)
+      shards[i]->client.RequestClientList();
+}
+
+void NSDNetShardedLink::clientListResponse(std::size_t shard,
+   const std::vector<std::string>& clientList)
+{
+   std::vector<std::string> merged;
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      if (!listAsked[shard])
+         return;
+      listAsked[shard] = false;
+      // Every robot is registered with every shard, so each is listed once.
+      BOOST_FOREACH(const std::string& clientID, clientList)
+         if (listSeen.insert(clientID).second)
+            listMerged.push_back(clientID);
+      if (--listPending)
+         return;
+      merged.swap(listMerged);
+      listSeen.clear();
+   }
+   handler.ClientListResponse(merged);
+}
+
+void NSDNetShardedLink::Send(const std::string& target, uint32_t len, const char *data,
+   Priority priority)
+{
+   if (!shards.empty())
+      shards[ShardOf(target)]->client.Send(target, len, data, priority);
+}
+
+void NSDNetShardedLink::Send(uint32_t len, const char *data, Priority priority)
+{
+   // Every robot is registered with the home shard, which fans it out.
+   if (!shards.empty())
+      shards[home]->client.Send(len, data, priority);
+}
+
+void NSDNetShardedLink::SendTopic(const std::string& topic, uint32_t len, const char *data,
+   Priority priority)
+{
+   if (!shards.empty())
+      shards[home]->client.SendTopic(topic, len, data, priority);
+}
+
+void NSDNetShardedLink::SendGroup(const std::vector<std::string>& targets, uint32_t len,
+   const char *data, Priority priority)
+{
+   std::vector<std::vector<std::string> > byShard(shards.size());
+   BOOST_FOREACH(const std::string& target, targets)
+      byShard[ShardOf(target)].push_back(target);
+   for (std::size_t i = 0; i < byShard.size(); i++)
+      if (!byShard[i].empty())
+         shards[i]->client.SendGroup(byShard[i], len, data, priority);
+}
+
+void NSDNetShardedLink::SendRange(double radius, uint32_t len, const char *data,
+   Priority priority)
+{
+   if (!shards.empty())
+      shards[home]->client.SendRange(radius, len, data, priority);
+}
+
+void NSDNetShardedLink::Subscribe(const std::set<std::string>& topics)
+{
+   // Topic messages arrive from the home shards of their senders.
+   BOOST_FOREACH(const boost::shared_ptr<Shard>& shard, shards)
+      shard->client.Subscribe(topics);
+}
+
+void NSDNetShardedLink::PropertyGet(const std::string& variable)
+{
+   boost::shared_ptr<Lookup> lookup(new Lookup(variable));
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      lookups.push_back(lookup);
+      ask(lookup);
+   }
+   answer();
+}
+
+void NSDNetShardedLink::ask(const boost::shared_ptr<Lookup>& lookup)
+{
+   // The robot's own properties are only known to its home shard.
+   std::size_t limit = boost::starts_with(lookup->variable, NSDNET_SHARD_SELF_KEY) ?
+      1 : shards.size();
+   while (lookup->tried < limit)
+   {
+      std::size_t i = (home + lookup->tried++) % shards.size();
+      // The home shard is asked even before it is registered, as the
+      // client holds the request until then.
+      if (lookup->tried > 1 &&
+         shards[i]->client.GetConnectionState() != PlayerNSDClient::StateRegistered)
+         continue;
+      shards[i]->asked.push_back(lookup);
+      shards[i]->client.PropertyGet(lookup->variable);
+      return;
+   }
+   lookup->done = true;
+}
+
+void NSDNetShardedLink::propertyResult(std::size_t shard, bool found, const std::string& value)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      std::deque<boost::shared_ptr<Lookup> >& asked = shards[shard]->asked;
+      if (asked.empty())
+         return;
+      boost::shared_ptr<Lookup> lookup = asked.front();
+      asked.pop_front();
+      if (found)
+      {
+         lookup->value = value;
+         lookup->found = lookup->done = true;
+      }
+      else
+         ask(lookup);
+   }
+   answer();
+}
+
+void NSDNetShardedLink::answer()
+{
+   boost::lock_guard<boost::mutex> order(answerMutex);
+   std::vector<boost::shared_ptr<Lookup> > ready;
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      while (!lookups.empty() && lookups.front()->done)
+      {
+         ready.push_back(lookups.front());
+         lookups.pop_front();
+      }
+   }
+   // Outside the lock, as the driver may be asking for more meanwhile.
+   BOOST_FOREACH(const boost::shared_ptr<Lookup>& lookup, ready)
+   {
+      if (lookup->found)
+         handler.PropertyValue(lookup->variable, lookup->value);
+      else
+         handler.ErrorRaised(PlayerNSDClient::ServerErrorPropertyNotExist, "error propertynotexist");
+   }
+}
+
+void NSDNetShardedLink::PropertySet(const std::string& variable, const std::string& value)
+{
+   if (shards.empty())
+      return;
+   // Every shard needs the position, to work out range broadcasts.
+   if (boost::starts_with(variable, NSDNET_SHARD_SELF_KEY) && variable != "self.position")
+   {
+      shards[home]->client.PropertySet(variable, value);
+      return;
+   }
+   BOOST_FOREACH(const boost::shared_ptr<Shard>& shard, shards)
+      shard->client.PropertySet(variable, value);
+}
+
+void NSDNetShardedLink::PropertyWatch(const std::set<std::string>& keys)
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   watched = keys;
+   watching = true;
+   if (!shards.empty())
+      shards[home]->client.PropertyWatch(keys);
+}
+
+void NSDNetShardedLink::Tick(uint32_t tick)
+{
+   BOOST_FOREACH(const boost::shared_ptr<Shard>& shard, shards)
+      shard->client.Tick(tick);
+}
+
+void NSDNetShardedLink::tickReached(std::size_t shard, uint32_t tick)
+{
+   uint32_t all;
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      shards[shard]->reached = std::max(shards[shard]->reached, tick);
+      // Messages of the tick may come from any shard, so it is only
+      // reached once every shard has reached it.
+      all = tick;
+      BOOST_FOREACH(const boost::shared_ptr<Shard>& s, shards)
+         all = std::min(all, s->reached);
+      if (all <= reached)
+         return;
+      reached = all;
+   }
+   handler.TickReached(all);
+}
+
+void NSDNetShardedLink::Close()
+{
+   // Each shard gets the whole close timeout, so drain them side by side.
+   boost::thread_group closers;
+   BOOST_FOREACH(const boost::shared_ptr<Shard>& shard, shards)
+      closers.create_thread(boost::bind(&PlayerNSDClient::Close, &shard->client));
+   closers.join_all();
+}
+
+void NSDNetShardedLink::GetMetrics(Metrics& metrics)
+{
+   metrics["shard.home"] = home;
+   for (std::size_t i = 0; i < shards.size(); i++)
+   {
+      Metrics shardMetrics;
+      shards[i]->client.GetMetrics(shardMetrics);
+      std::stringstream prefix;
+      prefix << "shard." << i << ".";
+      for (Metrics::const_iterator it = shardMetrics.begin(); it != shardMetrics.end(); ++it)
+         metrics[prefix.str() + it->first] = it->second;
+   }
+}
@@ -0,0 +1,178 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet link over several playernsd daemons
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * Spreads the robots over several playernsd daemons (shards) for swarms
+ * larger than one daemon can serve.  Each robot has a home shard, from an
+ * explicit map or else a hash of its id, which every driver works out the
+ * same way as long as they share the list of shards and the map.
+ *
+ * A robot connects and registers with every shard, and takes in messages
+ * from all of them.  It registers with its home shard first, and with the
+ * others once the home has taken its id, so that it has the same id on
+ * every shard.  A message to a robot goes to that robot's home shard,
+ * and broadcasts, range broadcasts and topic messages go to the sender's
+ * home shard only, which fans them out once to the whole swarm.
+ *
+ * Client lists are merged from all the shards, and a property lookup goes
+ * to the home shard first and then to the others in turn until one has the
+ * property.  Properties of the robot itself ("self.*") and watches stay on
+ * the home shard, other property updates, and the robot's position, are
+ * sent to every shard.  The ends of simulation ticks go to every shard, and
+ * a tick is reached once every shard has reached it.
+ */
+
+#ifndef _NSDNET_SHARD_H_
+#define _NSDNET_SHARD_H_
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "playernsd_client.h"
+
+class NSDNetShardedLink : public PlayerNSDLink
+{
+   public:
+      /**
+       * Creates a link without shards.
+       * \param handler The handler of the driver.
+       * \param homes Robot ids with the index of their home shard, the
+       * others are placed by a hash of their id.
+       */
+      NSDNetShardedLink(PlayerNSDClient::Handler& handler,
+         const std::map<std::string, std::size_t>& homes);
+      ~NSDNetShardedLink();
+
+      /**
+       * Adds the next shard, to be configured before connecting.
+       * \param host The host of its daemon.
+       * \param port The port of its daemon.
+       * \return The client for the shard.
+       */
+      PlayerNSDClient& AddShard(const std::string& host, const std::string& port);
+
+      /** Starts connecting to all the shards in the background. */
+      void Connect();
+
+      /**
+       * Gets the home shard of a robot.  An id with "_" appended, as the
+       * driver registers a robot whose id clashed, has the home of the id
+       * without them.
+       * \param clientID The id of the robot.
+       * \return The index of the shard.
+       */
+      std::size_t ShardOf(const std::string& clientID) const;
+
+      /**
+       * Splits a "host:port" endpoint; an IPv6 address is given as
+       * "[addr]:port", and a unix domain socket as "unix:/path", without a
+       * port.
+       * \param endpoint The endpoint.
+       * \param defaultPort The port if the endpoint has none.
+       * \param host The host.
+       * \param port The port.
+       */
+      static void ParseEndpoint(const std::string& endpoint, const std::string& defaultPort,
+         std::string& host, std::string& port);
+
+      virtual void Register(const std::string &clientID);
+      virtual void RequestClientList();
+      virtual void Send(const std::string& target, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void Send(uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendTopic(const std::string& topic, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendGroup(const std::vector<std::string>& targets, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendRange(double radius, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void Subscribe(const std::set<std::string>& topics);
+      virtual void PropertyGet(const std::string& variable);
+      virtual void PropertySet(const std::string& variable, const std::string& value);
+      virtual void PropertyWatch(const std::set<std::string>& keys);
+      virtual void Tick(uint32_t tick);
+      virtual void GetMetrics(Metrics& metrics);
+      virtual void Close();
+
+      struct Shard;
+
+   private:
+      /** A property lookup, passed from shard to shard until found. */
+      struct Lookup
+      {
+         Lookup(const std::string& variable) : variable(variable), tried(0), done(false), found(false) {}
+         std::string variable;
+         std::string value;
+         /** The number of shards asked so far. */
+         std::size_t tried;
+         bool done;
+         bool found;
+      };
+
+      bool isHome(std::size_t shard) const { return shard == home; }
+      bool startRegistering(std::size_t shard);
+      void stateChanged(std::size_t shard, PlayerNSDClient::ConnectionState state);
+      void errorRaised(std::size_t shard, PlayerNSDClient::ServerError err, const std::string& message);
+      void clientListResponse(std::size_t shard, const std::vector<std::string>& clientList);
+      void tickReached(std::size_t shard, uint32_t tick);
+      void propertyResult(std::size_t shard, bool found, const std::string& value);
+      void ask(const boost::shared_ptr<Lookup>& lookup);
+      void answer();
+
+      PlayerNSDClient::Handler& handler;
+      std::map<std::string, std::size_t> homes;
+      boost::atomic<std::size_t> home;
+      bool homed;
+
+      /** Guards the state below and the lookups of each shard. */
+      boost::mutex mutex;
+      std::string id;
+      /** Whether the home shard has taken the robot's id. */
+      bool accepted;
+      bool greeted;
+      std::set<std::string> watched;
+      bool watching;
+      /** Shards yet to answer the client list request, and the answers. */
+      std::vector<bool> listAsked;
+      std::size_t listPending;
+      std::vector<std::string> listMerged;
+      std::set<std::string> listSeen;
+      /** Property lookups in the order they were asked. */
+      std::deque<boost::shared_ptr<Lookup> > lookups;
+      /** Keeps the answers to lookups in order when shards answer at once. */
+      boost::mutex answerMutex;
+      /** The last tick every shard has reached. */
+      uint32_t reached;
+
+      /** Destroyed first, as their threads call back into the link. */
+      std::vector<boost::shared_ptr<Shard> > shards;
+};
+
+#endif
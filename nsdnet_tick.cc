@@ -0,0 +1,169 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet link batching traffic per simulation tick
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ */
+
+#include <algorithm>
+#include "nsdnet_tick.h"
+
+NSDNetTickLink::NSDNetTickLink(PlayerNSDLink *link) :
+   link(link), lastTick(0), ticks(0), flushed(0)
+{
+}
+
+NSDNetTickLink::Held& NSDNetTickLink::hold(Held::Kind kind, Priority priority,
+   uint32_t len, const char *data)
+{
+   held.push_back(Held(kind, priority));
+   if (len)
+      held.back().data.assign(data, len);
+   return held.back();
+}
+
+void NSDNetTickLink::Register(const std::string &clientID)
+{
+   link->Register(clientID);
+}
+
+void NSDNetTickLink::RequestClientList()
+{
+   link->RequestClientList();
+}
+
+void NSDNetTickLink::Send(const std::string& target, uint32_t len, const char *data,
+   Priority priority)
+{
+   hold(Held::KindSend, priority, len, data).name = target;
+}
+
+void NSDNetTickLink::Send(uint32_t len, const char *data, Priority priority)
+{
+   hold(Held::KindBroadcast, priority, len, data);
+}
+
+void NSDNetTickLink::SendTopic(const std::string& topic, uint32_t len, const char *data,
+   Priority priority)
+{
+   hold(Held::KindTopic, priority, len, data).name = topic;
+}
+
+void NSDNetTickLink::SendGroup(const std::vector<std::string>& targets, uint32_t len,
+   const char *data, Priority priority)
+{
+   hold(Held::KindGroup, priority, len, data).targets = targets;
+}
+
+void NSDNetTickLink::SendRange(double radius, uint32_t len, const char *data,
+   Priority priority)
+{
+   hold(Held::KindRange, priority, len, data).radius = radius;
+}
+
+void NSDNetTickLink::Subscribe(const std::set<std::string>& topics)
+{
+   link->Subscribe(topics);
+}
+
+void NSDNetTickLink::PropertyGet(const std::string& variable)
+{
+   // The robot reads back what it set, as it would outside tick mode, so
+   // the updates of the key go out ahead of the lookup.
+   std::size_t kept = 0;
+   for (std::size_t i = 0; i < held.size(); i++)
+   {
+      if (held[i].kind == Held::KindProperty && held[i].name == variable)
+      {
+         link->PropertySet(held[i].name, held[i].data);
+         flushed++;
+      }
+      else if (kept++ != i)
+         std::swap(held[kept - 1], held[i]);
+   }
+   held.erase(held.begin() + kept, held.end());
+   link->PropertyGet(variable);
+}
+
+void NSDNetTickLink::PropertySet(const std::string& variable, const std::string& value)
+{
+   Held& update = hold(Held::KindProperty, PlayerNSDSendQueue::PriorityControl);
+   update.name = variable;
+   update.data = value;
+}
+
+void NSDNetTickLink::PropertyWatch(const std::set<std::string>& keys)
+{
+   link->PropertyWatch(keys);
+}
+
+void NSDNetTickLink::Tick(uint32_t tick)
+{
+   flush();
+   lastTick = tick;
+   ticks++;
+   link->Tick(tick);
+}
+
+void NSDNetTickLink::Close()
+{
+   flush();
+   link->Close();
+}
+
+void NSDNetTickLink::flush()
+{
+   for (std::size_t i = 0; i < held.size(); i++)
+   {
+      const Held& h = held[i];
+      switch (h.kind)
+      {
+         case Held::KindSend:
+            link->Send(h.name, h.data.size(), h.data.data(), h.priority);
+            break;
+         case Held::KindBroadcast:
+            link->Send(h.data.size(), h.data.data(), h.priority);
+            break;
+         case Held::KindTopic:
+            link->SendTopic(h.name, h.data.size(), h.data.data(), h.priority);
+            break;
+         case Held::KindGroup:
+            link->SendGroup(h.targets, h.data.size(), h.data.data(), h.priority);
+            break;
+         case Held::KindRange:
+            link->SendRange(h.radius, h.data.size(), h.data.data(), h.priority);
+            break;
+         case Held::KindProperty:
+            link->PropertySet(h.name, h.data);
+            break;
+      }
+   }
+   flushed += held.size();
+   held.clear();
+}
+
+void NSDNetTickLink::GetMetrics(Metrics& metrics)
+{
+   link->GetMetrics(metrics);
+   metrics["tick.last"] = lastTick;
+   metrics["tick.count"] = ticks;
+   metrics["tick.held"] = held.size();
+   metrics["tick.flushed"] = flushed;
+}
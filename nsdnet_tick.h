@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet link batching traffic per simulation tick
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * Wraps another link for lockstep runs.  The messages and property updates
+ * of a simulation tick are held until the tick ends, and then go out
+ * together, followed by the end of the tick, so that what a robot sends in
+ * a tick does not depend on how its threads happened to be scheduled.
+ *
+ * Requests that are answered (property lookups, client lists) and
+ * subscriptions go straight through, a property lookup after the updates
+ * of the same key held so far.  The link is not locked, it is used
+ * from the driver's thread only.
+ */
+
+#ifndef _NSDNET_TICK_H_
+#define _NSDNET_TICK_H_
+
+#include <string>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+#include "playernsd_client.h"
+
+class NSDNetTickLink : public PlayerNSDLink
+{
+   public:
+      /** \param link The link to send through, owned from now on. */
+      NSDNetTickLink(PlayerNSDLink *link);
+
+      virtual void Register(const std::string &clientID);
+      virtual void RequestClientList();
+      virtual void Send(const std::string& target, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void Send(uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendTopic(const std::string& topic, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendGroup(const std::vector<std::string>& targets, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void SendRange(double radius, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      virtual void Subscribe(const std::set<std::string>& topics);
+      virtual void PropertyGet(const std::string& variable);
+      virtual void PropertySet(const std::string& variable, const std::string& value);
+      virtual void PropertyWatch(const std::set<std::string>& keys);
+      /** Sends what was held for the tick, then ends the tick. */
+      virtual void Tick(uint32_t tick);
+      virtual void GetMetrics(Metrics& metrics);
+      /** Sends what was held for the unfinished tick, then closes the link. */
+      virtual void Close();
+
+   private:
+      /** A message or property update held until the end of the tick. */
+      struct Held
+      {
+         enum Kind
+         {
+            KindSend,
+            KindBroadcast,
+            KindTopic,
+            KindGroup,
+            KindRange,
+            KindProperty,
+         };
+
+         Held(Kind kind, Priority priority) : kind(kind), priority(priority), radius(0.0) {}
+         Kind kind;
+         Priority priority;
+         /** The target, topic or property key. */
+         std::string name;
+         std::vector<std::string> targets;
+         double radius;
+         /** The message or property value. */
+         std::string data;
+      };
+
+      Held& hold(Held::Kind kind, Priority priority, uint32_t len = 0, const char *data = NULL);
+      void flush();
+
+      boost::scoped_ptr<PlayerNSDLink> link;
+      std::vector<Held> held;
+      uint32_t lastTick;
+      uint64_t ticks;
+      uint64_t flushed;
+};
+
+#endif
@@ -0,0 +1,109 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet world file cache
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ */
+
+#include <cstring>
+#include <map>
+#include <utility>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/unordered_map.hpp>
+#include "nsdnet_world_cache.h"
+
+/** Models of a world file, by name. */
+typedef boost::unordered_map<std::string, NSDNetWorldCache::ModelOrigin> ModelIndex;
+
+static boost::mutex cacheMutex;
+/** Stage world file and model, by Player config file. */
+static std::map<ConfigFile *, std::pair<std::string, std::string> > stageConfigs;
+/** Parsed world files, by file name. */
+static std::map<std::string, ModelIndex> worlds;
+
+void NSDNetWorldCache::GetStageConfig(ConfigFile *cf, std::string& worldFile, std::string& model)
+{
+   boost::lock_guard<boost::mutex> lock(cacheMutex);
+   std::map<ConfigFile *, std::pair<std::string, std::string> >::iterator it = stageConfigs.find(cf);
+   if (it == stageConfigs.end())
+   {
+      // Iterate sections to find stage
+      std::pair<std::string, std::string> stage;
+      for (int i = 0; i < cf->GetSectionCount(); i++)
+      {
+         const char *value = cf->ReadString(i, "name", NULL);
+         if (value && !strcmp(value, "stage"))
+         {
+            if ((value = cf->ReadFilename(i, "worldfile", NULL)))
+            {
+               stage.first = value;
+            }
+            if ((value = cf->ReadString(i, "model", NULL)))
+            {
+               stage.second = value;
+            }
+         }
+      }
+      it = stageConfigs.insert(std::make_pair(cf, stage)).first;
+   }
+   worldFile = it->second.first;
+   model = it->second.second;
+}
+
+bool NSDNetWorldCache::GetModelOrigin(const std::string& worldFile, const std::string& model,
+   ModelOrigin& origin)
+{
+   boost::lock_guard<boost::mutex> lock(cacheMutex);
+   std::map<std::string, ModelIndex>::iterator world = worlds.find(worldFile);
+   if (world == worlds.end())
+   {
+      // Parse the world file once; a file that fails to load is remembered
+      // as having no models.
+      world = worlds.insert(std::make_pair(worldFile, ModelIndex())).first;
+      ConfigFile worldCf;
+      if (worldCf.Load(worldFile.c_str()))
+      {
+         for (int i = 0; i < worldCf.GetSectionCount(); i++)
+         {
+            const char *value = worldCf.ReadString(i, "name", NULL);
+            // The first model with a name wins.
+            if (!value || world->second.count(value))
+               continue;
+            ModelOrigin& o = world->second[value];
+            // Get pose origin
+            o.pose.x = worldCf.ReadTupleLength(i, "pose", 0, 0.0);
+            o.pose.y = worldCf.ReadTupleLength(i, "pose", 1, 0.0);
+            o.pose.z = worldCf.ReadTupleLength(i, "pose", 2, 0.0);
+            o.pose.a = worldCf.ReadTupleAngle(i, "pose", 3, 0.0);
+            // Get localization origin
+            o.localization.x = worldCf.ReadTupleLength(i, "localization_origin", 0, 0.0);
+            o.localization.y = worldCf.ReadTupleLength(i, "localization_origin", 1, 0.0);
+            o.localization.z = worldCf.ReadTupleLength(i, "localization_origin", 2, 0.0);
+            o.localization.a = worldCf.ReadTupleAngle(i, "localization_origin", 3, 0.0);
+         }
+      }
+   }
+   ModelIndex::const_iterator it = world->second.find(model);
+   if (it == world->second.end())
+      return false;
+   origin = it->second;
+   return true;
+}
@@ -0,0 +1,74 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief nsdnet world file cache
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * Every driver instance needs the pose and localization origin of its model
+ * from the Stage world file.  The cache parses the Player config file and
+ * the world file once per process and indexes the models by name, so that
+ * the rest of the driver instances only do a lookup.
+ */
+
+#ifndef _NSDNET_WORLD_CACHE_H_
+#define _NSDNET_WORLD_CACHE_H_
+
+#include <string>
+#include <libplayercore/playercore.h>
+
+class NSDNetWorldCache
+{
+   public:
+      /** A pose as read from the world file. */
+      struct Pose
+      {
+         Pose() : x(0.0), y(0.0), z(0.0), a(0.0) {}
+         double x, y, z, a;
+      };
+
+      /** The origins of a model in the world file. */
+      struct ModelOrigin
+      {
+         Pose pose;
+         Pose localization;
+      };
+
+      /**
+       * Gets the Stage world file and model named in a Player config file.
+       * \param cf The Player config file.
+       * \param worldFile The world file, empty if there is none.
+       * \param model The model, empty if there is none.
+       */
+      static void GetStageConfig(ConfigFile *cf, std::string& worldFile, std::string& model);
+
+      /**
+       * Gets the origins of a model, parsing the world file on first use.
+       * \param worldFile The world file.
+       * \param model The name of the model.
+       * \param origin The origins of the model, untouched if not found.
+       * \return true if the model was found.
+       */
+      static bool GetModelOrigin(const std::string& worldFile, const std::string& model,
+         ModelOrigin& origin);
+};
+
+#endif
@@ -26,9 +26,12 @@
 #define _NSDNETPROXY_H_
 
 #include "dev_nsdnet.h"
+#include "nsdnet_codec.h"
 #include <libplayerc/playerc.h>
 #include <libplayercommon/playercommon.h>
 #include <libplayerc++/playerc++.h>
+#include <boost/function.hpp>
+#include <map>
 #include <vector>
 #include <string>
 
@@ -53,6 +56,27 @@ class PLAYERCC_EXPORT NSDNetProxy : public ClientProxy
       std::vector<std::string> clientList;
       // property value
       std::string propertyValue;
+      // property values requested together
+      std::map<std::string, std::string> properties;
+
+   public:
+
+      /// Called on each message as it is received (source, topic, data and
+      /// length), returning true to take it rather than have it queued.
+      typedef boost::function<bool (const std::string&, const std::string&,
+         const char *, int)> MessageCallback;
+
+   private:
+
+      // per-message callback
+      MessageCallback messageCallback;
+
+      static int received(nsdnet_t *device, const nsdmsg_t *msg)
+      {
+         NSDNetProxy *proxy = static_cast<NSDNetProxy *>(device->user);
+         return proxy->messageCallback(std::string(msg->clientid), std::string(msg->topic),
+            msg->msg, msg->msg_count);
+      }
 
    public:
 
@@ -66,9 +90,9 @@ class PLAYERCC_EXPORT NSDNetProxy : public ClientProxy
          if (playerc_add_xdr_ftable(player_plugininterf_gettable(), 0) < 0)
             throw PlayerError("Could not add xdr functions\n");
          device = nsdnet_create(mClient, index);
-         device->user = this;
          if (!device)
             throw PlayerError("NSDNetProxy::NSDNetProxy()", "could not create");
+         device->user = this;
          if (nsdnet_subscribe(device, PLAYER_OPEN_MODE))
             throw PlayerError("NSDNetProxy::NSDNetProxy()", "could not subscribe");
          // how can I get this into the clientproxy.cc?
@@ -114,8 +138,89 @@ class PLAYERCC_EXPORT NSDNetProxy : public ClientProxy
          SendMessage(message.length(), message.c_str());
       }
 
+      /// Send a message of a given type, e.g. PLAYER_NSDNET_TYPE_CONTROL
+      /// (an empty target broadcasts).
+      void SendMessageType(const std::string &target, int type, const std::string &message)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         if (nsdnet_send_message_type(this->device, target.empty() ? NULL : target.c_str(),
+            (char)type, message.length(), (char *)message.c_str()))
+            throw PlayerError("NSDNetProxy::SendMessageType()", "error sending message");
+      }
+
+      /// Send a message to a list of clients, with a type such as
+      /// PLAYER_NSDNET_TYPE_CONTROL.
+      void SendGroup(const std::vector<std::string> &targets, const std::string &message,
+         int type = 0)
+      {
+         SendGroup(std::string(), targets, message, type);
+      }
+
+      /// Send a message to the members of a named group (see SetGroup) and
+      /// a list of further clients.
+      void SendGroup(const std::string &group, const std::vector<std::string> &targets,
+         const std::string &message, int type = 0)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         std::vector<const char *> names;
+         for (size_t i = 0; i < targets.size(); i++)
+            names.push_back(targets[i].c_str());
+         if (nsdnet_send_group(this->device, group.empty() ? NULL : group.c_str(),
+            names.empty() ? NULL : &names[0], names.size(), (char)type,
+            message.length(), (char *)message.c_str()))
+            throw PlayerError("NSDNetProxy::SendGroup()", "error sending message");
+      }
+
+      /// Define a named group of clients.
+      void SetGroup(const std::string &group, const std::vector<std::string> &members)
+      {
+         std::string value;
+         for (size_t i = 0; i < members.size(); i++)
+            value += (i ? " " : "") + members[i];
+         SetProperty("driver.group." + group, value);
+      }
+
+      /// Publish a message on a topic, with a type such as
+      /// PLAYER_NSDNET_TYPE_CONTROL.
+      void Publish(const std::string &topic, const std::string &message, int type = 0)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         if (nsdnet_publish(this->device, topic.c_str(), (char)type, message.length(),
+            (char *)message.c_str()))
+            throw PlayerError("NSDNetProxy::Publish()", "error publishing message");
+      }
+
+      /// Broadcast a message to the robots within a radius (in metres) of
+      /// this one, with a type such as PLAYER_NSDNET_TYPE_CONTROL.
+      void SendRange(double radius, const std::string &message, int type = 0)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         if (nsdnet_send_range(this->device, radius, (char)type, message.length(),
+            (char *)message.c_str()))
+            throw PlayerError("NSDNetProxy::SendRange()", "error sending message");
+      }
+
+      /// Set the topics to receive messages on ("*" for every topic).
+      void SetTopics(const std::vector<std::string> &topics)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         std::vector<const char *> names;
+         for (size_t i = 0; i < topics.size(); i++)
+            names.push_back(topics[i].c_str());
+         if (nsdnet_set_topics(this->device, names.empty() ? NULL : &names[0], names.size()))
+            throw PlayerError("NSDNetProxy::SetTopics()", "error setting topics");
+      }
+
       /// Received message.
       bool ReceiveMessage(time_t& timestamp, std::string& source, std::string& message)
+      {
+         std::string topic;
+         return ReceiveMessage(timestamp, source, topic, message);
+      }
+
+      /// Received message, with the topic it was published on (empty if none).
+      bool ReceiveMessage(time_t& timestamp, std::string& source, std::string& topic,
+         std::string& message)
       {
          scoped_lock_t lock(mPc->mMutex);
          int err;
@@ -129,12 +234,95 @@ class PLAYERCC_EXPORT NSDNetProxy : public ClientProxy
                timestamp = msg->timestamp;
                message = std::string(msg->msg, msg->msg_count);
                source = std::string(msg->clientid);
+               topic = std::string(msg->topic);
                return true;
             }
          }
          return false;
       }
 
+      /// Received message, pointing into the receive queue rather than
+      /// copied, valid until the queue wraps around.
+      bool ReceiveMessage(time_t& timestamp, std::string& source, std::string& topic,
+         const char*& data, int& len)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         int err;
+         nsdmsg_t *msg;
+         if ((err = nsdnet_receive_message(this->device, &msg)))
+         {
+            if (err < 0)
+               throw PlayerError("NSDNetProxy::ReceiveMessage()", "error receiving message");
+            timestamp = msg->timestamp;
+            source = std::string(msg->clientid);
+            topic = std::string(msg->topic);
+            data = msg->msg;
+            len = msg->msg_count;
+            return true;
+         }
+         return false;
+      }
+
+      /// Send a message encoded with the nsdnet codec (see nsdnet_codec.h),
+      /// an empty target broadcasts.
+      template <typename T>
+      void Send(const std::string &target, const NSDNetCodecBuilder<T> &message, int type = 0)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         if (nsdnet_send_message_type(this->device, target.empty() ? NULL : target.c_str(),
+            (char)type, message.Size(), (char *)message.Data()))
+            throw PlayerError("NSDNetProxy::Send()", "error sending message");
+      }
+
+      /// Send a message without variable fields encoded with the nsdnet
+      /// codec, an empty target broadcasts.
+      template <typename T>
+      void Send(const std::string &target, const T &message, int type = 0)
+      {
+         Send(target, NSDNetCodecBuilder<T>(message), type);
+      }
+
+      /// Received message, read in place if it was encoded from a T, or
+      /// NULL in message if it was something else (see NSDNetCodec::TypeOf
+      /// to tell, with the data and len of the other ReceiveMessage).
+      template <typename T>
+      bool Receive(time_t& timestamp, std::string& source, const T*& message)
+      {
+         std::string topic;
+         const char *data;
+         int len;
+         if (!ReceiveMessage(timestamp, source, topic, data, len))
+            return false;
+         message = NSDNetCodec::View<T>(data, len);
+         return true;
+      }
+
+      /// Set a callback for each message as it is received, empty to queue
+      /// them all again.  It is called from within PlayerClient::Read, with
+      /// the client locked, so it must not call the client or its proxies.
+      void SetMessageCallback(const MessageCallback &callback)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         messageCallback = callback;
+         device->received = callback ? &NSDNetProxy::received : NULL;
+      }
+
+      /// A descriptor readable while messages are queued, for select or
+      /// poll, -1 if there is none.  When the client is not read by a
+      /// thread of its own (PlayerClient::StartThread), wait on
+      /// GetClientFd as well and read the client when it is readable.
+      int GetEventFd()
+      {
+         return nsdnet_get_fd(device);
+      }
+
+      /// The socket of the client, readable when there is something to
+      /// read.
+      int GetClientFd()
+      {
+         return nsdnet_get_client_fd(device);
+      }
+
       /// Get Last Error message
       bool GetLastErrorMessage(int& code, std::string& error)
       {
@@ -179,17 +367,97 @@ class PLAYERCC_EXPORT NSDNetProxy : public ClientProxy
             throw PlayerError("NSDNetProxy::SetProperty()", "error setting property");
       }
 
+      /// Request the values of several properties at once.
+      void RequestProperties(const std::vector<std::string>& variables)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         std::vector<const char *> keys;
+         for (size_t i = 0; i < variables.size(); i++)
+            keys.push_back(variables[i].c_str());
+         if (nsdnet_property_get_multi(this->device, keys.empty() ? NULL : &keys[0], keys.size()))
+            throw PlayerError("NSDNetProxy::RequestProperties()", "error requesting properties");
+         this->properties.clear();
+         for (int i = 0; i < this->device->props_count; i++)
+            if (this->device->props[i].found)
+               this->properties[this->device->props[i].key] = this->device->props[i].value;
+      }
+
+      /// Get the properties that exist of those last requested together.
+      const std::map<std::string, std::string>& GetProperties()
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         return this->properties;
+      }
+
+      /// Set several properties at once.
+      void SetProperties(const std::map<std::string, std::string>& values)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         std::vector<const char *> keys, vals;
+         for (std::map<std::string, std::string>::const_iterator it = values.begin(); it != values.end(); ++it)
+         {
+            keys.push_back(it->first.c_str());
+            vals.push_back(it->second.c_str());
+         }
+         if (nsdnet_property_set_multi(this->device, keys.empty() ? NULL : &keys[0],
+            vals.empty() ? NULL : &vals[0], keys.size()))
+            throw PlayerError("NSDNetProxy::SetProperties()", "error setting properties");
+      }
+
+      /// Watch properties (or prefixes ending in "*") for changes,
+      /// replacing any earlier ones.
+      void WatchProperties(const std::vector<std::string>& variables)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         std::vector<const char *> keys;
+         for (size_t i = 0; i < variables.size(); i++)
+            keys.push_back(variables[i].c_str());
+         if (nsdnet_watch_properties(this->device, keys.empty() ? NULL : &keys[0], keys.size()))
+            throw PlayerError("NSDNetProxy::WatchProperties()", "error watching properties");
+      }
+
+      /// Received change of a watched property.
+      bool ReceivePropertyChange(time_t& timestamp, std::string& variable, std::string& value)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         nsdpropchange_t *change;
+         if (!nsdnet_receive_propchange(this->device, &change))
+            return false;
+         timestamp = change->timestamp;
+         variable = change->key;
+         value = change->value;
+         return true;
+      }
+
+      /// Received property change count.
+      int PropertyChangeCount()
+      {
+         return device->propchanges_head - device->propchanges_tail;
+      }
+
+      /// The last simulation tick whose messages have all been received,
+      /// in tick mode; false before the first.
+      bool GetTick(uint32_t& tick)
+      {
+         scoped_lock_t lock(mPc->mMutex);
+         tick = device->tick;
+         return device->ticked;
+      }
+
       /// Request a list of clients.
       void RequestClientList()
       {
          scoped_lock_t lock(mPc->mMutex);
-         if (nsdnet_get_listclients(this->device))
+         int result = nsdnet_get_clientlist(this->device, 0, 0);
+         if (result < 0)
             throw PlayerError("NSDNetProxy::RequestClientList()", "error requesting client list");
-         // Convert the retrieved client list into a string vector.
+         // Convert the retrieved client list into a string vector, unless
+         // it has not changed.
+         if (result == 0)
+            return;
          this->clientList.clear();
-         for (int i = 0; i < this->device->listclients_count; i++)
-            this->clientList.push_back(this->device->listclients[i]);
-
+         for (int i = 0; i < nsdnet_clientlist_count(this->device); i++)
+            this->clientList.push_back(nsdnet_clientlist_id(this->device, i));
       }
 
       /// Get the list of clients.
@@ -29,13 +29,42 @@
 
 #include "playernsd_client.h"
 #include <boost/foreach.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/tokenizer.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/scoped_array.hpp>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <poll.h>
+#include <sys/socket.h>
+#if defined (HAVE_LZ4)
+   #include <lz4.h>
+
+/**
+ * Returns the CPU time consumed by the calling thread in seconds.
+ */
+static double threadCPUTime()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#endif
 
 PlayerNSDClient::PlayerNSDClient(PlayerNSDClient::Handler& handler) :
-      socket(ioService), connectionState(StateDisconnected), handler(handler)
+      stream(ioService), connectionState(StateDisconnected), handler(handler),
+      compressionThreshold(0), receiveBufferSize(0), chunkSize(0), maxMessageSize(0),
+      subscribed(false), watchPolls(0), watchInterval(PLAYERNSD_WATCH_INTERVAL),
+      shmRingSize(0), shmState(ShmOff), writerState(WriterWaiting),
+      closeTimeout(PLAYERNSD_CLOSE_TIMEOUT), closing(false)
 {
+   RequestFeature(PLAYERNSD_FEATURE_TOPICS);
+   RequestFeature(PLAYERNSD_FEATURE_MULTICAST);
+   RequestFeature(PLAYERNSD_FEATURE_PROPWATCH);
+   RequestFeature(PLAYERNSD_FEATURE_RANGE);
+   RequestFeature(PLAYERNSD_FEATURE_TICK);
 }
 
 PlayerNSDClient::~PlayerNSDClient(void)
@@ -45,25 +74,36 @@ PlayerNSDClient::~PlayerNSDClient(void)
 
 bool PlayerNSDClient::Connect(const std::string& host, const std::string& port)
 {
-   tcp::resolver resolver(ioService);
-   tcp::resolver::query query(host, port);
-   tcp::resolver::iterator iterator = resolver.resolve(query);
-
-   tcp::endpoint endpoint = *iterator;
-   while (iterator != tcp::resolver::iterator())
+   boost::system::error_code error;
+   if (!host.compare(0, strlen(PLAYERNSD_UNIX_PREFIX), PLAYERNSD_UNIX_PREFIX))
    {
-      try
-      {
-         socket.connect(endpoint);
-         break;
-      }
-      catch (std::exception& e)
+      // A daemon on the same host, skip the TCP stack.
+      boost::asio::local::stream_protocol::endpoint endpoint(host.substr(strlen(PLAYERNSD_UNIX_PREFIX)));
+      connectSocket(endpoint, error);
+   }
+   else
+   {
+      // Try each resolved endpoint in turn.
+      tcp::resolver resolver(ioService);
+      tcp::resolver::query query(host, port);
+      tcp::resolver::iterator iterator = resolver.resolve(query, error), end;
+      for (; iterator != end && !closing; ++iterator)
       {
-         std::cerr << "Exception: " << e.what() << "\n";
-         return false;
+         connectSocket(iterator->endpoint(), error);
+         if (!error)
+            break;
       }
-      ++iterator;
    }
+   if (error && closing)
+      return false;
+   if (error)
+   {
+      std::cerr << "Unable to connect to " << host << ":" << port << ": "
+         << error.message() << std::endl;
+      return false;
+   }
+   if (receiveBufferSize)
+      stream.GetSocket().set_option(boost::asio::socket_base::receive_buffer_size(receiveBufferSize));
    changeState(StateConnected);
 
    this->id = id;
@@ -77,24 +117,115 @@ bool PlayerNSDClient::Connect(const std::string& host, const std::string& port)
    return true;
 }
 
+void PlayerNSDClient::connectSocket(const boost::asio::generic::stream_protocol::endpoint& endpoint,
+   boost::system::error_code& error)
+{
+   // Connect without blocking, so that Close can give up on a daemon that
+   // does not answer rather than wait out the kernel's connect timeout.
+   PlayerNSDStream::Socket& socket = stream.GetSocket();
+   boost::system::error_code ignored;
+   socket.close(ignored);
+   socket.open(endpoint.protocol(), error);
+   if (error)
+      return;
+   socket.non_blocking(true, error);
+   if (error)
+      return;
+   if (::connect(socket.native_handle(), endpoint.data(), endpoint.size()) < 0)
+   {
+      if (errno != EINPROGRESS && errno != EAGAIN)
+      {
+         error = boost::system::error_code(errno, boost::system::system_category());
+         return;
+      }
+      struct pollfd fd;
+      fd.fd = socket.native_handle();
+      fd.events = POLLOUT;
+      for (;;)
+      {
+         if (closing)
+         {
+            error = boost::asio::error::operation_aborted;
+            return;
+         }
+         int n = poll(&fd, 1, PLAYERNSD_CONNECT_POLL);
+         if (n > 0)
+            break;
+         if (n < 0 && errno != EINTR)
+         {
+            error = boost::system::error_code(errno, boost::system::system_category());
+            return;
+         }
+      }
+      int result = 0;
+      socklen_t length = sizeof(result);
+      if (getsockopt(socket.native_handle(), SOL_SOCKET, SO_ERROR, &result, &length) < 0)
+         result = errno;
+      if (result)
+      {
+         error = boost::system::error_code(result, boost::system::system_category());
+         return;
+      }
+   }
+   socket.non_blocking(false, error);
+}
+
+void PlayerNSDClient::ConnectAsync(const std::string& host, const std::string& port)
+{
+   connector = boost::thread(&PlayerNSDClient::processConnector, this, host, port);
+}
+
+void PlayerNSDClient::processConnector(std::string host, std::string port)
+{
+   // Nobody is waiting on the connection, so the handler is told it failed.
+   if (!Connect(host, port) && !closing)
+      changeState(StateDisconnected);
+}
+
 void PlayerNSDClient::Close()
 {
-   reader.interrupt();
-   writer.interrupt();
+   // Give up on a connection in progress.
+   closing = true;
+   if (connector.joinable())
+      connector.join();
+   watcher.interrupt();
+   if (watcher.joinable())
+      watcher.join();
+   // A writer still waiting on registration has nothing it may send.
+   releaseWriter(WriterClosed);
 
-   boost::system::error_code error;
-   std::ostream request_stream(&request);
-   request_stream << "bye\n";
-   try
+   if (writer.joinable())
    {
-      boost::asio::write(socket, request);
+      // The writer sends what is left, then bye, and stops.
+      messageSendQueue.PushBarrier("bye\n");
+      messageSendQueue.Finish();
+      if (!writer.timed_join(boost::posix_time::microseconds((int64_t)(closeTimeout * 1e6))))
+      {
+         std::cerr << "Timed out sending to the daemon, dropping "
+            << messageSendQueue.Size(PlayerNSDSendQueue::PriorityControl) +
+               messageSendQueue.Size(PlayerNSDSendQueue::PriorityBulk)
+            << " queued frames" << std::endl;
+         messageSendQueue.Close();
+      }
    }
-   catch (std::exception& e)
+
+   // Wake up the reader, and the writer if still blocked on the daemon, and
+   // wait for them before the socket goes away.
+   stream.Shutdown();
    {
-      std::cerr << "Exception: " << e.what() << "\n";
+      boost::lock_guard<boost::mutex> lock(shmMutex);
+      if (shmState == ShmPending)
+         shmState = ShmRefused;
    }
+   shmChanged.notify_all();
+   if (writer.joinable())
+      writer.join();
+   if (reader.joinable())
+      reader.join();
 
-   socket.close();
+   stream.Close();
+   if (recorder)
+      recorder->Close();
 }
 
 void PlayerNSDClient::processReader()
@@ -106,7 +237,7 @@ void PlayerNSDClient::processReader()
 
       // Read until newline
       //std::cout << id <<  ": begin read command..." << std::endl;
-      boost::asio::read_until(socket, response, '\n', error);
+      boost::asio::read_until(stream, response, '\n', error);
       if (error == boost::asio::error::eof)
       {
          std::cout << "Got EOF... stopping reader" << std::endl;
@@ -126,14 +257,18 @@ void PlayerNSDClient::processReader()
       //std::cout << id <<  ": read command " << command << std::endl;
 
       // Tokenise the greeting.
-      boost::char_separator<char> sep(" ");
-      boost::tokenizer<boost::char_separator<char> > toker(command, sep);
-      std::vector<std::string> tokens(toker.begin(), toker.end()) ;
+      std::vector<std::string> tokens;
+      Tokenise(command, tokens);
+
+      // Frames with a payload are recorded once it has been read.
+      if (recorder && (tokens.empty() || (tokens[0] != "msgtext" && tokens[0] != "msgbin" &&
+         tokens[0] != "msgbinz" && tokens[0] != "msgtopic")))
+         recorder->Append(PlayerNSDRecorder::Inbound, command + "\n");
 
       // Handle pinging
       if (tokens[0] == "ping")
       {
-         messageSendQueue.push("pong\n");
+         messageSendQueue.Push("pong\n", PlayerNSDSendQueue::PriorityControl);
       }
       else if (tokens[0] == "listclients")
       {
@@ -151,6 +286,15 @@ void PlayerNSDClient::processReader()
                   if (tokens[3] == PLAYERNSD_PROTOCOL_VERSION)
                   {
                      protocolVersion = tokens[3];
+                     // Any further tokens are features the server offers,
+                     // keep those that have been requested.
+                     {
+                        boost::lock_guard<boost::mutex> lock(featureMutex);
+                        features.clear();
+                        for (std::size_t i = 4; i < tokens.size(); i++)
+                           if (requestedFeatures.count(tokens[i]))
+                              features.insert(tokens[i]);
+                     }
                      changeState(StateGreeting);
                   }
                   else
@@ -178,6 +322,10 @@ void PlayerNSDClient::processReader()
                if (tokens[0] == "registered")
                {
                   changeState(StateRegistered);
+                  releaseWriter(WriterRegistered);
+                  sendSubscription();
+                  sendWatch();
+                  attachSharedMemory();
                }
                else if (tokens[0] == "error")
                {
@@ -214,7 +362,7 @@ void PlayerNSDClient::processReader()
          }
          else if (tokens[0] == "msgtext")
          {
-            boost::asio::read_until(socket, response, '\n', error);
+            boost::asio::read_until(stream, response, '\n', error);
             if (error == boost::asio::error::eof)
             {
                std::cout << "Got EOF... stopping reader" << std::endl;
@@ -229,40 +377,139 @@ void PlayerNSDClient::processReader()
             std::istream response_stream(&response);
             std::string message;
             std::getline(response_stream, message);
+            if (recorder)
+               recorder->Append(PlayerNSDRecorder::Inbound, command + "\n" + message + "\n");
             handler.Receive(tokens[1], message);
          }
-         else if (tokens[0] == "msgbin")
+         else if (tokens[0] == "msgbin" || tokens[0] == "msgbinz")
          {
-            if (tokens.size() != 3)
+            bool compressed = tokens[0] == "msgbinz";
+            if (!compressed && tokens.size() != 3)
                throw Exception(std::string("Read message error [expected 2 parameters to msgbin]"));
+            if (compressed && tokens.size() != 4)
+               throw Exception(std::string("Read message error [expected 3 parameters to msgbinz]"));
             std::size_t length = boost::lexical_cast<size_t>(tokens[2]);
-            if (response.size() < length)
+            std::size_t rawLength = compressed ? boost::lexical_cast<size_t>(tokens[3]) : length;
+            if ((maxMessageSize && rawLength > maxMessageSize) ||
+               (compressed && std::max(length, rawLength) > messageSizeLimit()))
             {
-               //std::cout << id << ": expecting " << length - response.size() << std::endl;
-               boost::asio::read(socket, response, boost::asio::transfer_at_least(length - response.size()), error);
-               if (error == boost::asio::error::eof)
-               {
-                  std::cout << "Got EOF... stopping reader" << std::endl;
+               if (!refuseMessage(command, length))
                   return;
+            }
+            else
+            {
+               // Large messages are passed on in chunks, except for enveloped
+               // topic messages, which are delivered whole.
+               bool chunked = !compressed && chunkSize && length > chunkSize;
+               if (chunked)
+               {
+                  std::string topic;
+                  if (!readResponse(std::min<std::size_t>(length, PLAYERNSD_TOPIC_LEN + 16)))
+                     return;
+                  chunked = !ParseTopicEnvelope(boost::asio::buffer_cast<const char *>(response.data()),
+                     std::min(length, response.size()), topic);
                }
-               else if (error)
+               if (chunked)
                {
-                  std::cout << "ASIO Error: " << error.message() << std::endl;
-                  return;
+                  if (recorder)
+                     recorder->Append(PlayerNSDRecorder::Inbound, command + "\n");
+                  if (!receivePayload(tokens[1], length))
+                     return;
+               }
+               else if (length > messageSizeLimit())
+               {
+                  if (!refuseMessage(command, length))
+                     return;
+               }
+               else
+               {
+                  if (!readResponse(length))
+                     return;
+                  payload.resize(length + 1);
+                  std::istream response_stream(&response);
+                  //std::cout << id << ": response read " << length << std::endl;
+                  response_stream.read(&payload[0], length);
+                  //std::cout << id << ": response read done " << length << std::endl;
+                  if (recorder)
+                     recorder->Append(PlayerNSDRecorder::Inbound, command + "\n", &payload[0], length);
+                  if (compressed)
+                  {
+                     boost::scoped_array<char> raw(new char[rawLength + 1]);
+                     std::string topic;
+                     if (!decodeBinary(&payload[0], length, raw.get(), rawLength))
+                        std::cerr << "ERROR: Unable to decompress message from " << tokens[1] << std::endl;
+                     else if (chunkSize && rawLength > chunkSize &&
+                        !ParseTopicEnvelope(raw.get(), rawLength, topic))
+                     {
+                        // Passed on in chunks, as if it had not been compressed.
+                        for (std::size_t offset = 0; offset < rawLength; offset += chunkSize)
+                           handler.ReceiveChunk(tokens[1], rawLength, offset,
+                              std::min<std::size_t>(chunkSize, rawLength - offset), raw.get() + offset);
+                     }
+                     else
+                        deliverBinary(tokens[1], rawLength, raw.get());
+                  }
+                  else
+                     deliverBinary(tokens[1], length, &payload[0]);
                }
             }
-            std::istream response_stream(&response);
-            char message[length];
-            //std::cout << id << ": response read " << length << std::endl;
-            response_stream.read(message, length);
-            //std::cout << id << ": response read done " << length << std::endl;
-            handler.Receive(tokens[1], length, message);
+         }
+         else if (tokens[0] == "msgtopic")
+         {
+            if (tokens.size() != 4)
+               throw Exception(std::string("Read message error [expected 3 parameters to msgtopic]"));
+            std::size_t length = boost::lexical_cast<size_t>(tokens[3]);
+            // Topic messages are delivered whole, never chunked.
+            if (length > messageSizeLimit())
+            {
+               if (!refuseMessage(command, length))
+                  return;
+            }
+            else
+            {
+               if (!readResponse(length))
+                  return;
+               payload.resize(length + 1);
+               std::istream response_stream(&response);
+               response_stream.read(&payload[0], length);
+               if (recorder)
+                  recorder->Append(PlayerNSDRecorder::Inbound, command + "\n", &payload[0], length);
+               handler.ReceiveTopic(tokens[1], tokens[2], length, &payload[0]);
+            }
+         }
+         else if (tokens[0] == "shmready" || tokens[0] == "shmrefused")
+         {
+            // Nothing more comes over the socket after shmready.
+            bool ready = tokens[0] == "shmready";
+            if (ready)
+               stream.UseSharedMemoryForReads();
+            stream.UnlinkSharedMemory();
+            {
+               boost::lock_guard<boost::mutex> lock(shmMutex);
+               shmState = ready ? ShmReady : ShmRefused;
+            }
+            shmChanged.notify_all();
+            if (!ready)
+               std::cerr << "Shared memory transport refused by the daemon" << std::endl;
          }
          else if (tokens[0] == "propval")
          {
             // Remove the first two tokens.
-            std::string val = command.substr(tokens[0].size() + tokens[1].size() + 2);
-            handler.PropertyValue(tokens[1], val);
+            std::string val = command.substr(std::min(command.size(), tokens[0].size() + tokens[1].size() + 2));
+            std::string variable;
+            if (popPropertyGet(variable))
+               watchedValue(tokens[1], val);
+            else
+               handler.PropertyValue(tokens[1], val);
+         }
+         else if (tokens[0] == "propchanged" && tokens.size() >= 2)
+         {
+            handler.PropertyChanged(tokens[1],
+               command.substr(std::min(command.size(), tokens[0].size() + tokens[1].size() + 2)));
+         }
+         else if (tokens[0] == "tick" && tokens.size() == 2)
+         {
+            handler.TickReached(boost::lexical_cast<uint32_t>(tokens[1]));
          }
          else if (tokens[0] == "error")
          {
@@ -277,7 +524,14 @@ void PlayerNSDClient::processReader()
             else if (tokens[1] == "alreadyregistered")
                handler.ErrorRaised(ServerErrorAlreadyRegistered, command);
             else if (tokens[1] == "propertynotexist")
-               handler.ErrorRaised(ServerErrorPropertyNotExist, command);
+            {
+               // Only this error answers a propget, in its place in the
+               // order; a watched property that does not exist (yet) is no
+               // change.
+               std::string variable;
+               if (!popPropertyGet(variable))
+                  handler.ErrorRaised(ServerErrorPropertyNotExist, command);
+            }
             else if (tokens[1] == "unknownclient")
                handler.ErrorRaised(ServerErrorUnknownClient, command);
             else
@@ -293,6 +547,73 @@ void PlayerNSDClient::processReader()
    }
 }
 
+bool PlayerNSDClient::readResponse(std::size_t length)
+{
+   if (response.size() >= length)
+      return true;
+   boost::system::error_code error;
+   //std::cout << id << ": expecting " << length - response.size() << std::endl;
+   boost::asio::read(stream, response, boost::asio::transfer_at_least(length - response.size()), error);
+   if (error == boost::asio::error::eof)
+   {
+      std::cout << "Got EOF... stopping reader" << std::endl;
+      return false;
+   }
+   else if (error)
+   {
+      std::cout << "ASIO Error: " << error.message() << std::endl;
+      return false;
+   }
+   return true;
+}
+
+bool PlayerNSDClient::receivePayload(const std::string& source, std::size_t length)
+{
+   std::size_t size = chunkSize ? chunkSize : PLAYERNSD_DEFAULT_CHUNK_SIZE;
+   payload.resize(std::min(size, length) + 1);
+   std::istream response_stream(&response);
+   for (std::size_t offset = 0; offset < length; offset += size)
+   {
+      std::size_t len = std::min(size, length - offset);
+      if (!readResponse(len))
+         return false;
+      response_stream.read(&payload[0], len);
+      if (recorder)
+         recorder->Append(PlayerNSDRecorder::Inbound, std::string(), &payload[0], len, true);
+      if (!source.empty())
+         handler.ReceiveChunk(source, length, offset, len, &payload[0]);
+   }
+   return true;
+}
+
+std::size_t PlayerNSDClient::messageSizeLimit() const
+{
+   if (maxMessageSize && maxMessageSize < PLAYERNSD_MESSAGE_SIZE_LIMIT)
+      return maxMessageSize;
+   return PLAYERNSD_MESSAGE_SIZE_LIMIT;
+}
+
+bool PlayerNSDClient::refuseMessage(const std::string& command, std::size_t length)
+{
+   // Drain the oversized message without holding it in memory.
+   if (recorder)
+      recorder->Append(PlayerNSDRecorder::Inbound, command + "\n");
+   if (!receivePayload(std::string(), length))
+      return false;
+   handler.ErrorRaised(ServerErrorMessageTooLarge, command);
+   return true;
+}
+
+void PlayerNSDClient::deliverBinary(const std::string& source, uint32_t len, const char *data)
+{
+   std::string topic;
+   std::size_t envelope = ParseTopicEnvelope(data, len, topic);
+   if (envelope)
+      handler.ReceiveTopic(source, topic, len - envelope, data + envelope);
+   else
+      handler.Receive(source, len, data);
+}
+
 void PlayerNSDClient::Register(const std::string& clientID)
 {
    // Copy the client id.
@@ -302,19 +623,22 @@ void PlayerNSDClient::Register(const std::string& clientID)
    {
       // Set state for waiting registration.
       changeState(StateWaitingRegistration);
-      // Write the greeting
-      std::ostream request_stream(&request);
+      // Hand the greeting to the writer, ahead of anything queued.
+      std::ostringstream request_stream;
       request_stream << "greetings " << clientID <<
-         " playernsd " << PLAYERNSD_PROTOCOL_VERSION << "\n";
-      try
+         " playernsd " << PLAYERNSD_PROTOCOL_VERSION;
+      // Accept the features both sides support.
       {
-         boost::asio::write(socket, request);
+         boost::lock_guard<boost::mutex> lock(featureMutex);
+         BOOST_FOREACH(const std::string& feature, features)
+            request_stream << " " << feature;
       }
-      catch (std::exception& e)
+      request_stream << "\n";
       {
-         std::cerr << "Exception: " << e.what() << "\n";
-         return;
+         boost::lock_guard<boost::mutex> lock(writerMutex);
+         greeting = request_stream.str();
       }
+      writerChanged.notify_all();
    }
    else if (connectionState == StateWaitingRegistration)
    {
@@ -328,72 +652,560 @@ void PlayerNSDClient::Register(const std::string& clientID)
 
 void PlayerNSDClient::RequestClientList()
 {
-   messageSendQueue.push("listclients\n");
+   messageSendQueue.Push("listclients\n", PlayerNSDSendQueue::PriorityControl);
 }
 
-void PlayerNSDClient::Send(const std::string& target, const std::string& data)
+void PlayerNSDClient::Send(const std::string& target, const std::string& data, Priority priority)
 {
-   std::string msg("msgtext ");
-   msg += target + "\n" + data + "\n";
-   messageSendQueue.push(msg);
+   messageSendQueue.Push(FrameText(target, data), priority, target);
 }
 
-void PlayerNSDClient::Send(const std::string& target, uint32_t len, const char *data)
+void PlayerNSDClient::Send(const std::string& target, uint32_t len, const char *data,
+   Priority priority)
 {
-   std::string msg("msgbin ");
-   msg += target + " " + boost::lexical_cast<std::string>(len) + "\n" + std::string(data, len);
-   messageSendQueue.push(msg);
+   messageSendQueue.Push(encodeBinary(target, len, data), priority, target);
 }
 
-void PlayerNSDClient::Send(const std::string& data)
+void PlayerNSDClient::Send(const std::string& data, Priority priority)
 {
-   std::string msg("msgtext\n");
-   msg += data + "\n";
-   messageSendQueue.push(msg);
+   messageSendQueue.Push(FrameText(std::string(), data), priority, PlayerNSDSendQueue::BroadcastFlow);
 }
 
-void PlayerNSDClient::Send(uint32_t len, const char *data)
+void PlayerNSDClient::Send(uint32_t len, const char *data, Priority priority)
 {
-   std::string msg("msgbin ");
-   msg += boost::lexical_cast<std::string>(len) + "\n" + std::string(data, len);
-   messageSendQueue.push(msg);
+   messageSendQueue.Push(encodeBinary(std::string(), len, data), priority,
+      PlayerNSDSendQueue::BroadcastFlow);
+}
+
+void PlayerNSDClient::SendTopic(const std::string& topic, uint32_t len, const char *data,
+   Priority priority)
+{
+   if (HasFeature(PLAYERNSD_FEATURE_TOPICS))
+      messageSendQueue.Push(FrameTopic(topic, len, data), priority, "#" + topic);
+   else
+   {
+      // Broadcast to everyone, the receiving drivers filter by topic.
+      std::string msg = EnvelopeTopic(topic, len, data);
+      messageSendQueue.Push(encodeBinary(std::string(), msg.size(), msg.data()), priority,
+         PlayerNSDSendQueue::BroadcastFlow);
+   }
+}
+
+void PlayerNSDClient::SendGroup(const std::vector<std::string>& targets, uint32_t len,
+   const char *data, Priority priority)
+{
+   if (targets.empty())
+      return;
+   if (HasFeature(PLAYERNSD_FEATURE_MULTICAST))
+   {
+      // One frame, the daemon fans it out.
+      std::string msg("msgmulti ");
+      for (std::size_t i = 0; i < targets.size(); i++)
+         msg += (i ? "," : "") + targets[i];
+      msg += " " + boost::lexical_cast<std::string>(len) + "\n" + std::string(data, len);
+      messageSendQueue.Push(msg, priority, PlayerNSDSendQueue::BroadcastFlow);
+      return;
+   }
+   // A frame per target, all sharing the one (possibly compressed) payload.
+   boost::shared_ptr<std::string> coded(new std::string);
+   bool compressed = encodePayload(len, data, *coded);
+   if (!compressed)
+      coded->assign(data, len);
+   std::string lengths = boost::lexical_cast<std::string>(coded->size());
+   if (compressed)
+      lengths += " " + boost::lexical_cast<std::string>(len);
+   BOOST_FOREACH(const std::string& target, targets)
+   {
+      std::string header(compressed ? "msgbinz " : "msgbin ");
+      header += target + " " + lengths + "\n";
+      messageSendQueue.Push(header, priority, target, coded);
+   }
+}
+
+void PlayerNSDClient::SendRange(double radius, uint32_t len, const char *data, Priority priority)
+{
+   if (HasFeature(PLAYERNSD_FEATURE_RANGE))
+      messageSendQueue.Push(FrameRange(radius, len, data), priority, PlayerNSDSendQueue::BroadcastFlow);
+   else
+      // Only the daemon knows where everyone is.
+      Send(len, data, priority);
+}
+
+void PlayerNSDClient::Tick(uint32_t tick)
+{
+   if (HasFeature(PLAYERNSD_FEATURE_TICK))
+      // The daemon needs the marker after the tick's frames in every lane.
+      messageSendQueue.PushBarrier("tick " + boost::lexical_cast<std::string>(tick) + "\n");
+   else
+      handler.TickReached(tick);
+}
+
+void PlayerNSDClient::Subscribe(const std::set<std::string>& topics)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(topicMutex);
+      subscription = topics;
+      subscribed = true;
+   }
+   // Otherwise sent once registered.
+   if (connectionState == StateRegistered)
+      sendSubscription();
+}
+
+void PlayerNSDClient::sendSubscription()
+{
+   if (!HasFeature(PLAYERNSD_FEATURE_TOPICS))
+      return;
+   std::string msg("subscribe");
+   {
+      boost::lock_guard<boost::mutex> lock(topicMutex);
+      if (!subscribed)
+         return;
+      BOOST_FOREACH(const std::string& topic, subscription)
+         msg += " " + topic;
+   }
+   msg += "\n";
+   // Property names have no spaces, so this key never clashes with them.
+   messageSendQueue.PushConflated(msg, " subscribe");
 }
 
 void PlayerNSDClient::PropertyGet(const std::string& variable)
 {
    std::string msg("propget ");
    msg += variable + "\n";
-   messageSendQueue.push(msg);
+   // The daemon answers in order, which tells polls and requests apart.
+   boost::lock_guard<boost::mutex> lock(watchMutex);
+   propertyGets.push_back(std::make_pair(variable, false));
+   messageSendQueue.Push(msg, PlayerNSDSendQueue::PriorityControl);
+}
+
+bool PlayerNSDClient::popPropertyGet(std::string& variable)
+{
+   boost::lock_guard<boost::mutex> lock(watchMutex);
+   if (propertyGets.empty())
+      return false;
+   variable = propertyGets.front().first;
+   bool poll = propertyGets.front().second;
+   propertyGets.pop_front();
+   if (poll)
+      watchPolls--;
+   return poll;
+}
+
+void PlayerNSDClient::watchedValue(const std::string& variable, const std::string& value)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(watchMutex);
+      std::map<std::string, std::string>::iterator it = watchedValues.find(variable);
+      if (it != watchedValues.end() && it->second == value)
+         return;
+      watchedValues[variable] = value;
+   }
+   handler.PropertyChanged(variable, value);
+}
+
+void PlayerNSDClient::PropertyWatch(const std::set<std::string>& keys)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(watchMutex);
+      watched = keys;
+      // Forget the values of keys no longer watched.
+      for (std::map<std::string, std::string>::iterator it = watchedValues.begin(); it != watchedValues.end();)
+      {
+         if (!keys.count(it->first))
+            watchedValues.erase(it++);
+         else
+            ++it;
+      }
+   }
+   // Otherwise sent once registered.
+   if (connectionState == StateRegistered)
+      sendWatch();
+}
+
+void PlayerNSDClient::SetWatchInterval(double seconds)
+{
+   boost::lock_guard<boost::mutex> lock(watchMutex);
+   watchInterval = seconds;
+}
+
+void PlayerNSDClient::SetCloseTimeout(double seconds)
+{
+   closeTimeout = seconds;
+}
+
+void PlayerNSDClient::sendWatch()
+{
+   if (HasFeature(PLAYERNSD_FEATURE_PROPWATCH))
+   {
+      std::string msg("propwatch");
+      {
+         boost::lock_guard<boost::mutex> lock(watchMutex);
+         BOOST_FOREACH(const std::string& key, watched)
+            msg += " " + key;
+      }
+      msg += "\n";
+      messageSendQueue.PushConflated(msg, " propwatch");
+      return;
+   }
+   // Otherwise poll the keys and report what differs.
+   boost::lock_guard<boost::mutex> lock(watchMutex);
+   if (!watched.empty() && watchInterval > 0.0 && !watcher.joinable())
+      watcher = boost::thread(&PlayerNSDClient::processWatcher, this);
+}
+
+void PlayerNSDClient::processWatcher()
+{
+   while (true)
+   {
+      double interval;
+      {
+         boost::lock_guard<boost::mutex> lock(watchMutex);
+         interval = watchInterval;
+         // Skip a round while the last one is unanswered.
+         if (!watchPolls)
+         {
+            BOOST_FOREACH(const std::string& key, watched)
+            {
+               // Prefixes cannot be polled, only pushed by the daemon.
+               if (boost::algorithm::ends_with(key, PLAYERNSD_WATCH_PREFIX))
+                  continue;
+               propertyGets.push_back(std::make_pair(key, true));
+               watchPolls++;
+               messageSendQueue.Push("propget " + key + "\n", PlayerNSDSendQueue::PriorityControl);
+            }
+         }
+      }
+      boost::this_thread::sleep(boost::posix_time::microseconds((int64_t)(interval * 1e6)));
+   }
 }
 
 void PlayerNSDClient::PropertySet(const std::string& variable, const std::string& value)
 {
    std::string msg("propset ");
    msg += variable + " " + value + "\n";
-   messageSendQueue.push(msg);
+   // Only the latest value of a property that has not been sent yet matters.
+   messageSendQueue.PushConflated(msg, variable);
+}
+
+void PlayerNSDClient::releaseWriter(WriterState state)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(writerMutex);
+      if (writerState == WriterWaiting)
+         writerState = state;
+   }
+   writerChanged.notify_all();
+}
+
+bool PlayerNSDClient::writeGreetings()
+{
+   boost::unique_lock<boost::mutex> lock(writerMutex);
+   while (true)
+   {
+      if (!greeting.empty())
+      {
+         // Sent by this thread alone, so nothing interleaves with it.
+         std::string msg;
+         msg.swap(greeting);
+         lock.unlock();
+         try
+         {
+            boost::asio::write(stream, boost::asio::buffer(msg));
+         }
+         catch (std::exception& e)
+         {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return false;
+         }
+         if (recorder)
+            recorder->Append(PlayerNSDRecorder::Outbound, msg);
+         lock.lock();
+      }
+      else if (writerState == WriterWaiting)
+         writerChanged.wait(lock);
+      else
+         return writerState == WriterRegistered;
+   }
 }
 
 void PlayerNSDClient::processWriter()
 {
    std::cout << "Starting writer..." << std::endl;
+   // The daemon only takes other frames once it has registered us, so the
+   // queue is held until then.
+   if (!writeGreetings())
+      return;
    while (true)
    {
       // Wait on the queue until we have something to send.
-      std::string msg = messageSendQueue.pop(true);
+      std::string msg;
+      PlayerNSDSendQueue::Payload payload;
+      if (!messageSendQueue.Pop(msg, payload))
+         return;
       //std::cout << "Sending " << msg << std::endl;
-      std::ostream request_stream(&request);
-      request_stream << msg;
-      boost::system::error_code error;
+      // Write the frame and any shared payload straight from where they are.
+      std::vector<boost::asio::const_buffer> buffers;
+      buffers.push_back(boost::asio::buffer(msg));
+      if (payload)
+         buffers.push_back(boost::asio::buffer(*payload));
       try
       {
-         boost::asio::write(socket, request);
+         boost::asio::write(stream, buffers);
       }
       catch (std::exception& e)
       {
          std::cerr << "Exception: " << e.what() << "\n";
          return;
       }
+      if (recorder)
+         recorder->Append(PlayerNSDRecorder::Outbound, msg,
+            payload ? payload->data() : NULL, payload ? payload->size() : 0);
+      // Hold back everything after a shmattach until the daemon has
+      // answered, as the answer decides how the rest is written.
+      if (!msg.compare(0, 10, "shmattach "))
+      {
+         boost::unique_lock<boost::mutex> lock(shmMutex);
+         while (shmState == ShmPending)
+            shmChanged.wait(lock);
+         if (shmState == ShmReady)
+            stream.UseSharedMemoryForWrites();
+      }
+   }
+}
+
+void PlayerNSDClient::attachSharedMemory()
+{
+   if (!shmRingSize || !HasFeature(PLAYERNSD_FEATURE_SHM))
+      return;
+   std::string name;
+   if (!stream.CreateSharedMemory(shmRingSize, name))
+   {
+      std::cerr << "Unable to create shared memory for the daemon connection" << std::endl;
+      return;
+   }
+   {
+      boost::lock_guard<boost::mutex> lock(shmMutex);
+      shmState = ShmPending;
+   }
+   messageSendQueue.Push("shmattach " + name + " " + boost::lexical_cast<std::string>(shmRingSize) + "\n",
+      PlayerNSDSendQueue::PriorityControl);
+}
+
+void PlayerNSDClient::Tokenise(const std::string& command, std::vector<std::string>& tokens)
+{
+   boost::char_separator<char> sep(" ");
+   boost::tokenizer<boost::char_separator<char> > toker(command, sep);
+   tokens.insert(tokens.end(), toker.begin(), toker.end());
+}
+
+std::string PlayerNSDClient::FrameText(const std::string& target, const std::string& data)
+{
+   std::string msg("msgtext");
+   if (!target.empty())
+      msg += " " + target;
+   msg += "\n" + data + "\n";
+   return msg;
+}
+
+std::string PlayerNSDClient::FrameBinary(const std::string& target, uint32_t len, const char *data)
+{
+   std::string msg("msgbin ");
+   if (!target.empty())
+      msg += target + " ";
+   msg += boost::lexical_cast<std::string>(len) + "\n" + std::string(data, len);
+   return msg;
+}
+
+std::string PlayerNSDClient::FrameCompressed(const std::string& target, uint32_t len,
+   const char *data, uint32_t rawLen)
+{
+   std::string msg("msgbinz ");
+   if (!target.empty())
+      msg += target + " ";
+   msg += boost::lexical_cast<std::string>(len) + " " +
+      boost::lexical_cast<std::string>(rawLen) + "\n" + std::string(data, len);
+   return msg;
+}
+
+/** Marks the start of an enveloped topic message. */
+static const char topicMagic[] = "\0nsdtopic";
+
+std::string PlayerNSDClient::FrameTopic(const std::string& topic, uint32_t len, const char *data)
+{
+   std::string msg("msgtopic ");
+   msg += topic + " " + boost::lexical_cast<std::string>(len) + "\n" + std::string(data, len);
+   return msg;
+}
+
+std::string PlayerNSDClient::FrameRange(double radius, uint32_t len, const char *data)
+{
+   std::string msg("msgrange ");
+   msg += boost::lexical_cast<std::string>(radius) + " " + boost::lexical_cast<std::string>(len) +
+      "\n" + std::string(data, len);
+   return msg;
+}
+
+std::string PlayerNSDClient::EnvelopeTopic(const std::string& topic, uint32_t len, const char *data)
+{
+   // magic, NUL, topic, NUL, message
+   std::string msg(topicMagic, sizeof(topicMagic));
+   msg += topic;
+   msg += '\0';
+   msg.append(data, len);
+   return msg;
+}
+
+std::size_t PlayerNSDClient::ParseTopicEnvelope(const char *data, std::size_t len, std::string& topic)
+{
+   if (len < sizeof(topicMagic) || memcmp(data, topicMagic, sizeof(topicMagic)))
+      return 0;
+   const char *start = data + sizeof(topicMagic);
+   const char *end = (const char *) memchr(start, '\0',
+      std::min<std::size_t>(len - sizeof(topicMagic), PLAYERNSD_TOPIC_LEN));
+   if (!end)
+      return 0;
+   topic.assign(start, end);
+   return end + 1 - data;
+}
+
+void PlayerNSDClient::SetChunkSize(uint32_t size)
+{
+   chunkSize = size;
+}
+
+void PlayerNSDClient::SetMaxMessageSize(uint32_t size)
+{
+   maxMessageSize = size;
+}
+
+void PlayerNSDClient::SetFlowQuantum(uint32_t quantum)
+{
+   messageSendQueue.SetQuantum(quantum);
+}
+
+void PlayerNSDClient::SetReceiveBufferSize(int size)
+{
+   receiveBufferSize = size;
+}
+
+bool PlayerNSDClient::Record(const std::string& path)
+{
+   recorder.reset(new PlayerNSDRecorder());
+   if (recorder->Open(path))
+      return true;
+   std::cerr << "Unable to record to " << path << std::endl;
+   recorder.reset();
+   return false;
+}
+
+void PlayerNSDClient::SetSharedMemory(uint32_t ringSize)
+{
+   shmRingSize = ringSize;
+   if (ringSize)
+      RequestFeature(PLAYERNSD_FEATURE_SHM);
+}
+
+void PlayerNSDClient::RequestFeature(const std::string& feature)
+{
+   boost::lock_guard<boost::mutex> lock(featureMutex);
+   requestedFeatures.insert(feature);
+}
+
+bool PlayerNSDClient::HasFeature(const std::string& feature)
+{
+   boost::lock_guard<boost::mutex> lock(featureMutex);
+   return features.count(feature) > 0;
+}
+
+void PlayerNSDClient::SetCompressionThreshold(uint32_t threshold)
+{
+#if defined (HAVE_LZ4)
+   compressionThreshold = threshold;
+   if (threshold)
+      RequestFeature(PLAYERNSD_FEATURE_LZ4);
+#else
+   if (threshold)
+      std::cerr << "Compression requested but not built with LZ4 support" << std::endl;
+#endif
+}
+
+void PlayerNSDClient::GetMetrics(Metrics& metrics)
+{
+   boost::lock_guard<boost::mutex> lock(metricsMutex);
+   addCodecMetrics(metrics, "compress", compressMetrics);
+   addCodecMetrics(metrics, "decompress", decompressMetrics);
+   metrics["queue.control.depth"] = messageSendQueue.Size(PlayerNSDSendQueue::PriorityControl);
+   metrics["queue.bulk.depth"] = messageSendQueue.Size(PlayerNSDSendQueue::PriorityBulk);
+   metrics["queue.conflated"] = messageSendQueue.GetConflatedCount();
+   PlayerNSDSendQueue::FlowDepths depths;
+   messageSendQueue.GetFlowDepths(depths);
+   for (PlayerNSDSendQueue::FlowDepths::const_iterator it = depths.begin(); it != depths.end(); ++it)
+      metrics["queue.flow." + it->first + ".depth"] = it->second;
+}
+
+void PlayerNSDClient::addCodecMetrics(Metrics& metrics, const std::string& prefix,
+   const CodecMetrics& codec)
+{
+   metrics[prefix + ".messages"] = codec.messages;
+   metrics[prefix + ".raw_bytes"] = codec.rawBytes;
+   metrics[prefix + ".coded_bytes"] = codec.codedBytes;
+   metrics[prefix + ".ratio"] = codec.codedBytes ? (double) codec.rawBytes / codec.codedBytes : 0.0;
+   metrics[prefix + ".cpu_us_per_message"] = codec.messages ? codec.cpuTime * 1e6 / codec.messages : 0.0;
+}
+
+std::string PlayerNSDClient::encodeBinary(const std::string& target, uint32_t len, const char *data)
+{
+   std::string coded;
+   if (encodePayload(len, data, coded))
+      return FrameCompressed(target, coded.size(), coded.data(), len);
+   return FrameBinary(target, len, data);
+}
+
+bool PlayerNSDClient::encodePayload(uint32_t len, const char *data, std::string& coded)
+{
+#if defined (HAVE_LZ4)
+   if (compressionThreshold && len >= compressionThreshold && HasFeature(PLAYERNSD_FEATURE_LZ4))
+   {
+      double start = threadCPUTime();
+      int bound = LZ4_compressBound(len);
+      coded.resize(bound);
+      int codedLen = LZ4_compress_default(data, &coded[0], len, bound);
+      double elapsed = threadCPUTime() - start;
+      // Only worth sending compressed if it is actually smaller.
+      if (codedLen > 0 && (uint32_t) codedLen < len)
+      {
+         coded.resize(codedLen);
+         boost::lock_guard<boost::mutex> lock(metricsMutex);
+         compressMetrics.messages++;
+         compressMetrics.rawBytes += len;
+         compressMetrics.codedBytes += codedLen;
+         compressMetrics.cpuTime += elapsed;
+         return true;
+      }
+      coded.clear();
    }
+#endif
+   return false;
+}
+
+bool PlayerNSDClient::decodeBinary(const char *data, uint32_t len, char *raw, uint32_t rawLen)
+{
+#if defined (HAVE_LZ4)
+   double start = threadCPUTime();
+   int decoded = LZ4_decompress_safe(data, raw, len, rawLen);
+   double elapsed = threadCPUTime() - start;
+   if (decoded < 0 || (uint32_t) decoded != rawLen)
+      return false;
+   boost::lock_guard<boost::mutex> lock(metricsMutex);
+   decompressMetrics.messages++;
+   decompressMetrics.rawBytes += rawLen;
+   decompressMetrics.codedBytes += len;
+   decompressMetrics.cpuTime += elapsed;
+   return true;
+#else
+   return false;
+#endif
 }
 
 void PlayerNSDClient::changeState(ConnectionState state)
@@ -27,21 +27,131 @@
  * of messages before passing them down to the driver.
  */
 
+#ifndef _PLAYERNSD_CLIENT_H_
+#define _PLAYERNSD_CLIENT_H_
+
 #include <iostream>
 #include <istream>
 #include <ostream>
 #include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <deque>
 #include <exception>
+#include <boost/atomic.hpp>
 #include <boost/thread.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
-#include "boost/locking_queue.hpp"
+#include <boost/scoped_ptr.hpp>
+#include "playernsd_send_queue.h"
+#include "playernsd_stream.h"
+#include "playernsd_recorder.h"
 
 using boost::asio::ip::tcp;
 
 #define PLAYERNSD_PROTOCOL_VERSION "0001"
 
-class PlayerNSDClient
+/** Prefix of a host that is the path of a unix domain socket. */
+#define PLAYERNSD_UNIX_PREFIX "unix:"
+
+/** Chunk size used when draining a message without a chunk size set. */
+#define PLAYERNSD_DEFAULT_CHUNK_SIZE 65536
+
+/**
+ * The largest message taken whole, whatever max_message_size says: the
+ * ones held in memory are compressed messages and topic messages.
+ */
+#define PLAYERNSD_MESSAGE_SIZE_LIMIT (256u << 20)
+
+/** Feature token for LZ4 compressed msgbin payloads. */
+#define PLAYERNSD_FEATURE_LZ4 "lz4"
+/** Feature token for msgtopic frames and subscriptions. */
+#define PLAYERNSD_FEATURE_TOPICS "topics"
+/** Feature token for msgmulti frames (one message to a list of clients). */
+#define PLAYERNSD_FEATURE_MULTICAST "multicast"
+/** Feature token for propwatch subscriptions and pushed propchanged frames. */
+#define PLAYERNSD_FEATURE_PROPWATCH "propwatch"
+/** Feature token for msgrange frames (a broadcast to the clients in range). */
+#define PLAYERNSD_FEATURE_RANGE "range"
+/** Feature token for tick frames (a barrier at the end of each simulation tick). */
+#define PLAYERNSD_FEATURE_TICK "tick"
+
+/** Suffix of a watched key that watches every key with its prefix. */
+#define PLAYERNSD_WATCH_PREFIX "*"
+/** Default seconds between polls of watched properties. */
+#define PLAYERNSD_WATCH_INTERVAL 1.0
+/** Default seconds a closing client spends sending what is still queued. */
+#define PLAYERNSD_CLOSE_TIMEOUT 1.0
+/** Milliseconds between checks for Close while connecting. */
+#define PLAYERNSD_CONNECT_POLL 50
+
+/** Maximum topic length, including the terminating NUL. */
+#define PLAYERNSD_TOPIC_LEN 64
+/** Topic that subscribes to every topic. */
+#define PLAYERNSD_ALL_TOPICS "*"
+
+/**
+ * The operations the driver performs on its link to the other robots.
+ * PlayerNSDClient goes through playernsd; other links report back to the
+ * same PlayerNSDClient::Handler.
+ */
+class PlayerNSDLink
+{
+   public:
+      /** Send priority of a message. */
+      typedef PlayerNSDSendQueue::Priority Priority;
+
+      /** Named counters and gauges describing the link's traffic. */
+      typedef std::map<std::string, double> Metrics;
+
+      virtual ~PlayerNSDLink() {}
+      virtual void Register(const std::string &clientID) = 0;
+      virtual void RequestClientList() = 0;
+      virtual void Send(const std::string& target, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk) = 0;
+      virtual void Send(uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk) = 0;
+      virtual void SendTopic(const std::string& topic, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk) = 0;
+      virtual void SendGroup(const std::vector<std::string>& targets, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk) = 0;
+      /**
+       * Broadcasts a message to the clients within a range of this one,
+       * by their "self.position" properties.  Links that cannot tell who
+       * is in range send to every client.
+       * \param radius The range.
+       * \param len The length of the message.
+       * \param data The message.
+       * \param priority The send priority.
+       */
+      virtual void SendRange(double radius, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk) = 0;
+      virtual void Subscribe(const std::set<std::string>& topics) = 0;
+      virtual void PropertyGet(const std::string& variable) = 0;
+      virtual void PropertySet(const std::string& variable, const std::string& value) = 0;
+      /**
+       * Replaces the properties whose changes are reported to the handler.
+       * \param keys The keys, or prefixes ending in PLAYERNSD_WATCH_PREFIX.
+       */
+      virtual void PropertyWatch(const std::set<std::string>& keys) = 0;
+      /**
+       * Marks the end of a simulation tick: everything sent so far belongs
+       * to it.  The handler is told once every robot has finished the tick
+       * and all their messages for it have been received.
+       * \param tick The tick.
+       */
+      virtual void Tick(uint32_t tick) = 0;
+      virtual void GetMetrics(Metrics& metrics) = 0;
+      /**
+       * Sends what is still queued, within the link's close timeout, and
+       * stops the link's threads.  The handler is not called once it has
+       * returned.
+       */
+      virtual void Close() = 0;
+};
+
+class PlayerNSDClient : public PlayerNSDLink
 {
    public:
       enum ConnectionState
@@ -63,6 +173,7 @@ class PlayerNSDClient
          ServerErrorAlreadyRegistered,
          ServerErrorUnknownClient,
          ServerErrorPropertyNotExist,
+         ServerErrorMessageTooLarge,
       };
 
       class Handler
@@ -71,25 +182,170 @@ class PlayerNSDClient
             virtual void ErrorRaised(ServerError err, const std::string& message) = 0;
             virtual void Receive(const std::string& source, const std::string& data) = 0;
             virtual void Receive(const std::string& source, int len, const char *data) = 0;
+            /**
+             * Receives one chunk of a message larger than the chunk size.
+             * The chunks of a message arrive in order and are not
+             * interleaved with other messages.
+             * \param source The source of the message.
+             * \param total The length of the whole message.
+             * \param offset The offset of this chunk in the message.
+             * \param len The length of this chunk.
+             * \param data The chunk.
+             */
+            virtual void ReceiveChunk(const std::string& source, uint32_t total, uint32_t offset,
+               int len, const char *data) = 0;
+            /**
+             * Receives a message published on a topic.
+             * \param source The source of the message.
+             * \param topic The topic of the message.
+             * \param len The length of the message.
+             * \param data The message.
+             */
+            virtual void ReceiveTopic(const std::string& source, const std::string& topic,
+               int len, const char *data) = 0;
             virtual void ClientListResponse(const std::vector<std::string>& clientList) = 0;
             virtual void PropertyValue(const std::string& variable, const std::string& value) = 0;
+            /**
+             * Receives the new value of a watched property, and its value
+             * when first watched.
+             * \param variable The property variable name.
+             * \param value The property value.
+             */
+            virtual void PropertyChanged(const std::string& variable, const std::string& value) = 0;
+            /**
+             * Receives the end of a simulation tick, after every message
+             * of the tick.  Daemons without the tick feature cannot wait
+             * for the other robots, so it then comes straight from Tick.
+             * \param tick The last tick finished by every robot.
+             */
+            virtual void TickReached(uint32_t tick) = 0;
             virtual void StateChanged(ConnectionState state) = 0;
       };
 
       PlayerNSDClient(Handler& handler);
       ~PlayerNSDClient(void);
       bool Connect(const std::string& host, const std::string &port);
+      /**
+       * Connects on a thread of its own, reporting StateDisconnected to the
+       * handler if the daemon cannot be reached.
+       */
+      void ConnectAsync(const std::string& host, const std::string &port);
       void Close();
       void Register(const std::string &clientID);
-      void Send(const std::string& target, const std::string& data);
-      void Send(const std::string& target, uint32_t len, const char *data);
-      void Send(const std::string& data);
-      void Send(uint32_t len, const char *data);
+      void Send(const std::string& target, const std::string& data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      void Send(const std::string& target, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      void Send(const std::string& data, Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      void Send(uint32_t len, const char *data, Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      void SendTopic(const std::string& topic, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      void SendGroup(const std::vector<std::string>& targets, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      void SendRange(double radius, uint32_t len, const char *data,
+         Priority priority = PlayerNSDSendQueue::PriorityBulk);
+      void Subscribe(const std::set<std::string>& topics);
       void PropertyGet(const std::string& variable);
       void PropertySet(const std::string& variable, const std::string& value);
+      void PropertyWatch(const std::set<std::string>& keys);
+      void Tick(uint32_t tick);
+      /**
+       * Sets how often watched properties are polled, for daemons that do
+       * not push their changes.
+       * \param seconds The time between polls, 0 to not poll.
+       */
+      void SetWatchInterval(double seconds);
+      /**
+       * Sets how long Close may spend sending the frames still queued
+       * before dropping them.
+       * \param seconds The time allowed, 0 to drop them straight away.
+       */
+      void SetCloseTimeout(double seconds);
       void RequestIP(const std::string &target);
       void RequestClientList();
       ConnectionState GetConnectionState() { return connectionState; }
+      void RequestFeature(const std::string& feature);
+      bool HasFeature(const std::string& feature);
+      void SetCompressionThreshold(uint32_t threshold);
+      void SetChunkSize(uint32_t size);
+      void SetMaxMessageSize(uint32_t size);
+      void SetFlowQuantum(uint32_t quantum);
+      void SetReceiveBufferSize(int size);
+      /** Uses shared memory rings of this size once connected to a local daemon (0 = off). */
+      void SetSharedMemory(uint32_t ringSize);
+      /**
+       * Records every frame sent and received from now on (call before
+       * connecting to record a whole session).
+       * \param path The recording to create.
+       * \return true if the recording was created.
+       */
+      bool Record(const std::string& path);
+      void GetMetrics(Metrics& metrics);
+
+      /**
+       * Splits a protocol command line into its space separated tokens.
+       * \param command The command line (without the trailing newline).
+       * \param tokens The vector the tokens are appended to.
+       */
+      static void Tokenise(const std::string& command, std::vector<std::string>& tokens);
+      /**
+       * Builds a msgtext frame.
+       * \param target The destination client id, empty for a broadcast.
+       * \param data The text message.
+       * \return The frame as written to the daemon.
+       */
+      static std::string FrameText(const std::string& target, const std::string& data);
+      /**
+       * Builds a msgbin frame.
+       * \param target The destination client id, empty for a broadcast.
+       * \param len The length of the binary message.
+       * \param data The binary message.
+       * \return The frame as written to the daemon.
+       */
+      static std::string FrameBinary(const std::string& target, uint32_t len, const char *data);
+      /**
+       * Builds a msgbinz frame (a compressed msgbin).
+       * \param target The destination client id, empty for a broadcast.
+       * \param len The length of the compressed message.
+       * \param data The compressed message.
+       * \param rawLen The length of the message once decompressed.
+       * \return The frame as written to the daemon.
+       */
+      static std::string FrameCompressed(const std::string& target, uint32_t len,
+         const char *data, uint32_t rawLen);
+      /**
+       * Builds a msgtopic frame, for daemons with the topics feature.
+       * \param topic The topic.
+       * \param len The length of the binary message.
+       * \param data The binary message.
+       * \return The frame as written to the daemon.
+       */
+      static std::string FrameTopic(const std::string& topic, uint32_t len, const char *data);
+      /**
+       * Builds a msgrange frame, for daemons with the range feature.
+       * \param radius The range of the broadcast.
+       * \param len The length of the binary message.
+       * \param data The binary message.
+       * \return The frame as written to the daemon.
+       */
+      static std::string FrameRange(double radius, uint32_t len, const char *data);
+      /**
+       * Wraps a topic message in an envelope, so it can be broadcast through
+       * daemons without the topics feature.
+       * \param topic The topic.
+       * \param len The length of the binary message.
+       * \param data The binary message.
+       * \return The enveloped message.
+       */
+      static std::string EnvelopeTopic(const std::string& topic, uint32_t len, const char *data);
+      /**
+       * Checks a received binary message for a topic envelope.
+       * \param data The binary message.
+       * \param len The length of the binary message.
+       * \param topic The topic, if enveloped.
+       * \return The length of the envelope, or 0 if the message has none.
+       */
+      static std::size_t ParseTopicEnvelope(const char *data, std::size_t len, std::string& topic);
       class Exception : public std::exception
       {
          public:
@@ -103,23 +359,105 @@ class PlayerNSDClient
 
    private:
       boost::asio::io_service ioService;
-      tcp::socket socket;
-      boost::thread reader, writer;
+      /** A TCP or unix domain socket, or shared memory once negotiated. */
+      PlayerNSDStream stream;
+      boost::thread reader, writer, connector, watcher;
    protected:
       ConnectionState connectionState;
       std::string protocolVersion;
       Exception exception;
-      boost::locking_queue<std::string> messageSendQueue;
+      PlayerNSDSendQueue messageSendQueue;
       std::string id, host, port;
 
    private:
+      /** Totals for compressing or decompressing payloads. */
+      struct CodecMetrics
+      {
+         CodecMetrics() : messages(0), rawBytes(0), codedBytes(0), cpuTime(0.0) {}
+         uint64_t messages;
+         uint64_t rawBytes;
+         uint64_t codedBytes;
+         double cpuTime;
+      };
+
+      void processConnector(std::string host, std::string port);
+      void connectSocket(const boost::asio::generic::stream_protocol::endpoint& endpoint,
+         boost::system::error_code& error);
       void processReader();
       void processWriter();
+      bool writeGreetings();
       void changeState(ConnectionState state);
+      bool readResponse(std::size_t length);
+      bool receivePayload(const std::string& source, std::size_t length);
+      void deliverBinary(const std::string& source, uint32_t len, const char *data);
+      std::size_t messageSizeLimit() const;
+      bool refuseMessage(const std::string& command, std::size_t length);
+      void sendSubscription();
+      void sendWatch();
+      void processWatcher();
+      bool popPropertyGet(std::string& variable);
+      void watchedValue(const std::string& variable, const std::string& value);
+      void attachSharedMemory();
+      std::string encodeBinary(const std::string& target, uint32_t len, const char *data);
+      bool encodePayload(uint32_t len, const char *data, std::string& coded);
+      bool decodeBinary(const char *data, uint32_t len, char *raw, uint32_t rawLen);
+      void addCodecMetrics(Metrics& metrics, const std::string& prefix, const CodecMetrics& codec);
 
       Handler& handler;
       boost::asio::io_service io_service;
-      boost::asio::streambuf request;
       boost::asio::streambuf response;
+      std::set<std::string> requestedFeatures;
+      std::set<std::string> features;
+      boost::mutex featureMutex;
+      uint32_t compressionThreshold;
+      CodecMetrics compressMetrics;
+      CodecMetrics decompressMetrics;
+      boost::mutex metricsMutex;
+      int receiveBufferSize;
+      uint32_t chunkSize;
+      uint32_t maxMessageSize;
+      std::vector<char> payload;
+      std::set<std::string> subscription;
+      bool subscribed;
+      boost::mutex topicMutex;
+      /** The watched keys, with the last value of each seen. */
+      std::set<std::string> watched;
+      std::map<std::string, std::string> watchedValues;
+      /** Keys of the propgets awaiting an answer, in the order sent, and
+          whether each is a poll of a watched key. */
+      std::deque<std::pair<std::string, bool> > propertyGets;
+      std::size_t watchPolls;
+      double watchInterval;
+      boost::mutex watchMutex;
+      /** Progress of switching to the shared memory transport. */
+      enum ShmState
+      {
+         ShmOff,
+         ShmPending,
+         ShmReady,
+         ShmRefused,
+      };
+      uint32_t shmRingSize;
+      ShmState shmState;
+      boost::mutex shmMutex;
+      boost::condition_variable shmChanged;
+      /** Whether the writer may send the queue, held until registered. */
+      enum WriterState
+      {
+         WriterWaiting,
+         WriterRegistered,
+         WriterClosed,
+      };
+      void releaseWriter(WriterState state);
+      WriterState writerState;
+      /** A greeting for the writer to send ahead of the queue. */
+      std::string greeting;
+      boost::mutex writerMutex;
+      boost::condition_variable writerChanged;
+      double closeTimeout;
+      /** Set by Close to abandon a connection in progress. */
+      boost::atomic<bool> closing;
+      boost::scoped_ptr<PlayerNSDRecorder> recorder;
 };
 
+#endif
@@ -0,0 +1,138 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd spatial index of client positions.
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <boost/foreach.hpp>
+#include "playernsd_grid.h"
+
+PlayerNSDGrid::PlayerNSDGrid(double cellSize) :
+   cellSize(cellSize > 0.0 ? cellSize : PLAYERNSD_GRID_CELL)
+{
+}
+
+PlayerNSDGrid::Cell PlayerNSDGrid::cellOf(double x, double y) const
+{
+   return Cell((long) std::floor(x / cellSize), (long) std::floor(y / cellSize));
+}
+
+PlayerNSDGrid::Entries::iterator PlayerNSDGrid::entryOf(Entries& entries, const std::string& id)
+{
+   Entries::iterator it = entries.begin();
+   while (it != entries.end() && it->id != id)
+      ++it;
+   return it;
+}
+
+void PlayerNSDGrid::Update(const std::string& id, double x, double y)
+{
+   Cell cell = cellOf(x, y);
+   std::map<std::string, Cell>::iterator it = positions.find(id);
+   if (it != positions.end())
+   {
+      Entries& old = cells[it->second];
+      Entries::iterator entry = entryOf(old, id);
+      // Most moves stay within the cell.
+      if (it->second == cell)
+      {
+         entry->x = x;
+         entry->y = y;
+         return;
+      }
+      old.erase(entry);
+      if (old.empty())
+         cells.erase(it->second);
+      it->second = cell;
+   }
+   else
+      positions[id] = cell;
+   Entry entry;
+   entry.id = id;
+   entry.x = x;
+   entry.y = y;
+   cells[cell].push_back(entry);
+}
+
+void PlayerNSDGrid::Remove(const std::string& id)
+{
+   std::map<std::string, Cell>::iterator it = positions.find(id);
+   if (it == positions.end())
+      return;
+   Entries& old = cells[it->second];
+   old.erase(entryOf(old, id));
+   if (old.empty())
+      cells.erase(it->second);
+   positions.erase(it);
+}
+
+bool PlayerNSDGrid::Find(const std::string& id, double& x, double& y) const
+{
+   std::map<std::string, Cell>::const_iterator it = positions.find(id);
+   if (it == positions.end())
+      return false;
+   const Entries& entries = cells.find(it->second)->second;
+   for (std::size_t i = 0; i < entries.size(); i++)
+      if (entries[i].id == id)
+      {
+         x = entries[i].x;
+         y = entries[i].y;
+         return true;
+      }
+   return false;
+}
+
+void PlayerNSDGrid::Query(double x, double y, double radius, std::vector<std::string>& ids) const
+{
+   if (radius < 0.0)
+      return;
+   Cell low = cellOf(x - radius, y - radius);
+   Cell high = cellOf(x + radius, y + radius);
+   double squared = radius * radius;
+   // A range wider than the occupied cells is cheaper to check cell by cell.
+   if ((high.first - low.first + 1.0) * (high.second - low.second + 1.0) > cells.size())
+   {
+      for (boost::unordered_map<Cell, Entries>::const_iterator cell = cells.begin();
+         cell != cells.end(); ++cell)
+         BOOST_FOREACH(const Entry& entry, cell->second)
+         {
+            double dx = entry.x - x, dy = entry.y - y;
+            if (dx * dx + dy * dy <= squared)
+               ids.push_back(entry.id);
+         }
+      return;
+   }
+   for (long cx = low.first; cx <= high.first; cx++)
+      for (long cy = low.second; cy <= high.second; cy++)
+      {
+         boost::unordered_map<Cell, Entries>::const_iterator cell = cells.find(Cell(cx, cy));
+         if (cell == cells.end())
+            continue;
+         BOOST_FOREACH(const Entry& entry, cell->second)
+         {
+            double dx = entry.x - x, dy = entry.y - y;
+            if (dx * dx + dy * dy <= squared)
+               ids.push_back(entry.id);
+         }
+      }
+}
@@ -0,0 +1,99 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd spatial index of client positions.
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * A uniform grid of square cells holding the latest position of each
+ * client, for finding the clients within range of a sender.  A query only
+ * visits the cells the range touches, so its cost follows the number of
+ * clients nearby rather than the number of clients in all.
+ *
+ * The grid is not locked, its owner guards it.
+ */
+
+#ifndef _PLAYERNSD_GRID_H_
+#define _PLAYERNSD_GRID_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+/** Default side of a grid cell, in metres. */
+#define PLAYERNSD_GRID_CELL 5.0
+
+class PlayerNSDGrid
+{
+   public:
+      /** \param cellSize The side of a cell, best about the usual range. */
+      PlayerNSDGrid(double cellSize = PLAYERNSD_GRID_CELL);
+
+      /**
+       * Places a client, or moves it if already placed.
+       * \param id The client id.
+       * \param x The x coordinate.
+       * \param y The y coordinate.
+       */
+      void Update(const std::string& id, double x, double y);
+
+      /** Removes a client, if placed. */
+      void Remove(const std::string& id);
+
+      /**
+       * Gets the position of a client.
+       * \return false if the client is not placed.
+       */
+      bool Find(const std::string& id, double& x, double& y) const;
+
+      /**
+       * Finds the clients within a range of a point.
+       * \param x The x coordinate.
+       * \param y The y coordinate.
+       * \param radius The range.
+       * \param ids The vector the ids found are appended to.
+       */
+      void Query(double x, double y, double radius, std::vector<std::string>& ids) const;
+
+      std::size_t Size() const { return positions.size(); }
+
+   private:
+      typedef std::pair<long, long> Cell;
+
+      /** A client in a cell, with its position kept there for queries. */
+      struct Entry
+      {
+         std::string id;
+         double x, y;
+      };
+      typedef std::vector<Entry> Entries;
+
+      Cell cellOf(double x, double y) const;
+      Entries::iterator entryOf(Entries& entries, const std::string& id);
+
+      double cellSize;
+      /** The cell of each client. */
+      std::map<std::string, Cell> positions;
+      boost::unordered_map<Cell, Entries> cells;
+};
+
+#endif
@@ -0,0 +1,303 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd traffic recorder.
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/thread/locks.hpp>
+#include "playernsd_recorder.h"
+
+/** Marks a playernsd recording, with the format version. */
+static const char recordMagic[8] = { 'N', 'S', 'D', 'R', 'E', 'C', '0', '1' };
+
+/** Initial size of the mapping, doubled as needed. */
+#define PLAYERNSD_RECORD_INITIAL_SIZE (16 << 20)
+
+/** Flag for a record that continues the previous frame. */
+#define PLAYERNSD_RECORD_CONTINUATION 1
+
+struct RecordFileHeader
+{
+   char magic[8];
+   /** Start of the recording on the monotonic and the real time clocks. */
+   uint64_t startMonotonic;
+   uint64_t startRealtime;
+   /** End of the records, kept up to date while recording. */
+   uint64_t dataEnd;
+   /** The block index, written on close (0 if not closed). */
+   uint64_t indexOffset;
+   uint64_t indexCount;
+   uint32_t blockSize;
+   char pad[12];
+};
+
+struct RecordHeader
+{
+   uint64_t time;
+   uint32_t length;
+   uint16_t direction;
+   uint16_t flags;
+};
+
+struct RecordIndexEntry
+{
+   uint64_t offset;
+   uint64_t time;
+};
+
+static uint64_t clockNanoseconds(clockid_t clock)
+{
+   struct timespec ts;
+   clock_gettime(clock, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static std::size_t align8(std::size_t n)
+{
+   return (n + 7) & ~(std::size_t) 7;
+}
+
+PlayerNSDRecorder::PlayerNSDRecorder() :
+   fd(-1), map(NULL), capacity(0), end(0), start(0), blockSize(0), nextBlock(0)
+{
+}
+
+PlayerNSDRecorder::~PlayerNSDRecorder()
+{
+   Close();
+}
+
+bool PlayerNSDRecorder::Open(const std::string& path, uint32_t blockSize)
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+      return false;
+   if (!reserve(PLAYERNSD_RECORD_INITIAL_SIZE))
+   {
+      close(fd);
+      fd = -1;
+      return false;
+   }
+   this->blockSize = std::max<uint32_t>(blockSize, 4096);
+   start = clockNanoseconds(CLOCK_MONOTONIC);
+   RecordFileHeader *header = (RecordFileHeader *) map;
+   memcpy(header->magic, recordMagic, sizeof(recordMagic));
+   header->startMonotonic = start;
+   header->startRealtime = clockNanoseconds(CLOCK_REALTIME);
+   header->blockSize = this->blockSize;
+   end = sizeof(RecordFileHeader);
+   header->dataEnd = end;
+   nextBlock = 0;
+   index.clear();
+   return true;
+}
+
+bool PlayerNSDRecorder::reserve(std::size_t size)
+{
+   if (size <= capacity)
+      return true;
+   std::size_t grown = std::max(size, capacity * 2);
+   if (ftruncate(fd, grown) < 0)
+      return false;
+   if (map)
+      munmap(map, capacity);
+   void *p = mmap(NULL, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (p == MAP_FAILED)
+   {
+      map = NULL;
+      capacity = 0;
+      return false;
+   }
+   map = (char *) p;
+   capacity = grown;
+   return true;
+}
+
+void PlayerNSDRecorder::Append(Direction direction, const std::string& frame, const char *data,
+   std::size_t len, bool continuation)
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   if (!map)
+      return;
+   std::size_t length = frame.size() + len;
+   if (!reserve(end + align8(sizeof(RecordHeader) + length)))
+   {
+      // Out of space, stop recording rather than fail the connection.
+      closeLog();
+      return;
+   }
+   uint64_t now = clockNanoseconds(CLOCK_MONOTONIC) - start;
+   if (end >= nextBlock)
+   {
+      index.push_back(std::make_pair((uint64_t) end, now));
+      nextBlock = (end / blockSize + 1) * blockSize;
+   }
+   RecordHeader *record = (RecordHeader *)(map + end);
+   record->time = now;
+   record->length = length;
+   record->direction = direction;
+   record->flags = continuation ? PLAYERNSD_RECORD_CONTINUATION : 0;
+   memcpy(record + 1, frame.data(), frame.size());
+   if (len)
+      memcpy((char *)(record + 1) + frame.size(), data, len);
+   end += align8(sizeof(RecordHeader) + length);
+   __atomic_store_n(&((RecordFileHeader *) map)->dataEnd, end, __ATOMIC_RELEASE);
+}
+
+void PlayerNSDRecorder::Close()
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   closeLog();
+}
+
+void PlayerNSDRecorder::closeLog()
+{
+   if (fd < 0)
+      return;
+   if (map && reserve(end + index.size() * sizeof(RecordIndexEntry)))
+   {
+      RecordIndexEntry *entries = (RecordIndexEntry *)(map + end);
+      for (std::size_t i = 0; i < index.size(); i++)
+      {
+         entries[i].offset = index[i].first;
+         entries[i].time = index[i].second;
+      }
+      RecordFileHeader *header = (RecordFileHeader *) map;
+      header->indexOffset = end;
+      header->indexCount = index.size();
+      end += index.size() * sizeof(RecordIndexEntry);
+   }
+   if (map)
+      munmap(map, capacity);
+   // Drop the unused tail of the mapping.
+   if (ftruncate(fd, end) < 0)
+      perror("Unable to trim recording");
+   close(fd);
+   fd = -1;
+   map = NULL;
+   capacity = 0;
+}
+
+PlayerNSDRecording::PlayerNSDRecording() : map(NULL), size(0), end(0), position(0)
+{
+}
+
+PlayerNSDRecording::~PlayerNSDRecording()
+{
+   if (map)
+      munmap(map, size);
+}
+
+bool PlayerNSDRecording::Open(const std::string& path)
+{
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0)
+      return false;
+   struct stat st;
+   if (fstat(fd, &st) < 0 || (std::size_t) st.st_size < sizeof(RecordFileHeader))
+   {
+      close(fd);
+      return false;
+   }
+   void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED)
+      return false;
+   map = (char *) p;
+   size = st.st_size;
+   const RecordFileHeader *header = (const RecordFileHeader *) map;
+   if (memcmp(header->magic, recordMagic, sizeof(recordMagic)) ||
+      header->dataEnd < sizeof(RecordFileHeader) || header->dataEnd > size)
+   {
+      munmap(map, size);
+      map = NULL;
+      return false;
+   }
+   end = header->dataEnd;
+   position = sizeof(RecordFileHeader);
+   return true;
+}
+
+bool PlayerNSDRecording::Next(Record& record)
+{
+   if (!map || position + sizeof(RecordHeader) > end)
+      return false;
+   const RecordHeader *header = (const RecordHeader *)(map + position);
+   if (position + sizeof(RecordHeader) + header->length > end)
+      return false;
+   record.time = header->time;
+   record.direction = (PlayerNSDRecorder::Direction) header->direction;
+   record.continuation = header->flags & PLAYERNSD_RECORD_CONTINUATION;
+   record.data = (const char *)(header + 1);
+   record.length = header->length;
+   position += align8(sizeof(RecordHeader) + header->length);
+   return true;
+}
+
+bool PlayerNSDRecording::HasIndex() const
+{
+   return map && ((const RecordFileHeader *) map)->indexOffset != 0;
+}
+
+void PlayerNSDRecording::Seek(uint64_t time)
+{
+   if (!map)
+      return;
+   position = sizeof(RecordFileHeader);
+   if (HasIndex())
+   {
+      // Start from the last block that begins at or before the time.
+      const RecordFileHeader *header = (const RecordFileHeader *) map;
+      const RecordIndexEntry *entries = (const RecordIndexEntry *)(map + header->indexOffset);
+      std::size_t lo = 0, hi = header->indexCount;
+      while (lo < hi)
+      {
+         std::size_t mid = (lo + hi) / 2;
+         if (entries[mid].time <= time)
+            lo = mid + 1;
+         else
+            hi = mid;
+      }
+      if (lo)
+         position = entries[lo - 1].offset;
+   }
+   for (;;)
+   {
+      std::size_t last = position;
+      Record record;
+      if (!Next(record))
+         return;
+      if (record.time >= time)
+      {
+         position = last;
+         return;
+      }
+   }
+}
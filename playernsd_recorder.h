@@ -0,0 +1,158 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd traffic recorder.
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * Records the frames of a playernsd connection, in both directions, to a
+ * memory-mapped binary log so that a run can be replayed later.
+ *
+ * A log starts with a fixed header, followed by the records: a 16 byte
+ * record header (time in nanoseconds since the recording started on the
+ * monotonic clock, length, direction and flags) and the frame, padded to 8
+ * bytes.  The header keeps the end of the records up to date on every
+ * append, so a log of a crashed run can still be read.  When the log is
+ * closed a block index is appended (the offset and time of the first record
+ * in each block of the log), which lets a reader seek to a point in time
+ * without scanning the records before it.
+ *
+ * A frame whose payload is received in chunks is recorded as its command
+ * line followed by one continuation record per chunk.
+ */
+
+#ifndef _PLAYERNSD_RECORDER_H_
+#define _PLAYERNSD_RECORDER_H_
+
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+#include <boost/cstdint.hpp>
+
+/** Default size of the blocks the index points into. */
+#define PLAYERNSD_RECORD_BLOCK_SIZE (1 << 20)
+
+class PlayerNSDRecorder : boost::noncopyable
+{
+   public:
+      /** The direction of a recorded frame. */
+      enum Direction
+      {
+         Inbound,
+         Outbound,
+      };
+
+      PlayerNSDRecorder();
+      ~PlayerNSDRecorder();
+
+      /**
+       * Creates a log, replacing any existing file.
+       * \param path The path of the log.
+       * \param blockSize The size of the blocks indexed.
+       * \return true if the log was created.
+       */
+      bool Open(const std::string& path, uint32_t blockSize = PLAYERNSD_RECORD_BLOCK_SIZE);
+
+      /**
+       * Appends a frame to the log.
+       * \param direction The direction of the frame.
+       * \param frame The frame, or its command line.
+       * \param data A payload following the frame, if any.
+       * \param len The length of the payload.
+       * \param continuation Whether this continues the previous frame in
+       * the same direction.
+       */
+      void Append(Direction direction, const std::string& frame, const char *data = NULL,
+         std::size_t len = 0, bool continuation = false);
+
+      /**
+       * Writes the index and closes the log.
+       */
+      void Close();
+
+   private:
+      bool reserve(std::size_t size);
+      void closeLog();
+
+      boost::mutex mutex;
+      int fd;
+      char *map;
+      std::size_t capacity;
+      std::size_t end;
+      uint64_t start;
+      uint32_t blockSize;
+      std::size_t nextBlock;
+      /** Offset and time of the first record in each block. */
+      std::vector<std::pair<uint64_t, uint64_t> > index;
+};
+
+/**
+ * Reads a log written by PlayerNSDRecorder.
+ */
+class PlayerNSDRecording : boost::noncopyable
+{
+   public:
+      /** A recorded frame, pointing into the mapped log. */
+      struct Record
+      {
+         /** Nanoseconds since the recording started. */
+         uint64_t time;
+         PlayerNSDRecorder::Direction direction;
+         bool continuation;
+         const char *data;
+         uint32_t length;
+      };
+
+      PlayerNSDRecording();
+      ~PlayerNSDRecording();
+
+      /**
+       * Maps a log.
+       * \param path The path of the log.
+       * \return true if it is a valid log.
+       */
+      bool Open(const std::string& path);
+
+      /**
+       * Reads the next record.
+       * \return false at the end of the log.
+       */
+      bool Next(Record& record);
+
+      /**
+       * Moves to the first record at or after a time, using the block index
+       * if the log has one.
+       * \param time Nanoseconds since the recording started.
+       */
+      void Seek(uint64_t time);
+
+      /** Returns whether the log has a block index (it was closed cleanly). */
+      bool HasIndex() const;
+
+   private:
+      char *map;
+      std::size_t size;
+      std::size_t end;
+      std::size_t position;
+};
+
+#endif
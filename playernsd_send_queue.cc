@@ -0,0 +1,261 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd send queue.
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ */
+
+#include <algorithm>
+#include "playernsd_send_queue.h"
+
+const char *PlayerNSDSendQueue::BroadcastFlow = "*";
+
+PlayerNSDSendQueue::PlayerNSDSendQueue(std::size_t quantum) :
+   conflated(0), frontCredited(false), bulkSize(0),
+   quantum(std::max<std::size_t>(quantum, 1)), finishing(false), closed(false)
+{
+}
+
+void PlayerNSDSendQueue::Push(const std::string& frame, Priority priority,
+   const std::string& flow, const Payload& payload)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      if (finishing || closed)
+         return;
+      // Only messages are held back, so pong and property requests never
+      // wait for the bulk data ahead of a barrier.
+      if (!held.empty() && (priority == PriorityBulk || !flow.empty()))
+      {
+         held.push_back(HeldFrame());
+         held.back().frame = frame;
+         held.back().payload = payload;
+         held.back().priority = priority;
+         held.back().flow = flow;
+         held.back().barrier = false;
+         return;
+      }
+      enqueue(frame, priority, flow, payload);
+   }
+   nonEmpty.notify_one();
+}
+
+void PlayerNSDSendQueue::enqueue(const std::string& frame, Priority priority,
+   const std::string& flow, const Payload& payload)
+{
+   if (priority == PriorityControl)
+   {
+      control.push_back(ControlFrame());
+      control.back().frame = frame;
+      control.back().payload = payload;
+   }
+   else
+   {
+      std::string name = flow.empty() ? std::string(BroadcastFlow) : flow;
+      Flow& f = flows[name];
+      if (f.frames.empty())
+         activeFlows.push_back(name);
+      f.frames.push_back(BulkFrame());
+      f.frames.back().frame = frame;
+      f.frames.back().payload = payload;
+      bulkSize++;
+   }
+}
+
+void PlayerNSDSendQueue::PushConflated(const std::string& frame, const std::string& key)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      if (finishing || closed)
+         return;
+      if (!enqueueConflated(frame, key))
+         return;
+   }
+   nonEmpty.notify_one();
+}
+
+bool PlayerNSDSendQueue::enqueueConflated(const std::string& frame, const std::string& key)
+{
+   std::map<std::string, ControlFrame *>::iterator it = slots.find(key);
+   if (it != slots.end())
+   {
+      // Deque elements stay put when pushing or popping at the ends.
+      it->second->frame = frame;
+      conflated++;
+      return false;
+   }
+   control.push_back(ControlFrame());
+   control.back().frame = frame;
+   control.back().key = key;
+   slots[key] = &control.back();
+   return true;
+}
+
+void PlayerNSDSendQueue::PushBarrier(const std::string& frame)
+{
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      if (finishing || closed)
+         return;
+      held.push_back(HeldFrame());
+      held.back().frame = frame;
+      held.back().barrier = true;
+   }
+   nonEmpty.notify_one();
+}
+
+bool PlayerNSDSendQueue::Pop(std::string& frame)
+{
+   Payload payload;
+   if (!Pop(frame, payload))
+      return false;
+   if (payload)
+      frame += *payload;
+   return true;
+}
+
+bool PlayerNSDSendQueue::Pop(std::string& frame, Payload& payload)
+{
+   boost::unique_lock<boost::mutex> lock(mutex);
+   for (;;)
+   {
+      if (closed)
+         return false;
+      if (!control.empty())
+      {
+         frame.swap(control.front().frame);
+         payload.swap(control.front().payload);
+         if (!control.front().key.empty())
+            slots.erase(control.front().key);
+         control.pop_front();
+         return true;
+      }
+      if (popBulk(frame, payload))
+         return true;
+      if (popBarrier(frame, payload))
+         return true;
+      if (finishing)
+         return false;
+      nonEmpty.wait(lock);
+   }
+}
+
+bool PlayerNSDSendQueue::popBulk(std::string& frame, Payload& payload)
+{
+   while (!activeFlows.empty())
+   {
+      std::map<std::string, Flow>::iterator it = flows.find(activeFlows.front());
+      Flow& flow = it->second;
+      if (!frontCredited)
+      {
+         flow.deficit += quantum;
+         frontCredited = true;
+      }
+      BulkFrame& head = flow.frames.front();
+      // A lone flow has nobody to be fair to.
+      if (head.size() <= flow.deficit || activeFlows.size() == 1)
+      {
+         flow.deficit -= std::min(head.size(), flow.deficit);
+         frame.swap(head.frame);
+         payload.swap(head.payload);
+         flow.frames.pop_front();
+         bulkSize--;
+         if (flow.frames.empty())
+         {
+            flows.erase(it);
+            activeFlows.pop_front();
+            frontCredited = false;
+         }
+         return true;
+      }
+      // Not enough credit left this round, move on to the next flow.
+      activeFlows.push_back(activeFlows.front());
+      activeFlows.pop_front();
+      frontCredited = false;
+   }
+   return false;
+}
+
+bool PlayerNSDSendQueue::popBarrier(std::string& frame, Payload& payload)
+{
+   // Only reached once both lanes are empty, so the barrier follows every
+   // frame queued before it.
+   if (held.empty())
+      return false;
+   frame.swap(held.front().frame);
+   payload.reset();
+   held.pop_front();
+   // What was queued behind it goes into the lanes, up to the next barrier.
+   while (!held.empty() && !held.front().barrier)
+   {
+      HeldFrame& next = held.front();
+      enqueue(next.frame, next.priority, next.flow, next.payload);
+      held.pop_front();
+   }
+   return true;
+}
+
+void PlayerNSDSendQueue::Finish()
+{
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      finishing = true;
+   }
+   nonEmpty.notify_all();
+}
+
+void PlayerNSDSendQueue::Close()
+{
+   {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      closed = true;
+   }
+   nonEmpty.notify_all();
+}
+
+std::size_t PlayerNSDSendQueue::Size(Priority priority) const
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   std::size_t size = priority == PriorityControl ? control.size() : bulkSize;
+   for (std::deque<HeldFrame>::const_iterator it = held.begin(); it != held.end(); ++it)
+      if ((it->barrier ? PriorityControl : it->priority) == priority)
+         size++;
+   return size;
+}
+
+void PlayerNSDSendQueue::GetFlowDepths(FlowDepths& depths) const
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   for (std::map<std::string, Flow>::const_iterator it = flows.begin(); it != flows.end(); ++it)
+      depths[it->first] = it->second.frames.size();
+}
+
+uint64_t PlayerNSDSendQueue::GetConflatedCount() const
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   return conflated;
+}
+
+void PlayerNSDSendQueue::SetQuantum(std::size_t quantum)
+{
+   boost::lock_guard<boost::mutex> lock(mutex);
+   // A flow must earn some credit each round, or the round never ends.
+   this->quantum = std::max<std::size_t>(quantum, 1);
+}
@@ -0,0 +1,225 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd send queue.
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * The queue of frames waiting for the writer thread.  Frames are queued in
+ * priority lanes so that small control frames (pong, property updates,
+ * requests) are never stuck behind bulk message data.
+ *
+ * Within the bulk lane every destination is a separate flow, and the flows
+ * are served by deficit round-robin on bytes, so a long stream of messages
+ * to one client does not hold up the messages to any other.
+ *
+ * Control frames can be keyed (property updates by their key), in which case
+ * a newer frame replaces an older one with the same key that has not been
+ * written yet, so only the freshest value is sent.
+ *
+ * A frame may be followed by a shared payload, so that the same message sent
+ * to several destinations is only held in memory once.
+ *
+ * A barrier frame is sent after every frame queued before it, whatever its
+ * lane or flow, and messages (frames with a flow, and bulk frames) queued
+ * after it wait until it has been taken.  The protocol's own control
+ * frames, such as pong and property requests, are never held back.
+ *
+ * On shutdown the queue is finished rather than closed, so that the writer
+ * drains what is left (a final barrier goes out last) and then stops.
+ */
+
+#ifndef _PLAYERNSD_SEND_QUEUE_H_
+#define _PLAYERNSD_SEND_QUEUE_H_
+
+#include <deque>
+#include <map>
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/utility.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+class PlayerNSDSendQueue : boost::noncopyable
+{
+   public:
+      /** Priority lanes, served strictly in this order. */
+      enum Priority
+      {
+         PriorityControl,
+         PriorityBulk,
+         PriorityCount,
+      };
+
+      /** Name of the flow of broadcast messages. */
+      static const char *BroadcastFlow;
+
+      /** Flow depths by flow name. */
+      typedef std::map<std::string, std::size_t> FlowDepths;
+
+      /** A payload shared between frames, written after the frame. */
+      typedef boost::shared_ptr<const std::string> Payload;
+
+      /**
+       * Creates a send queue.
+       * \param quantum The bytes each bulk flow may send per round.
+       */
+      PlayerNSDSendQueue(std::size_t quantum = 65536);
+
+      /**
+       * Queues a frame.
+       * \param frame The frame to send.
+       * \param priority The lane to queue the frame in.
+       * \param flow The flow within the bulk lane (the destination, or
+       * BroadcastFlow), empty for frames that are not messages.
+       * \param payload A payload to write after the frame, if any.
+       */
+      void Push(const std::string& frame, Priority priority,
+         const std::string& flow = std::string(), const Payload& payload = Payload());
+
+      /**
+       * Queues a control frame, replacing in place any queued control frame
+       * with the same key that has not been written yet.
+       * \param frame The frame to send.
+       * \param key The key of the frame.
+       */
+      void PushConflated(const std::string& frame, const std::string& key);
+
+      /**
+       * Queues a barrier frame, sent after every frame queued so far.  The
+       * messages queued after it are held back until it has been taken.
+       * \param frame The frame to send.
+       */
+      void PushBarrier(const std::string& frame);
+
+      /**
+       * Takes the next frame to send, blocking until there is one.
+       * \param frame The frame to send.
+       * \return false if the queue has been closed.
+       */
+      bool Pop(std::string& frame);
+
+      /**
+       * Takes the next frame to send without joining its payload to it,
+       * blocking until there is one.
+       * \param frame The frame to send.
+       * \param payload The payload to send after the frame, if any.
+       * \return false if the queue has been closed.
+       */
+      bool Pop(std::string& frame, Payload& payload);
+
+      /**
+       * Lets Pop take the frames queued so far and then fail, instead of
+       * blocking.  Frames queued from now on are dropped.
+       */
+      void Finish();
+
+      /**
+       * Wakes up any blocked Pop and makes further ones fail.
+       */
+      void Close();
+
+      /**
+       * Returns the number of frames queued in a lane.
+       * \param priority The lane.
+       */
+      std::size_t Size(Priority priority) const;
+
+      /**
+       * Gets the number of frames queued in each non-empty bulk flow.
+       * \param depths The depths, by flow name.
+       */
+      void GetFlowDepths(FlowDepths& depths) const;
+
+      /**
+       * Returns the number of frames that have been replaced by newer ones.
+       */
+      uint64_t GetConflatedCount() const;
+
+      /**
+       * Sets the bytes each bulk flow may send per round.
+       * \param quantum The quantum in bytes, at least 1.
+       */
+      void SetQuantum(std::size_t quantum);
+
+   private:
+      /** A control frame and its conflation key (empty if not keyed). */
+      struct ControlFrame
+      {
+         std::string frame;
+         Payload payload;
+         std::string key;
+      };
+
+      /** A bulk frame. */
+      struct BulkFrame
+      {
+         std::size_t size() const { return frame.size() + (payload ? payload->size() : 0); }
+         std::string frame;
+         Payload payload;
+      };
+
+      /** A bulk flow and its deficit counter. */
+      struct Flow
+      {
+         Flow() : deficit(0) {}
+         std::deque<BulkFrame> frames;
+         std::size_t deficit;
+      };
+
+      /** A message queued behind a barrier, or a barrier. */
+      struct HeldFrame
+      {
+         std::string frame;
+         Payload payload;
+         Priority priority;
+         std::string flow;
+         bool barrier;
+      };
+
+      void enqueue(const std::string& frame, Priority priority,
+         const std::string& flow, const Payload& payload);
+      bool enqueueConflated(const std::string& frame, const std::string& key);
+      bool popBulk(std::string& frame, Payload& payload);
+      bool popBarrier(std::string& frame, Payload& payload);
+
+      mutable boost::mutex mutex;
+      boost::condition_variable nonEmpty;
+      std::deque<ControlFrame> control;
+      /** Queued keyed control frames, by key. */
+      std::map<std::string, ControlFrame *> slots;
+      uint64_t conflated;
+      std::map<std::string, Flow> flows;
+      /** Flows with frames queued, in round-robin order. */
+      std::deque<std::string> activeFlows;
+      /** Whether the flow at the front has had its quantum this round. */
+      bool frontCredited;
+      std::size_t bulkSize;
+      /** The oldest barrier not yet taken, then the frames and barriers
+          queued after it. */
+      std::deque<HeldFrame> held;
+      std::size_t quantum;
+      bool finishing;
+      bool closed;
+};
+
+#endif
@@ -0,0 +1,331 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd stream.
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/lexical_cast.hpp>
+#if defined (__linux__)
+   #include <linux/futex.h>
+   #include <sys/syscall.h>
+#endif
+#include "playernsd_stream.h"
+
+/** Marks a playernsd shared memory segment. */
+#define PLAYERNSD_SHM_MAGIC 0x4e534452
+/** How long a blocked read or write sleeps before checking on the peer. */
+#define PLAYERNSD_SHM_WAIT_MS 100
+
+/**
+ * One direction of the shared memory transport.  Positions count bytes
+ * written and read and wrap around; the producer only writes head and the
+ * consumer only writes tail, each on its own cache line.
+ */
+struct PlayerNSDStream::Ring
+{
+   uint32_t size;
+   uint32_t closed;
+   char pad0[56];
+   uint32_t head;
+   /** Futex word, bumped whenever data is added. */
+   uint32_t dataSeq;
+   uint32_t readerWaiting;
+   char pad1[52];
+   uint32_t tail;
+   /** Futex word, bumped whenever data is taken. */
+   uint32_t spaceSeq;
+   uint32_t writerWaiting;
+   char pad2[52];
+
+   char *data() { return (char *)(this + 1); }
+};
+
+/** The start of a segment, followed by the two rings. */
+struct SegmentHeader
+{
+   uint32_t magic;
+   uint32_t ringSize;
+   char pad[56];
+};
+
+static uint32_t load(uint32_t *p)
+{
+   return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store(uint32_t *p, uint32_t v)
+{
+   __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sleeps while a futex word still has a value, for at most the wait period.
+ * \return false if the wait period passed without a wakeup.
+ */
+static bool futexWait(uint32_t *p, uint32_t value)
+{
+#if defined (__linux__)
+   struct timespec ts = { 0, PLAYERNSD_SHM_WAIT_MS * 1000000L };
+   return syscall(SYS_futex, p, FUTEX_WAIT, value, &ts, NULL, 0) == 0 || errno != ETIMEDOUT;
+#else
+   if (load(p) == value)
+      usleep(1000);
+   return load(p) != value;
+#endif
+}
+
+static void futexWake(uint32_t *p)
+{
+#if defined (__linux__)
+   syscall(SYS_futex, p, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+PlayerNSDStream::PlayerNSDStream(boost::asio::io_service& ioService) :
+   socket(ioService), segment(NULL), segmentSize(0), in(NULL), out(NULL),
+   shmReads(false), shmWrites(false), closed(false)
+{
+}
+
+PlayerNSDStream::~PlayerNSDStream()
+{
+   UnlinkSharedMemory();
+   if (segment)
+      munmap(segment, segmentSize);
+}
+
+bool PlayerNSDStream::CreateSharedMemory(uint32_t ringSize, std::string& name)
+{
+   static boost::atomic<unsigned> count(0);
+   uint32_t size = 4096;
+   while (size < ringSize)
+      size <<= 1;
+   name = "/playernsd." + boost::lexical_cast<std::string>(getpid()) + "." +
+      boost::lexical_cast<std::string>(count++);
+   int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+   if (fd < 0)
+      return false;
+   std::size_t total = sizeof(SegmentHeader) + 2 * (sizeof(Ring) + size);
+   if (ftruncate(fd, total) < 0 || !mapSharedMemory(fd, total))
+   {
+      close(fd);
+      shm_unlink(name.c_str());
+      return false;
+   }
+   close(fd);
+   segmentName = name;
+   // A new segment is zero filled, so only the sizes need setting.
+   SegmentHeader *header = (SegmentHeader *) segment;
+   header->ringSize = size;
+   out = (Ring *)(header + 1);
+   in = (Ring *)(out->data() + size);
+   out->size = in->size = size;
+   store(&header->magic, PLAYERNSD_SHM_MAGIC);
+   return true;
+}
+
+bool PlayerNSDStream::AttachSharedMemory(const std::string& name)
+{
+   int fd = shm_open(name.c_str(), O_RDWR, 0);
+   if (fd < 0)
+      return false;
+   struct stat st;
+   bool mapped = fstat(fd, &st) == 0 && (std::size_t) st.st_size > sizeof(SegmentHeader) &&
+      mapSharedMemory(fd, st.st_size);
+   close(fd);
+   if (!mapped)
+      return false;
+   SegmentHeader *header = (SegmentHeader *) segment;
+   if (load(&header->magic) != PLAYERNSD_SHM_MAGIC ||
+      sizeof(SegmentHeader) + 2 * (sizeof(Ring) + (std::size_t) header->ringSize) > segmentSize)
+   {
+      munmap(segment, segmentSize);
+      segment = NULL;
+      return false;
+   }
+   // The creator's outgoing ring is our incoming one.
+   in = (Ring *)(header + 1);
+   out = (Ring *)(in->data() + header->ringSize);
+   return true;
+}
+
+bool PlayerNSDStream::mapSharedMemory(int fd, std::size_t size)
+{
+   void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (p == MAP_FAILED)
+      return false;
+   segment = p;
+   segmentSize = size;
+   return true;
+}
+
+void PlayerNSDStream::UnlinkSharedMemory()
+{
+   if (!segmentName.empty())
+      shm_unlink(segmentName.c_str());
+   segmentName.clear();
+}
+
+void PlayerNSDStream::Shutdown()
+{
+   closed = true;
+   if (segment)
+   {
+      // Let the peer drain what is left and then see the end of the stream.
+      store(&out->closed, 1);
+      __atomic_fetch_add(&out->dataSeq, 1, __ATOMIC_SEQ_CST);
+      futexWake(&out->dataSeq);
+      // Wake up our own reader and writer.
+      __atomic_fetch_add(&in->dataSeq, 1, __ATOMIC_SEQ_CST);
+      futexWake(&in->dataSeq);
+      __atomic_fetch_add(&out->spaceSeq, 1, __ATOMIC_SEQ_CST);
+      futexWake(&out->spaceSeq);
+   }
+   // Unlike closing it, this wakes a thread blocked on the socket.
+   boost::system::error_code error;
+   socket.shutdown(Socket::shutdown_both, error);
+}
+
+void PlayerNSDStream::Close()
+{
+   Shutdown();
+   boost::system::error_code error;
+   socket.close(error);
+}
+
+bool PlayerNSDStream::peerAlive()
+{
+   if (closed)
+      return false;
+   struct pollfd pfd;
+   pfd.fd = socket.native_handle();
+#if defined (POLLRDHUP)
+   pfd.events = POLLRDHUP;
+#else
+   pfd.events = 0;
+#endif
+   pfd.revents = 0;
+   if (poll(&pfd, 1, 0) < 0)
+      return true;
+   return !(pfd.revents & (POLLHUP | POLLERR | POLLNVAL
+#if defined (POLLRDHUP)
+      | POLLRDHUP
+#endif
+      ));
+}
+
+std::size_t PlayerNSDStream::ringRead(Ring *ring, void *data, std::size_t len,
+   boost::system::error_code& error)
+{
+   error = boost::system::error_code();
+   if (!len)
+      return 0;
+   uint32_t mask = ring->size - 1;
+   uint32_t tail = ring->tail;
+   for (;;)
+   {
+      uint32_t head = load(&ring->head);
+      if (head != tail)
+      {
+         std::size_t n = std::min<std::size_t>(len, head - tail);
+         std::size_t first = std::min<std::size_t>(n, ring->size - (tail & mask));
+         memcpy(data, ring->data() + (tail & mask), first);
+         memcpy((char *) data + first, ring->data(), n - first);
+         store(&ring->tail, tail + n);
+         __atomic_fetch_add(&ring->spaceSeq, 1, __ATOMIC_SEQ_CST);
+         if (load(&ring->writerWaiting))
+            futexWake(&ring->spaceSeq);
+         return n;
+      }
+      if (closed || load(&ring->closed))
+      {
+         error = boost::asio::error::eof;
+         return 0;
+      }
+      // Sleep until the writer adds data, checking again after announcing
+      // that we are waiting so that its wakeup cannot be missed.
+      uint32_t seq = load(&ring->dataSeq);
+      __atomic_store_n(&ring->readerWaiting, 1, __ATOMIC_SEQ_CST);
+      bool woken = load(&ring->head) != tail || futexWait(&ring->dataSeq, seq);
+      store(&ring->readerWaiting, 0);
+      if (!woken && !peerAlive())
+      {
+         error = boost::asio::error::eof;
+         return 0;
+      }
+   }
+}
+
+std::size_t PlayerNSDStream::ringWrite(Ring *ring, const void *data, std::size_t len,
+   bool block, boost::system::error_code& error)
+{
+   error = boost::system::error_code();
+   if (!len)
+      return 0;
+   uint32_t mask = ring->size - 1;
+   uint32_t head = ring->head;
+   for (;;)
+   {
+      if (closed || load(&ring->closed))
+      {
+         error = boost::asio::error::broken_pipe;
+         return 0;
+      }
+      uint32_t space = ring->size - (head - load(&ring->tail));
+      if (space)
+      {
+         std::size_t n = std::min<std::size_t>(len, space);
+         std::size_t first = std::min<std::size_t>(n, ring->size - (head & mask));
+         memcpy(ring->data() + (head & mask), data, first);
+         memcpy(ring->data(), (const char *) data + first, n - first);
+         store(&ring->head, head + n);
+         return n;
+      }
+      if (!block)
+         return 0;
+      // The reader may be waiting for the data already written.
+      ringNotify(ring);
+      uint32_t seq = load(&ring->spaceSeq);
+      __atomic_store_n(&ring->writerWaiting, 1, __ATOMIC_SEQ_CST);
+      bool woken = ring->size != head - load(&ring->tail) || futexWait(&ring->spaceSeq, seq);
+      store(&ring->writerWaiting, 0);
+      if (!woken && !peerAlive())
+      {
+         error = boost::asio::error::broken_pipe;
+         return 0;
+      }
+   }
+}
+
+void PlayerNSDStream::ringNotify(Ring *ring)
+{
+   __atomic_fetch_add(&ring->dataSeq, 1, __ATOMIC_SEQ_CST);
+   if (load(&ring->readerWaiting))
+      futexWake(&ring->dataSeq);
+}
@@ -0,0 +1,186 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd stream.
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * The byte stream a playernsd connection is carried over.  It starts out as
+ * a TCP or unix domain socket, and when both ends are on the same host it
+ * can be switched to a pair of single producer, single consumer ring buffers
+ * in shared memory (one per direction), so that frames are copied straight
+ * into the peer's address space without a system call per write.  A blocked
+ * reader or writer sleeps on a futex in the segment and is only woken when
+ * it is actually waiting.
+ *
+ * The switch is negotiated with the "shm" feature: after registration the
+ * client creates the segment and sends "shmattach <name> <size>", and the
+ * daemon attaches and replies "shmready" (or "shmrefused") on the socket.
+ * Everything after those two frames goes through the rings; the socket is
+ * kept open so that either end notices when the other goes away.
+ *
+ * The stream models ASIO's SyncReadStream and SyncWriteStream, so it is
+ * used with boost::asio::read, read_until and write like a socket.
+ */
+
+#ifndef _PLAYERNSD_STREAM_H_
+#define _PLAYERNSD_STREAM_H_
+
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/utility.hpp>
+#include <boost/cstdint.hpp>
+
+/** Feature token for the shared memory transport. */
+#define PLAYERNSD_FEATURE_SHM "shm"
+
+class PlayerNSDStream : boost::noncopyable
+{
+   public:
+      /** A TCP or unix domain stream socket. */
+      typedef boost::asio::generic::stream_protocol::socket Socket;
+
+      PlayerNSDStream(boost::asio::io_service& ioService);
+      ~PlayerNSDStream();
+
+      /** Returns the socket the stream starts out on. */
+      Socket& GetSocket() { return socket; }
+
+      template <typename MutableBufferSequence>
+      std::size_t read_some(const MutableBufferSequence& buffers, boost::system::error_code& error)
+      {
+         if (!shmReads)
+            return socket.read_some(buffers, error);
+         boost::asio::mutable_buffer buffer = *boost::asio::buffer_sequence_begin(buffers);
+         return ringRead(in, buffer.data(), buffer.size(), error);
+      }
+
+      template <typename MutableBufferSequence>
+      std::size_t read_some(const MutableBufferSequence& buffers)
+      {
+         boost::system::error_code error;
+         std::size_t n = read_some(buffers, error);
+         boost::asio::detail::throw_error(error, "read_some");
+         return n;
+      }
+
+      template <typename ConstBufferSequence>
+      std::size_t write_some(const ConstBufferSequence& buffers, boost::system::error_code& error)
+      {
+         if (!shmWrites)
+            return socket.write_some(buffers, error);
+         return writeBuffers(boost::asio::buffer_sequence_begin(buffers),
+            boost::asio::buffer_sequence_end(buffers), error);
+      }
+
+      template <typename ConstBufferSequence>
+      std::size_t write_some(const ConstBufferSequence& buffers)
+      {
+         boost::system::error_code error;
+         std::size_t n = write_some(buffers, error);
+         boost::asio::detail::throw_error(error, "write_some");
+         return n;
+      }
+
+      /**
+       * Creates a shared memory segment for the rings (the client side).
+       * \param ringSize The size of each ring in bytes, rounded up to a
+       * power of two.
+       * \param name The name of the segment, to send to the daemon.
+       * \return true if the segment was created.
+       */
+      bool CreateSharedMemory(uint32_t ringSize, std::string& name);
+
+      /**
+       * Attaches to a shared memory segment created by the peer (the daemon
+       * side).
+       * \param name The name of the segment.
+       * \return true if the segment was attached.
+       */
+      bool AttachSharedMemory(const std::string& name);
+
+      /**
+       * Removes the name of a created segment once the peer has attached
+       * (or refused it), so that it goes away with the last mapping.
+       */
+      void UnlinkSharedMemory();
+
+      /** Reads from the shared memory ring from now on. */
+      void UseSharedMemoryForReads() { shmReads = true; }
+
+      /** Writes to the shared memory ring from now on. */
+      void UseSharedMemoryForWrites() { shmWrites = true; }
+
+      /** Returns whether the stream writes to shared memory. */
+      bool UsesSharedMemory() const { return shmWrites; }
+
+      /**
+       * Wakes up and fails any blocked read or write, keeping the socket
+       * open so that threads still using it can be joined safely.
+       */
+      void Shutdown();
+
+      /**
+       * Wakes up and fails any blocked read or write, and closes the socket.
+       */
+      void Close();
+
+   private:
+      struct Ring;
+
+      /** Gathers as much of the buffers as fits, then wakes the reader once. */
+      template <typename Iterator>
+      std::size_t writeBuffers(Iterator begin, Iterator end, boost::system::error_code& error)
+      {
+         std::size_t total = 0;
+         for (; begin != end; ++begin)
+         {
+            boost::asio::const_buffer buffer(*begin);
+            std::size_t n = ringWrite(out, buffer.data(), buffer.size(), total == 0, error);
+            total += n;
+            if (error || n < buffer.size())
+               break;
+         }
+         if (total)
+            ringNotify(out);
+         return total;
+      }
+
+      std::size_t ringRead(Ring *ring, void *data, std::size_t len, boost::system::error_code& error);
+      std::size_t ringWrite(Ring *ring, const void *data, std::size_t len, bool block,
+         boost::system::error_code& error);
+      void ringNotify(Ring *ring);
+      bool peerAlive();
+      bool mapSharedMemory(int fd, std::size_t size);
+
+      Socket socket;
+      void *segment;
+      std::size_t segmentSize;
+      std::string segmentName;
+      Ring *in;
+      Ring *out;
+      bool shmReads;
+      bool shmWrites;
+      boost::atomic<bool> closed;
+};
+
+#endif
@@ -0,0 +1,666 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd load generator
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * Runs a swarm of PlayerNSDClient instances in one process against a
+ * daemon (playernsd, or playernsd_peer) to find where it stops keeping up.
+ *
+ *    ./playernsd_load --clients 100,1000,5000 --profile mixed localhost 9999
+ *
+ * The number of clients is ramped through the given steps, the clients of
+ * one step staying connected for the next.  At each step every client acts
+ * --rate times a second for --duration seconds, after --settle seconds to
+ * warm up, and one CSV row is written: the rates of messages sent and
+ * received, the percentiles of the message latency, and the CPU time and
+ * resident memory of the process per client.
+ *
+ * The profiles are:
+ *    broadcast   every client broadcasts each time
+ *    knearest    every client sends to its --k nearest clients, placed on a
+ *                square lattice
+ *    poll        every client looks up a property it has set
+ *    mixed       one in ten broadcasts, two in ten polls, the rest knearest
+ *
+ * Latency is measured within the process, from the client handing a
+ * message over to the receiving client's handler (or from a property
+ * lookup to its answer), so it includes both clients' queues and threads
+ * and the daemon.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "playernsd_client.h"
+#include "playernsd_grid.h"
+
+/** Latency histograms, shared out between the clients to keep contention down. */
+#define PLAYERNSD_LOAD_SHARDS 64
+/** Sub-buckets per power of two of the latency histograms. */
+#define PLAYERNSD_LOAD_SUB_BITS 4
+
+static uint64_t monotonicNanoseconds()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Returns the CPU time of the process in seconds. */
+static double processCPUTime()
+{
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+/** Returns the resident memory of the process in bytes. */
+static double residentBytes()
+{
+   long pages = 0, resident = 0;
+   FILE *statm = fopen("/proc/self/statm", "r");
+   if (statm)
+   {
+      if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+         resident = 0;
+      fclose(statm);
+   }
+   return (double) resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Throws away what is written to it.  It keeps no state, so the clients'
+ * threads may all write to it at once, and it never grows.
+ */
+class NullBuffer : public std::streambuf
+{
+   protected:
+      virtual int overflow(int c) { return traits_type::not_eof(c); }
+      virtual std::streamsize xsputn(const char *s, std::streamsize n) { return n; }
+};
+
+/**
+ * A log-linear histogram of latencies in nanoseconds, exact to within one
+ * part in 2^PLAYERNSD_LOAD_SUB_BITS.
+ */
+class Histogram
+{
+   public:
+      Histogram() { Clear(); }
+
+      void Clear()
+      {
+         memset(counts, 0, sizeof(counts));
+         total = 0;
+         max = 0;
+      }
+
+      void Add(uint64_t value)
+      {
+         counts[bucketOf(value)]++;
+         total++;
+         max = std::max(max, value);
+      }
+
+      void Merge(const Histogram& other)
+      {
+         for (std::size_t i = 0; i < Buckets; i++)
+            counts[i] += other.counts[i];
+         total += other.total;
+         max = std::max(max, other.max);
+      }
+
+      /** \param fraction e.g. 0.99 for the 99th percentile. */
+      uint64_t Percentile(double fraction) const
+      {
+         if (!total)
+            return 0;
+         uint64_t rank = (uint64_t) std::ceil(fraction * total);
+         uint64_t seen = 0;
+         for (std::size_t i = 0; i < Buckets; i++)
+         {
+            seen += counts[i];
+            if (seen >= std::max<uint64_t>(rank, 1))
+               return std::min(valueOf(i), max);
+         }
+         return max;
+      }
+
+      uint64_t Total() const { return total; }
+      uint64_t Max() const { return max; }
+
+   private:
+      static const std::size_t Sub = 1 << PLAYERNSD_LOAD_SUB_BITS;
+      static const std::size_t Buckets = 64 * Sub;
+
+      static std::size_t bucketOf(uint64_t value)
+      {
+         if (value < Sub)
+            return value;
+         int msb = 63 - __builtin_clzll(value);
+         int shift = msb - PLAYERNSD_LOAD_SUB_BITS;
+         return (msb - PLAYERNSD_LOAD_SUB_BITS + 1) * Sub + ((value >> shift) - Sub);
+      }
+
+      /** The upper end of a bucket. */
+      static uint64_t valueOf(std::size_t bucket)
+      {
+         if (bucket < Sub)
+            return bucket;
+         int shift = bucket / Sub - 1;
+         return ((uint64_t)(Sub + bucket % Sub + 1) << shift) - 1;
+      }
+
+      uint64_t counts[Buckets];
+      uint64_t total;
+      uint64_t max;
+};
+
+/** What the clients of a shard have received. */
+struct Shard
+{
+   Shard() : received(0), bytes(0), errors(0) {}
+   boost::mutex mutex;
+   Histogram latency;
+   uint64_t received;
+   uint64_t bytes;
+   uint64_t errors;
+};
+
+static Shard shards[PLAYERNSD_LOAD_SHARDS];
+
+enum Profile
+{
+   ProfileBroadcast,
+   ProfileKNearest,
+   ProfilePoll,
+   ProfileMixed,
+};
+
+/** One simulated robot: a client and what it does each time it acts. */
+class LoadClient : public PlayerNSDClient::Handler
+{
+   public:
+      LoadClient(const std::string& id, std::size_t index) :
+         client(*this), id(id), index(index), registered(false), actions(0)
+      {
+         client.SetCloseTimeout(0.1);
+      }
+
+      /** Stops the client's threads, which call back into the members. */
+      ~LoadClient()
+      {
+         client.Close();
+      }
+
+      void Connect(const std::string& host, const std::string& port)
+      {
+         client.ConnectAsync(host, port);
+      }
+
+      bool Registered() const { return registered; }
+
+      /** Sets the property polled, so that the lookups find it. */
+      void Prepare()
+      {
+         client.PropertySet(pollKey(), id);
+      }
+
+      /**
+       * Acts once.
+       * \return The number of messages or requests sent.
+       */
+      uint64_t Act(Profile profile, const std::string& payload)
+      {
+         if (profile == ProfileMixed)
+         {
+            uint64_t n = actions++ % 10;
+            profile = n == 0 ? ProfileBroadcast : n < 3 ? ProfilePoll : ProfileKNearest;
+         }
+         // Every message carries the time it was sent.
+         std::string message(payload);
+         uint64_t now = monotonicNanoseconds();
+         memcpy(&message[0], &now, sizeof(now));
+         switch (profile)
+         {
+            case ProfileBroadcast:
+               client.Send(message.size(), message.data());
+               return 1;
+            case ProfileKNearest:
+               for (std::size_t i = 0; i < neighbours.size(); i++)
+                  client.Send(neighbours[i], message.size(), message.data());
+               return neighbours.size();
+            default:
+            {
+               boost::lock_guard<boost::mutex> lock(pollMutex);
+               polls.push_back(now);
+               client.PropertyGet(pollKey());
+               return 1;
+            }
+         }
+      }
+
+      std::vector<std::string> neighbours;
+
+      virtual void ErrorRaised(PlayerNSDClient::ServerError err, const std::string& message)
+      {
+         if (err == PlayerNSDClient::ServerErrorPropertyNotExist)
+         {
+            boost::lock_guard<boost::mutex> lock(pollMutex);
+            if (!polls.empty())
+               polls.pop_front();
+         }
+         Shard& shard = shards[index % PLAYERNSD_LOAD_SHARDS];
+         boost::lock_guard<boost::mutex> lock(shard.mutex);
+         shard.errors++;
+      }
+      virtual void Receive(const std::string& source, const std::string& data)
+      {
+         Receive(source, data.size(), data.data());
+      }
+      virtual void Receive(const std::string& source, int len, const char *data)
+      {
+         uint64_t sent = 0;
+         if (len >= (int) sizeof(sent))
+            memcpy(&sent, data, sizeof(sent));
+         received(sent, len);
+      }
+      virtual void ReceiveChunk(const std::string& source, uint32_t total, uint32_t offset,
+         int len, const char *data)
+      {
+      }
+      virtual void ReceiveTopic(const std::string& source, const std::string& topic,
+         int len, const char *data)
+      {
+      }
+      virtual void ClientListResponse(const std::vector<std::string>& clientList)
+      {
+      }
+      virtual void PropertyValue(const std::string& variable, const std::string& value)
+      {
+         uint64_t sent = 0;
+         {
+            boost::lock_guard<boost::mutex> lock(pollMutex);
+            if (polls.empty())
+               return;
+            sent = polls.front();
+            polls.pop_front();
+         }
+         received(sent, value.size());
+      }
+      virtual void PropertyChanged(const std::string& variable, const std::string& value)
+      {
+      }
+      virtual void TickReached(uint32_t tick)
+      {
+      }
+      virtual void StateChanged(PlayerNSDClient::ConnectionState state)
+      {
+         if (state == PlayerNSDClient::StateGreeting)
+            client.Register(id);
+         else if (state == PlayerNSDClient::StateRegistered)
+            registered = true;
+      }
+
+   private:
+      std::string pollKey() const { return "load." + id; }
+
+      void received(uint64_t sent, std::size_t len)
+      {
+         uint64_t now = monotonicNanoseconds();
+         Shard& shard = shards[index % PLAYERNSD_LOAD_SHARDS];
+         boost::lock_guard<boost::mutex> lock(shard.mutex);
+         if (sent && sent <= now)
+            shard.latency.Add(now - sent);
+         shard.received++;
+         shard.bytes += len;
+      }
+
+      PlayerNSDClient client;
+      std::string id;
+      std::size_t index;
+      boost::atomic<bool> registered;
+      uint64_t actions;
+      /** Times the property lookups awaiting an answer were sent, in order. */
+      std::deque<uint64_t> polls;
+      boost::mutex pollMutex;
+};
+
+typedef boost::shared_ptr<LoadClient> LoadClientPtr;
+
+/** Settings of a run. */
+struct Options
+{
+   Options() : profile(ProfileMixed), profileName("mixed"), rate(10.0), duration(10.0),
+      settle(2.0), connectTimeout(60.0), size(64), k(5), threads(0) {}
+   std::vector<std::size_t> steps;
+   Profile profile;
+   std::string profileName;
+   double rate;
+   double duration;
+   double settle;
+   double connectTimeout;
+   std::size_t size;
+   std::size_t k;
+   std::size_t threads;
+   std::string host, port;
+};
+
+/**
+ * Makes every client act at the rate, each sender looking after every
+ * threads-th client, until told to stop.
+ */
+static void processSender(const std::vector<LoadClientPtr>* clients, const Options* options,
+   std::size_t first, std::size_t threads, boost::atomic<bool>* running,
+   boost::atomic<uint64_t>* sent)
+{
+   std::string payload(std::max<std::size_t>(options->size, sizeof(uint64_t)), '\0');
+   uint64_t period = (uint64_t)(1e9 / options->rate);
+   uint64_t due = monotonicNanoseconds();
+   while (*running)
+   {
+      uint64_t n = 0;
+      for (std::size_t i = first; i < clients->size(); i += threads)
+         n += (*clients)[i]->Act(options->profile, payload);
+      *sent += n;
+      // Falls behind rather than bursting when the clients cannot keep up.
+      due = std::max(due + period, monotonicNanoseconds());
+      uint64_t now = monotonicNanoseconds();
+      if (due > now)
+         boost::this_thread::sleep(boost::posix_time::microseconds((due - now) / 1000));
+   }
+}
+
+/**
+ * Gives every client its k nearest clients on a square lattice.
+ * \param side The number of clients on a side of the lattice.
+ */
+static void placeNeighbours(std::vector<LoadClientPtr>& clients, const std::vector<std::string>& ids,
+   std::size_t side, std::size_t k)
+{
+   PlayerNSDGrid grid(4.0);
+   for (std::size_t i = 0; i < clients.size(); i++)
+      grid.Update(ids[i], (double)(i % side), (double)(i / side));
+   k = std::min(k, clients.size() - 1);
+   for (std::size_t i = 0; i < clients.size(); i++)
+   {
+      double x = (double)(i % side), y = (double)(i / side);
+      std::vector<std::string> found;
+      for (double radius = std::sqrt((double) k) + 1.0; found.size() < k + 1; radius *= 2.0)
+      {
+         found.clear();
+         grid.Query(x, y, radius, found);
+      }
+      std::vector<std::pair<double, std::string> > byDistance;
+      for (std::size_t j = 0; j < found.size(); j++)
+      {
+         double fx, fy;
+         grid.Find(found[j], fx, fy);
+         if (found[j] != ids[i])
+            byDistance.push_back(std::make_pair((fx - x) * (fx - x) + (fy - y) * (fy - y), found[j]));
+      }
+      std::sort(byDistance.begin(), byDistance.end());
+      clients[i]->neighbours.clear();
+      for (std::size_t j = 0; j < k && j < byDistance.size(); j++)
+         clients[i]->neighbours.push_back(byDistance[j].second);
+   }
+}
+
+/** Takes what the shards have received so far, and clears them. */
+static void collect(Histogram& latency, uint64_t& received, uint64_t& bytes, uint64_t& errors)
+{
+   latency.Clear();
+   received = bytes = errors = 0;
+   for (std::size_t i = 0; i < PLAYERNSD_LOAD_SHARDS; i++)
+   {
+      boost::lock_guard<boost::mutex> lock(shards[i].mutex);
+      latency.Merge(shards[i].latency);
+      received += shards[i].received;
+      bytes += shards[i].bytes;
+      errors += shards[i].errors;
+      shards[i].latency.Clear();
+      shards[i].received = shards[i].bytes = shards[i].errors = 0;
+   }
+}
+
+static bool parseProfile(const std::string& name, Profile& profile)
+{
+   if (name == "broadcast")
+      profile = ProfileBroadcast;
+   else if (name == "knearest")
+      profile = ProfileKNearest;
+   else if (name == "poll")
+      profile = ProfilePoll;
+   else if (name == "mixed")
+      profile = ProfileMixed;
+   else
+      return false;
+   return true;
+}
+
+static void usage(const char *name)
+{
+   std::cerr << "Usage: " << name << " [options] <host | unix:path> [port]\n"
+      << "  --clients <n,n,...>       the numbers of clients to ramp through (100)\n"
+      << "  --profile <name>          broadcast, knearest, poll or mixed (mixed)\n"
+      << "  --rate <per second>       actions per client per second (10)\n"
+      << "  --size <bytes>            message size, at least 8 (64)\n"
+      << "  --k <n>                   neighbours of each client for knearest (5)\n"
+      << "  --duration <seconds>      measured time per step (10)\n"
+      << "  --settle <seconds>        warm up time per step (2)\n"
+      << "  --connect-timeout <s>     time allowed to register the clients of a step (60)\n"
+      << "  --threads <n>             sending threads (one per core)\n"
+      << "  --out <file.csv>          where to write the results (standard output)\n"
+      << "  --verbose                 keep the clients' progress messages"
+      << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+   Options options;
+   std::string out;
+   bool verbose = false;
+   std::vector<std::string> positional;
+   for (int i = 1; i < argc; i++)
+   {
+      std::string arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (arg == "--clients" && hasValue)
+      {
+         std::stringstream list(argv[++i]);
+         std::string step;
+         while (std::getline(list, step, ','))
+            if (atoi(step.c_str()) > 0)
+               options.steps.push_back(atoi(step.c_str()));
+      }
+      else if (arg == "--profile" && hasValue)
+      {
+         options.profileName = argv[++i];
+         if (!parseProfile(options.profileName, options.profile))
+         {
+            usage(argv[0]);
+            return 1;
+         }
+      }
+      else if (arg == "--rate" && hasValue)
+         options.rate = std::max(0.001, atof(argv[++i]));
+      else if (arg == "--size" && hasValue)
+         options.size = atoi(argv[++i]);
+      else if (arg == "--k" && hasValue)
+         options.k = std::max(1, atoi(argv[++i]));
+      else if (arg == "--duration" && hasValue)
+         options.duration = atof(argv[++i]);
+      else if (arg == "--settle" && hasValue)
+         options.settle = atof(argv[++i]);
+      else if (arg == "--connect-timeout" && hasValue)
+         options.connectTimeout = atof(argv[++i]);
+      else if (arg == "--threads" && hasValue)
+         options.threads = std::max(1, atoi(argv[++i]));
+      else if (arg == "--out" && hasValue)
+         out = argv[++i];
+      else if (arg == "--verbose")
+         verbose = true;
+      else if (!arg.compare(0, 2, "--"))
+      {
+         usage(argv[0]);
+         return 1;
+      }
+      else
+         positional.push_back(arg);
+   }
+   if (positional.empty() || positional.size() > 2)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+   options.host = positional[0];
+   options.port = positional.size() > 1 ? positional[1] : "9999";
+   if (options.steps.empty())
+      options.steps.push_back(100);
+   std::sort(options.steps.begin(), options.steps.end());
+   if (!options.threads)
+      options.threads = std::max(1u, boost::thread::hardware_concurrency());
+
+   FILE *csv = out.empty() ? stdout : fopen(out.c_str(), "w");
+   if (!csv)
+   {
+      std::cerr << "Unable to create " << out << std::endl;
+      return 1;
+   }
+   // The clients report every thread they start on standard output.
+   NullBuffer discard;
+   std::streambuf *console = std::cout.rdbuf();
+   if (!verbose)
+      std::cout.rdbuf(&discard);
+
+   fprintf(csv, "clients,registered,profile,rate,size,duration_s,sent_per_s,received_per_s,"
+      "received_mb_per_s,latency_p50_us,latency_p90_us,latency_p99_us,latency_p999_us,"
+      "latency_max_us,errors,cpu_ms_per_client_s,rss_kb_per_client\n");
+   fflush(csv);
+
+   std::size_t side = (std::size_t) std::ceil(std::sqrt((double) options.steps.back()));
+   std::string prefix = "load" + boost::lexical_cast<std::string>(getpid()) + ".";
+   double baseResident = residentBytes();
+   std::vector<LoadClientPtr> clients;
+   std::vector<std::string> ids;
+
+   for (std::size_t step = 0; step < options.steps.size(); step++)
+   {
+      std::size_t target = options.steps[step];
+      while (clients.size() < target)
+      {
+         ids.push_back(prefix + boost::lexical_cast<std::string>(clients.size()));
+         clients.push_back(LoadClientPtr(new LoadClient(ids.back(), clients.size())));
+         clients.back()->Connect(options.host, options.port);
+      }
+
+      // Wait for the clients to register, going on with those that do.
+      std::size_t registered = 0;
+      uint64_t deadline = monotonicNanoseconds() + (uint64_t)(options.connectTimeout * 1e9);
+      for (;;)
+      {
+         registered = 0;
+         for (std::size_t i = 0; i < clients.size(); i++)
+            registered += clients[i]->Registered();
+         if (registered == clients.size() || monotonicNanoseconds() > deadline)
+            break;
+         boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+      }
+      std::cerr << registered << " of " << clients.size() << " clients registered" << std::endl;
+
+      placeNeighbours(clients, ids, side, options.k);
+      for (std::size_t i = 0; i < clients.size(); i++)
+         clients[i]->Prepare();
+
+      boost::atomic<bool> running(true);
+      boost::atomic<uint64_t> sent(0);
+      boost::thread_group senders;
+      for (std::size_t t = 0; t < options.threads; t++)
+         senders.create_thread(boost::bind(processSender, &clients, &options, t, options.threads,
+            &running, &sent));
+
+      boost::this_thread::sleep(boost::posix_time::microseconds((int64_t)(options.settle * 1e6)));
+      Histogram latency;
+      uint64_t received, bytes, errors;
+      collect(latency, received, bytes, errors);
+      uint64_t sentBefore = sent;
+      double cpuBefore = processCPUTime();
+      uint64_t start = monotonicNanoseconds();
+
+      boost::this_thread::sleep(boost::posix_time::microseconds((int64_t)(options.duration * 1e6)));
+      collect(latency, received, bytes, errors);
+      double elapsed = (monotonicNanoseconds() - start) * 1e-9;
+      double cpu = processCPUTime() - cpuBefore;
+      uint64_t sentDuring = sent - sentBefore;
+      double resident = residentBytes();
+
+      running = false;
+      senders.join_all();
+
+      fprintf(csv, "%u,%u,%s,%g,%u,%.3f,%.1f,%.1f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu,%.3f,%.1f\n",
+         (unsigned) clients.size(), (unsigned) registered, options.profileName.c_str(),
+         options.rate, (unsigned) options.size, elapsed, sentDuring / elapsed, received / elapsed,
+         bytes / elapsed / 1e6, latency.Percentile(0.5) / 1e3, latency.Percentile(0.9) / 1e3,
+         latency.Percentile(0.99) / 1e3, latency.Percentile(0.999) / 1e3, latency.Max() / 1e3,
+         (unsigned long long) errors, cpu * 1e3 / elapsed / clients.size(),
+         (resident - baseResident) / 1024 / clients.size());
+      fflush(csv);
+
+      // Let what is still on the way arrive before the next step.
+      boost::this_thread::sleep(boost::posix_time::microseconds((int64_t)(options.settle * 1e6)));
+   }
+
+   // Disconnect the clients side by side, a slice to each thread.
+   {
+      boost::thread_group closers;
+      std::vector<std::vector<LoadClientPtr> > slices(options.threads);
+      for (std::size_t i = 0; i < clients.size(); i++)
+         slices[i % options.threads].push_back(clients[i]);
+      clients.clear();
+      for (std::size_t t = 0; t < slices.size(); t++)
+         closers.create_thread(boost::bind(&std::vector<LoadClientPtr>::clear, &slices[t]));
+      closers.join_all();
+   }
+   std::cout.rdbuf(console);
+   if (csv != stdout)
+      fclose(csv);
+   return 0;
+}
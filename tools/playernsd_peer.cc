@@ -0,0 +1,478 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd stand-in peer
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * A small local stand-in for playernsd, so that the driver and the client
+ * can be run without the simulator.  Messages are passed straight between
+ * the connected clients (there is no network model), properties are kept in
+ * a table (with their changes pushed to the clients watching them), range
+ * broadcasts go to the clients within range by their "self.position", the
+ * ends of simulation ticks are a barrier across the clients marking them,
+ * and every protocol feature the client knows about is offered, including
+ * the shared memory transport.
+ *
+ *    ./playernsd_peer 9999
+ *    ./playernsd_peer unix:/tmp/playernsd.sock
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/tokenizer.hpp>
+
+#include "playernsd_client.h"
+#include "playernsd_grid.h"
+#include "playernsd_stream.h"
+
+class Peer
+{
+   public:
+      Peer(const std::string& address) : acceptor(ioService), releasedAny(false), released(0)
+      {
+         if (!address.compare(0, strlen(PLAYERNSD_UNIX_PREFIX), PLAYERNSD_UNIX_PREFIX))
+         {
+            std::string path = address.substr(strlen(PLAYERNSD_UNIX_PREFIX));
+            unlink(path.c_str());
+            listen(boost::asio::local::stream_protocol::endpoint(path));
+         }
+         else
+         {
+            listen(tcp::endpoint(tcp::v4(), boost::lexical_cast<unsigned short>(address)));
+         }
+      }
+
+      void Run()
+      {
+         for (;;)
+         {
+            boost::shared_ptr<Connection> connection(new Connection(ioService));
+            acceptor.accept(connection->stream.GetSocket());
+            boost::thread(&Peer::serve, this, connection).detach();
+         }
+      }
+
+   private:
+      /** A connected client. */
+      struct Connection
+      {
+         Connection(boost::asio::io_service& ioService) : stream(ioService), subscribed(false), tick(0) {}
+         PlayerNSDStream stream;
+         /** Serialises writes from the threads of other connections. */
+         boost::mutex writeMutex;
+         std::string id;
+         std::set<std::string> topics;
+         bool subscribed;
+         /** Watched property keys and prefixes. */
+         std::set<std::string> watched;
+         /** The last tick the client finished, if marking ticks. */
+         uint32_t tick;
+      };
+      typedef boost::shared_ptr<Connection> ConnectionPtr;
+
+      template <typename Endpoint>
+      void listen(const Endpoint& endpoint)
+      {
+         boost::asio::generic::stream_protocol::endpoint generic(endpoint);
+         acceptor.open(generic.protocol());
+         acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+         acceptor.bind(generic);
+         acceptor.listen();
+      }
+
+      /**
+       * Writes a frame and an optional payload to a connection.
+       */
+      static bool watches(const std::set<std::string>& watched, const std::string& key)
+      {
+         BOOST_FOREACH(const std::string& watch, watched)
+            if (watch == key || (boost::algorithm::ends_with(watch, PLAYERNSD_WATCH_PREFIX) &&
+               !key.compare(0, watch.size() - 1, watch, 0, watch.size() - 1)))
+               return true;
+         return false;
+      }
+
+      void send(const ConnectionPtr& connection, const std::string& frame,
+         const char *data = NULL, std::size_t len = 0)
+      {
+         std::vector<boost::asio::const_buffer> buffers;
+         buffers.push_back(boost::asio::buffer(frame));
+         if (len)
+            buffers.push_back(boost::asio::buffer(data, len));
+         boost::system::error_code error;
+         boost::lock_guard<boost::mutex> lock(connection->writeMutex);
+         boost::asio::write(connection->stream, buffers, error);
+      }
+
+      /**
+       * Gets the registered connections a message from a client goes to.
+       * \param source The sending connection.
+       * \param targets The target ids, empty for everyone but the sender.
+       * \param recipients The connections.
+       */
+      void findRecipients(const ConnectionPtr& source, const std::vector<std::string>& targets,
+         std::vector<ConnectionPtr>& recipients)
+      {
+         boost::lock_guard<boost::mutex> lock(mutex);
+         if (targets.empty())
+         {
+            for (std::map<std::string, ConnectionPtr>::iterator it = clients.begin(); it != clients.end(); ++it)
+               if (it->second != source)
+                  recipients.push_back(it->second);
+         }
+         BOOST_FOREACH(const std::string& target, targets)
+         {
+            std::map<std::string, ConnectionPtr>::iterator it = clients.find(target);
+            if (it != clients.end())
+               recipients.push_back(it->second);
+         }
+      }
+
+      /**
+       * Ends the ticks every client marking ticks has finished, telling
+       * each of them.  Their messages for the ticks have all been passed
+       * on by then.  Must be called with tickMutex held.
+       * \return false if there was no tick to end.
+       */
+      bool releaseTicks()
+      {
+         if (ticking.empty())
+            return false;
+         uint32_t low = (*ticking.begin())->tick;
+         BOOST_FOREACH(const ConnectionPtr& connection, ticking)
+            low = std::min(low, connection->tick);
+         if (releasedAny && low <= released)
+            return false;
+         released = low;
+         releasedAny = true;
+         std::string frame = "tick " + boost::lexical_cast<std::string>(low) + "\n";
+         BOOST_FOREACH(const ConnectionPtr& connection, ticking)
+            send(connection, frame);
+         tickReleased.notify_all();
+         return true;
+      }
+
+      /**
+       * Reads the binary payload following a command.
+       */
+      bool readPayload(const ConnectionPtr& connection, boost::asio::streambuf& buffer,
+         std::size_t length, std::vector<char>& payload)
+      {
+         boost::system::error_code error;
+         if (buffer.size() < length)
+            boost::asio::read(connection->stream, buffer,
+               boost::asio::transfer_at_least(length - buffer.size()), error);
+         if (error)
+            return false;
+         payload.resize(length + 1);
+         std::istream(&buffer).read(&payload[0], length);
+         return true;
+      }
+
+      void serve(ConnectionPtr connection)
+      {
+         boost::asio::streambuf buffer;
+         std::vector<char> payload;
+         send(connection, "greetings playernsd_peer playernsd " PLAYERNSD_PROTOCOL_VERSION " "
+            PLAYERNSD_FEATURE_LZ4 " " PLAYERNSD_FEATURE_TOPICS " " PLAYERNSD_FEATURE_MULTICAST " "
+            PLAYERNSD_FEATURE_SHM " " PLAYERNSD_FEATURE_PROPWATCH " " PLAYERNSD_FEATURE_RANGE " "
+            PLAYERNSD_FEATURE_TICK "\n");
+         for (;;)
+         {
+            boost::system::error_code error;
+            boost::asio::read_until(connection->stream, buffer, '\n', error);
+            if (error)
+               break;
+            std::string line;
+            std::getline(std::istream(&buffer), line);
+            std::vector<std::string> tokens;
+            PlayerNSDClient::Tokenise(line, tokens);
+            if (tokens.empty() || tokens[0] == "pong")
+               continue;
+            if (tokens[0] == "bye")
+               break;
+
+            if (connection->id.empty())
+            {
+               if (tokens[0] != "greetings" || tokens.size() < 2)
+               {
+                  send(connection, "error unknowncommand\n");
+                  continue;
+               }
+               boost::lock_guard<boost::mutex> lock(mutex);
+               if (clients.count(tokens[1]))
+               {
+                  send(connection, "error clientidinuse\n");
+                  continue;
+               }
+               connection->id = tokens[1];
+               clients[tokens[1]] = connection;
+               send(connection, "registered\n");
+               std::cout << connection->id << " registered" << std::endl;
+            }
+            else if (tokens[0] == "msgtext" && tokens.size() <= 2)
+            {
+               std::string message;
+               boost::asio::read_until(connection->stream, buffer, '\n', error);
+               if (error)
+                  break;
+               std::getline(std::istream(&buffer), message);
+               std::vector<ConnectionPtr> recipients;
+               findRecipients(connection, std::vector<std::string>(tokens.begin() + 1, tokens.end()), recipients);
+               BOOST_FOREACH(const ConnectionPtr& recipient, recipients)
+                  send(recipient, "msgtext " + connection->id + "\n" + message + "\n");
+            }
+            else if ((tokens[0] == "msgbin" && (tokens.size() == 2 || tokens.size() == 3)) ||
+               (tokens[0] == "msgbinz" && (tokens.size() == 3 || tokens.size() == 4)) ||
+               (tokens[0] == "msgmulti" && tokens.size() == 3))
+            {
+               // msgbin [target] len, msgbinz [target] len rawlen, msgmulti targets len
+               bool compressed = tokens[0] == "msgbinz";
+               std::size_t lengthToken = tokens.size() - (compressed ? 2 : 1);
+               std::size_t length = boost::lexical_cast<std::size_t>(tokens[lengthToken]);
+               if (!readPayload(connection, buffer, length, payload))
+                  break;
+               std::vector<std::string> targets;
+               if (tokens[0] == "msgmulti")
+               {
+                  boost::char_separator<char> sep(",");
+                  boost::tokenizer<boost::char_separator<char> > toker(tokens[1], sep);
+                  targets.assign(toker.begin(), toker.end());
+               }
+               else if (lengthToken == 2)
+                  targets.push_back(tokens[1]);
+               std::string frame = (compressed ? "msgbinz " : "msgbin ") + connection->id + " " +
+                  tokens[lengthToken] + (compressed ? " " + tokens[3] : std::string()) + "\n";
+               std::vector<ConnectionPtr> recipients;
+               findRecipients(connection, targets, recipients);
+               BOOST_FOREACH(const ConnectionPtr& recipient, recipients)
+                  send(recipient, frame, &payload[0], length);
+            }
+            else if (tokens[0] == "msgtopic" && tokens.size() == 3)
+            {
+               std::size_t length = boost::lexical_cast<std::size_t>(tokens[2]);
+               if (!readPayload(connection, buffer, length, payload))
+                  break;
+               std::string frame = "msgtopic " + connection->id + " " + tokens[1] + " " + tokens[2] + "\n";
+               std::vector<ConnectionPtr> recipients;
+               findRecipients(connection, std::vector<std::string>(), recipients);
+               BOOST_FOREACH(const ConnectionPtr& recipient, recipients)
+               {
+                  bool wanted;
+                  {
+                     boost::lock_guard<boost::mutex> lock(mutex);
+                     wanted = !recipient->subscribed || recipient->topics.count(tokens[1]) ||
+                        recipient->topics.count(PLAYERNSD_ALL_TOPICS);
+                  }
+                  if (wanted)
+                     send(recipient, frame, &payload[0], length);
+               }
+            }
+            else if (tokens[0] == "msgrange" && tokens.size() == 3)
+            {
+               std::size_t length = boost::lexical_cast<std::size_t>(tokens[2]);
+               if (!readPayload(connection, buffer, length, payload))
+                  break;
+               double radius = boost::lexical_cast<double>(tokens[1]);
+               std::vector<ConnectionPtr> recipients;
+               bool positioned;
+               {
+                  boost::lock_guard<boost::mutex> lock(mutex);
+                  double x, y;
+                  std::vector<std::string> ids;
+                  positioned = grid.Find(connection->id, x, y);
+                  if (positioned)
+                     grid.Query(x, y, radius, ids);
+                  BOOST_FOREACH(const std::string& id, ids)
+                     if (id != connection->id)
+                        recipients.push_back(clients[id]);
+               }
+               // Without a position of its own the sender reaches everyone.
+               if (!positioned)
+                  findRecipients(connection, std::vector<std::string>(), recipients);
+               std::string frame = "msgbin " + connection->id + " " + tokens[2] + "\n";
+               BOOST_FOREACH(const ConnectionPtr& recipient, recipients)
+                  send(recipient, frame, &payload[0], length);
+            }
+            else if (tokens[0] == "tick" && tokens.size() == 2)
+            {
+               uint32_t tick = boost::lexical_cast<uint32_t>(tokens[1]);
+               boost::unique_lock<boost::mutex> lock(tickMutex);
+               connection->tick = tick;
+               bool joined = ticking.insert(connection).second;
+               if (!releaseTicks() && joined && releasedAny && tick <= released)
+                  // Joining behind the others, its tick is already over.
+                  send(connection, "tick " + boost::lexical_cast<std::string>(released) + "\n");
+               // What the client sends next is for a later tick, which waits
+               // until every client has finished this one.
+               while (!(releasedAny && released >= tick))
+                  tickReleased.wait(lock);
+            }
+            else if (tokens[0] == "subscribe")
+            {
+               boost::lock_guard<boost::mutex> lock(mutex);
+               connection->topics = std::set<std::string>(tokens.begin() + 1, tokens.end());
+               connection->subscribed = true;
+            }
+            else if (tokens[0] == "propset" && tokens.size() >= 2)
+            {
+               std::size_t start = tokens[0].size() + tokens[1].size() + 2;
+               std::string value = start < line.size() ? line.substr(start) : std::string();
+               std::vector<ConnectionPtr> watchers;
+               {
+                  boost::lock_guard<boost::mutex> lock(mutex);
+                  if (tokens[1] == "self.position")
+                  {
+                     // "x y a", as set by the driver from its position2d device.
+                     std::istringstream ss(value);
+                     double x, y;
+                     if (ss >> x >> y)
+                        grid.Update(connection->id, x, y);
+                  }
+                  std::map<std::string, std::string>::iterator it = properties.find(tokens[1]);
+                  if (it != properties.end() && it->second == value)
+                     continue;
+                  properties[tokens[1]] = value;
+                  for (std::map<std::string, ConnectionPtr>::iterator it = clients.begin(); it != clients.end(); ++it)
+                     if (watches(it->second->watched, tokens[1]))
+                        watchers.push_back(it->second);
+               }
+               BOOST_FOREACH(const ConnectionPtr& watcher, watchers)
+                  send(watcher, "propchanged " + tokens[1] + " " + value + "\n");
+            }
+            else if (tokens[0] == "propwatch")
+            {
+               // Reply with the current values of the watched properties.
+               std::string reply;
+               {
+                  boost::lock_guard<boost::mutex> lock(mutex);
+                  connection->watched = std::set<std::string>(tokens.begin() + 1, tokens.end());
+                  for (std::map<std::string, std::string>::iterator it = properties.begin(); it != properties.end(); ++it)
+                     if (watches(connection->watched, it->first))
+                        reply += "propchanged " + it->first + " " + it->second + "\n";
+               }
+               if (!reply.empty())
+                  send(connection, reply);
+            }
+            else if (tokens[0] == "propget" && tokens.size() == 2)
+            {
+               std::string reply;
+               {
+                  boost::lock_guard<boost::mutex> lock(mutex);
+                  std::map<std::string, std::string>::iterator it = properties.find(tokens[1]);
+                  reply = it == properties.end() ? std::string("error propertynotexist\n") :
+                     "propval " + it->first + " " + it->second + "\n";
+               }
+               send(connection, reply);
+            }
+            else if (tokens[0] == "listclients")
+            {
+               std::string reply("listclients");
+               {
+                  boost::lock_guard<boost::mutex> lock(mutex);
+                  for (std::map<std::string, ConnectionPtr>::iterator it = clients.begin(); it != clients.end(); ++it)
+                     reply += " " + it->first;
+               }
+               send(connection, reply + "\n");
+            }
+            else if (tokens[0] == "shmattach" && tokens.size() == 3)
+            {
+               if (connection->stream.AttachSharedMemory(tokens[1]))
+               {
+                  // The reply is the last frame on the socket in each direction.
+                  boost::lock_guard<boost::mutex> lock(connection->writeMutex);
+                  boost::asio::write(connection->stream, boost::asio::buffer(std::string("shmready\n")), error);
+                  connection->stream.UseSharedMemoryForWrites();
+                  connection->stream.UseSharedMemoryForReads();
+                  std::cout << connection->id << " switched to shared memory" << std::endl;
+               }
+               else
+                  send(connection, "shmrefused\n");
+            }
+            else
+            {
+               send(connection, "error unknowncommand\n");
+            }
+         }
+
+         if (!connection->id.empty())
+         {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            clients.erase(connection->id);
+            grid.Remove(connection->id);
+            std::cout << connection->id << " disconnected" << std::endl;
+         }
+         {
+            // Nobody waits for a client that has gone.
+            boost::lock_guard<boost::mutex> lock(tickMutex);
+            if (ticking.erase(connection))
+               releaseTicks();
+         }
+         boost::lock_guard<boost::mutex> lock(connection->writeMutex);
+         connection->stream.Close();
+      }
+
+      boost::asio::io_service ioService;
+      boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol> acceptor;
+      /** Guards the client table, properties and subscriptions. */
+      boost::mutex mutex;
+      std::map<std::string, ConnectionPtr> clients;
+      std::map<std::string, std::string> properties;
+      /** The positions of the clients that have set one. */
+      PlayerNSDGrid grid;
+      /** Guards the clients marking ticks and the last tick they all finished. */
+      boost::mutex tickMutex;
+      boost::condition_variable tickReleased;
+      std::set<ConnectionPtr> ticking;
+      bool releasedAny;
+      uint32_t released;
+};
+
+int main(int argc, char *argv[])
+{
+   if (argc != 2)
+   {
+      std::cerr << "Usage: " << argv[0] << " <port | unix:path>" << std::endl;
+      return 1;
+   }
+   try
+   {
+      Peer peer(argv[1]);
+      peer.Run();
+   }
+   catch (std::exception& e)
+   {
+      std::cerr << "Exception: " << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
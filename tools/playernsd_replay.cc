@@ -0,0 +1,292 @@
+/**
+ * Copyright (C) 2011 The University of York
+ * Author(s):
+ *   Tai Chi Minh Ralph Eastwood <tcmreastwood@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 1, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ *
+ * \brief playernsd traffic replayer
+ * \author Tai Chi Minh Ralph Eastwood
+ * \author University of York
+ *
+ * \section Description
+ *
+ * Plays back a recording made with the record_dir driver option (or
+ * PlayerNSDClient::Record), at the original speed or as fast as possible.
+ *
+ *    ./playernsd_replay --dump robot1.nsdrec
+ *       Lists the recorded frames.
+ *    ./playernsd_replay --serve 9999 robot1.nsdrec
+ *       Stands in for the daemon: sends the frames the client received to
+ *       the first client that connects (e.g. the driver, so that a recorded
+ *       workload runs through its Handler and publishing path).
+ *    ./playernsd_replay --send localhost 9999 robot1.nsdrec
+ *       Stands in for the client: sends the frames the client sent to a
+ *       daemon (e.g. playernsd_peer).
+ *
+ * --fast replays without waiting between frames and --from <seconds>
+ * starts part way into the recording (after replaying the handshake).
+ * Anything received from the other end is read and discarded.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#include "playernsd_client.h"
+#include "playernsd_recorder.h"
+
+/** Seconds to wait for the other end to close once the replay is done. */
+#define PLAYERNSD_REPLAY_LINGER 2
+
+typedef boost::asio::generic::stream_protocol::socket Socket;
+
+static uint64_t monotonicNanoseconds()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Reads and discards everything from the other end until it closes.
+ */
+static void drain(Socket *socket, uint64_t *received)
+{
+   char buffer[65536];
+   boost::system::error_code error;
+   while (!error)
+      *received += socket->read_some(boost::asio::buffer(buffer), error);
+}
+
+/**
+ * Gets the bytes to replay for a record.  The shared memory transport is
+ * not replayed, so its handshake is dropped and the feature removed from
+ * the greetings.
+ * \return false if the record is skipped.
+ */
+static bool replayFrame(const PlayerNSDRecording::Record& record, std::string& frame)
+{
+   frame.assign(record.data, record.length);
+   if (record.continuation)
+      return true;
+   if (!frame.compare(0, 9, "shmattach") || !frame.compare(0, 8, "shmready") ||
+      !frame.compare(0, 10, "shmrefused"))
+      return false;
+   if (!frame.compare(0, 10, "greetings "))
+   {
+      std::vector<std::string> tokens;
+      PlayerNSDClient::Tokenise(frame.substr(0, frame.find('\n')), tokens);
+      frame.clear();
+      for (std::size_t i = 0; i < tokens.size(); i++)
+         if (tokens[i] != PLAYERNSD_FEATURE_SHM)
+            frame += (frame.empty() ? "" : " ") + tokens[i];
+      frame += "\n";
+   }
+   return true;
+}
+
+/**
+ * Writes the recorded frames in one direction to a socket.
+ */
+static void replay(PlayerNSDRecording& recording, PlayerNSDRecorder::Direction direction,
+   Socket& socket, bool fast, uint64_t from)
+{
+   PlayerNSDRecording::Record record;
+   std::string frame;
+   uint64_t frames = 0, bytes = 0;
+   if (from)
+   {
+      // The handshake is always replayed, then skip ahead.
+      while (recording.Next(record))
+      {
+         if (record.direction == direction && replayFrame(record, frame))
+            boost::asio::write(socket, boost::asio::buffer(frame));
+         if (record.direction == PlayerNSDRecorder::Inbound && !record.continuation &&
+            !strncmp(record.data, "registered", std::min<std::size_t>(record.length, 10)))
+            break;
+      }
+      recording.Seek(from);
+   }
+
+   uint64_t start = monotonicNanoseconds();
+   uint64_t first = 0;
+   bool started = false;
+   while (recording.Next(record))
+   {
+      if (record.direction != direction || !replayFrame(record, frame))
+         continue;
+      if (!started)
+      {
+         first = record.time;
+         started = true;
+      }
+      if (!fast)
+      {
+         uint64_t due = start + (record.time - first);
+         uint64_t now = monotonicNanoseconds();
+         if (due > now)
+            boost::this_thread::sleep(boost::posix_time::microseconds((due - now) / 1000));
+      }
+      boost::system::error_code error;
+      boost::asio::write(socket, boost::asio::buffer(frame), error);
+      if (error)
+      {
+         std::cerr << "Connection closed: " << error.message() << std::endl;
+         break;
+      }
+      frames++;
+      bytes += frame.size();
+   }
+   double elapsed = (monotonicNanoseconds() - start) * 1e-9;
+   std::cout << "Replayed " << frames << " frames, " << bytes << " bytes in " << elapsed << " s ("
+      << (elapsed > 0 ? bytes / elapsed / 1e6 : 0) << " MB/s)" << std::endl;
+}
+
+static void dump(PlayerNSDRecording& recording)
+{
+   PlayerNSDRecording::Record record;
+   while (recording.Next(record))
+   {
+      std::string line(record.data, record.length);
+      line = line.substr(0, line.find('\n'));
+      if (record.continuation)
+         line = "...";
+      printf("%12.6f %s %8u %s\n", record.time * 1e-9,
+         record.direction == PlayerNSDRecorder::Inbound ? "<" : ">", record.length,
+         line.substr(0, 60).c_str());
+   }
+}
+
+/**
+ * Makes a generic endpoint from a port or a unix: path.
+ */
+static boost::asio::generic::stream_protocol::endpoint makeEndpoint(boost::asio::io_service& ioService,
+   const std::string& host, const std::string& port)
+{
+   if (!port.compare(0, strlen(PLAYERNSD_UNIX_PREFIX), PLAYERNSD_UNIX_PREFIX))
+      return boost::asio::local::stream_protocol::endpoint(port.substr(strlen(PLAYERNSD_UNIX_PREFIX)));
+   if (host.empty())
+      return tcp::endpoint(tcp::v4(), atoi(port.c_str()));
+   tcp::resolver resolver(ioService);
+   return resolver.resolve(tcp::resolver::query(host, port))->endpoint();
+}
+
+static void usage(const char *name)
+{
+   std::cerr << "Usage: " << name << " [--fast] [--from <seconds>] --dump <recording>\n"
+      << "       " << name << " [--fast] [--from <seconds>] --serve <port | unix:path> <recording>\n"
+      << "       " << name << " [--fast] [--from <seconds>] --send <host> <port | unix:path> <recording>"
+      << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+   std::string mode, host, port;
+   bool fast = false;
+   uint64_t from = 0;
+   int i = 1;
+   for (; i < argc - 1; i++)
+   {
+      std::string arg = argv[i];
+      if (arg == "--fast")
+         fast = true;
+      else if (arg == "--from" && i + 1 < argc - 1)
+         from = (uint64_t)(atof(argv[++i]) * 1e9);
+      else if (arg == "--dump")
+         mode = arg;
+      else if (arg == "--serve" && i + 1 < argc - 1)
+      {
+         mode = arg;
+         port = argv[++i];
+      }
+      else if (arg == "--send" && i + 2 < argc - 1)
+      {
+         mode = arg;
+         host = argv[++i];
+         port = argv[++i];
+      }
+      else
+         break;
+   }
+   if (mode.empty() || i != argc - 1)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   PlayerNSDRecording recording;
+   if (!recording.Open(argv[argc - 1]))
+   {
+      std::cerr << "Unable to read recording " << argv[argc - 1] << std::endl;
+      return 1;
+   }
+   if (!recording.HasIndex())
+      std::cerr << "Recording was not closed, seeking without an index" << std::endl;
+   if (mode == "--dump")
+   {
+      recording.Seek(from);
+      dump(recording);
+      return 0;
+   }
+
+   try
+   {
+      boost::asio::io_service ioService;
+      Socket socket(ioService);
+      if (mode == "--serve")
+      {
+         if (!port.compare(0, strlen(PLAYERNSD_UNIX_PREFIX), PLAYERNSD_UNIX_PREFIX))
+            unlink(port.substr(strlen(PLAYERNSD_UNIX_PREFIX)).c_str());
+         boost::asio::generic::stream_protocol::endpoint endpoint = makeEndpoint(ioService, "", port);
+         boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol> acceptor(ioService);
+         acceptor.open(endpoint.protocol());
+         acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+         acceptor.bind(endpoint);
+         acceptor.listen();
+         acceptor.accept(socket);
+      }
+      else
+      {
+         socket.connect(makeEndpoint(ioService, host, port));
+      }
+      uint64_t received = 0;
+      boost::thread drainer(drain, &socket, &received);
+      replay(recording, mode == "--serve" ? PlayerNSDRecorder::Inbound : PlayerNSDRecorder::Outbound,
+         socket, fast, from);
+      // Let the other end read everything before the connection goes away.
+      boost::system::error_code error;
+      socket.shutdown(boost::asio::socket_base::shutdown_send, error);
+      if (!drainer.timed_join(boost::posix_time::seconds(PLAYERNSD_REPLAY_LINGER)))
+      {
+         socket.shutdown(boost::asio::socket_base::shutdown_both, error);
+         drainer.join();
+      }
+      std::cout << "Received " << received << " bytes" << std::endl;
+   }
+   catch (std::exception& e)
+   {
+      std::cerr << "Exception: " << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}